@@ -1,96 +1,232 @@
 #include <defs.h>
 #include <mram.h>
+#include <alloc.h>
 #include <perfcounter.h>
 #include <stdint.h>
-#include <stdio.h>
 #include <barrier.h>
 #include <vmutex.h>
 
-// Total number of points
-#define TOTAL_NUM_POINTS 1024
-#define NR_TASKLETS 4
+#include "common.h"
 
-__mram_noinit uint8_t points[TOTAL_NUM_POINTS * 2];
-__mram uint64_t distance[TOTAL_NUM_POINTS];
-__dma_aligned uint64_t x_sum[NR_TASKLETS];
-__dma_aligned uint64_t y_sum[NR_TASKLETS];
-__host uint64_t total[2];
+// The tasklet count comes from the build, see common.h
+#ifndef NR_TASKLETS
+#error "NR_TASKLETS must be set by the build, e.g. -DNR_TASKLETS=16"
+#endif
+
+// Number of points resident on this DPU, set by the host after each load
+__host uint32_t num_points;
+
+// Number of clusters to reduce, broadcast by the host before each launch
+__host uint32_t num_centroids;
+
+// Per cluster coordinate sums and point counts of this DPU, DIM sums per cluster.
+// A sum is at most MAX_POINTS_PER_DPU * 255 and fits in 32 bits.
+__host uint32_t sums[MAX_CENTROID_VALUES];
+__host uint32_t counts[MAX_CENTROIDS];
+
+// Cycles of this launch, from the start of tasklet 0 to the end of the reduction
+__host uint64_t cycles;
+
+// WRAM for the partial results of all tasklets, beyond it the clusters are reduced a chunk at a time
+#define PARTIALS_BYTES (8 << 10)
+
+// Per tasklet partial results in WRAM, num_centroids * DIM sums followed by num_centroids counts
+uint32_t *tasklet_partials[NR_TASKLETS];
 
 // Barrier for synchronization
 BARRIER_INIT(my_barrier, NR_TASKLETS);
 
-// Function to sum x and y values
-void sum_xy_values(int A, uint64_t *x_sum_tasklet, uint64_t *y_sum_tasklet) {
-    *x_sum_tasklet += points[A];
-    *y_sum_tasklet += points[A + 1];
+// Add the DIM coordinates of a point to the sums of its cluster
+void sum_values(uint8_t *point, uint32_t *sum) {
+    #pragma unroll
+    for (uint32_t d = 0; d < DIM; d++) {
+        sum[d] += point[d];
+    }
 }
 
-// Find the closest point to the total average in each tasklet then return the distance and index
-void find_closest_point(uint64_t total_x_sum, uint64_t total_y_sum, uint64_t *min_distance, uint64_t *min_index, uint32_t tasklet_id) {
-    uint64_t min_dist = UINT64_MAX;
-    uint64_t min_idx = 0;
-
-    // Calculate the number of points per tasklet
-    int num_points_per_tasklet = TOTAL_NUM_POINTS / NR_TASKLETS;
-    for (int i = tasklet_id * num_points_per_tasklet * 2; i < (tasklet_id + 1) * num_points_per_tasklet * 2; i += 2) {
-        uint64_t dx = total_x_sum - points[i];
-        uint64_t dy = total_y_sum - points[i + 1];
-        uint64_t dist = dx * dx + dy * dy;
-        if (dist < min_dist) {
-            min_dist = dist;
-            min_idx = i / 2;
+/*
+    Merge the num_values partial results of all tasklets into those of tasklet 0, pairwise in
+    log2(NR_TASKLETS) rounds separated by barriers
+*/
+void merge_partials(uint32_t tasklet_id, uint32_t *partials, uint32_t num_values) {
+    // In each round a tasklet adds the partial results of the tasklet step above it
+    for (uint32_t step = 1; step < NR_TASKLETS; step *= 2) {
+        barrier_wait(&my_barrier);
+        if (tasklet_id % (2 * step) == 0 && tasklet_id + step < NR_TASKLETS) {
+            uint32_t *other = tasklet_partials[tasklet_id + step];
+            for (uint32_t v = 0; v < num_values; v++) {
+                partials[v] += other[v];
+            }
         }
     }
 
-    // Store the result in the global arrays
-    min_distance[tasklet_id] = min_dist;
-    min_index[tasklet_id] = min_idx;
+    // Barrier to ensure the reduction has finished
+    barrier_wait(&my_barrier);
 }
 
-int main() {
-    // Initialize performance counter
-    perfcounter_config(COUNT_CYCLES, true);
-
-    // Get tasklet ID
-    uint32_t tasklet_id = me();
+/*
+    Every tasklet sums the tiles it takes in turn into its own partial results, the partial
+    results are then merged with merge_partials
+*/
+void sum_by_tiles(uint32_t tasklet_id, __mram_ptr uint8_t *points, __mram_ptr uint16_t *labels) {
+    uint32_t num_values = num_centroids * (DIM + 1);
+
+    // Initialize the partial results of this tasklet
+    uint32_t *partials = mem_alloc(num_values * sizeof(uint32_t));
+    for (uint32_t v = 0; v < num_values; v++) {
+        partials[v] = 0;
+    }
+    uint32_t *local_sums = partials;
+    uint32_t *local_counts = &partials[num_centroids * DIM];
+    tasklet_partials[tasklet_id] = partials;
+
+    // WRAM tiles of this tasklet
+    uint8_t *point_block = mem_alloc(TILE_POINTS * DIM);
+    uint16_t *label_block = mem_alloc(TILE_POINTS * sizeof(uint16_t));
+
+    // Sum the coordinates of every point into its cluster, tasklets take the tiles in turn.
+    // When the tiles do not divide evenly the first tasklets take one tile more.
+    uint32_t num_blocks = (num_points + TILE_POINTS - 1) / TILE_POINTS;
+    for (uint32_t b = tasklet_id; b < num_blocks; b += NR_TASKLETS) {
+        mram_read(&points[b * TILE_POINTS * DIM], point_block, TILE_POINTS * DIM);
+        mram_read(&labels[b * TILE_POINTS], label_block, TILE_POINTS * sizeof(uint16_t));
+
+        // The last block may be partially filled
+        uint32_t count = num_points - b * TILE_POINTS;
+        if (count > TILE_POINTS) {
+            count = TILE_POINTS;
+        }
 
-    // Each Tasklet handles TOTAL_NUM_POINTS/NR_TASKLETS points
-    int num_points_per_tasklet = TOTAL_NUM_POINTS / NR_TASKLETS;
+        for (uint32_t i = 0; i < count; i++) {
+            uint16_t label = label_block[i];
+            // Points that were never assigned do not belong to any cluster
+            if (label >= num_centroids) {
+                continue;
+            }
+            sum_values(&point_block[i * DIM], &local_sums[label * DIM]);
+            local_counts[label]++;
+        }
+    }
 
-    // Initialize sum variables for this tasklet
-    __dma_aligned uint64_t local_x_sum = 0;
-    __dma_aligned uint64_t local_y_sum = 0;
+    merge_partials(tasklet_id, partials, num_values);
 
-    // Sum the x and y values
-    for (int i = tasklet_id * num_points_per_tasklet * 2; i < (tasklet_id + 1) * num_points_per_tasklet * 2; i += 2) {
-        sum_xy_values(i, &local_x_sum, &local_y_sum);
+    // All tasklets copy the totals, the totals of the previous launch are overwritten
+    uint32_t *totals = tasklet_partials[0];
+    for (uint32_t v = tasklet_id; v < num_centroids * DIM; v += NR_TASKLETS) {
+        sums[v] = totals[v];
     }
+    for (uint32_t k = tasklet_id; k < num_centroids; k += NR_TASKLETS) {
+        counts[k] = totals[num_centroids * DIM + k];
+    }
+}
 
-    // Store the result in the global arrays
-    x_sum[tasklet_id] = local_x_sum;
-    y_sum[tasklet_id] = local_y_sum;
+/*
+    sum_by_tiles a chunk of clusters at a time, for when the partial results of every tasklet
+    for all clusters do not fit in WRAM, i.e. for many clusters of wide points
+        1. A chunk is as many clusters as the partial results of all tasklets fit in
+           PARTIALS_BYTES, at least one
+        2. Tasklets take the tiles in turn and sum the points of the chunk's clusters into
+           their own partial results, a tile without any of them skips reading its points
+        3. The partial results are merged with merge_partials and copied to sums and counts
+    Every chunk reads the labels again, but every tasklet only reads its own tiles.
+*/
+void sum_by_chunks(uint32_t tasklet_id, __mram_ptr uint8_t *points, __mram_ptr uint16_t *labels) {
+    // A single cluster of 128 coordinates takes 516 bytes per tasklet, beyond the budget with 16 tasklets
+    uint32_t chunk = PARTIALS_BYTES / (NR_TASKLETS * (DIM + 1) * sizeof(uint32_t));
+    if (chunk == 0) {
+        chunk = 1;
+    }
+    uint32_t *partials = mem_alloc(chunk * (DIM + 1) * sizeof(uint32_t));
+    tasklet_partials[tasklet_id] = partials;
+
+    // WRAM tiles of this tasklet
+    uint8_t *point_block = mem_alloc(TILE_POINTS * DIM);
+    uint16_t *label_block = mem_alloc(TILE_POINTS * sizeof(uint16_t));
+
+    uint32_t num_blocks = (num_points + TILE_POINTS - 1) / TILE_POINTS;
+    for (uint32_t first = 0; first < num_centroids; first += chunk) {
+        uint32_t chunk_centroids = num_centroids - first < chunk ? num_centroids - first : chunk;
+        uint32_t num_values = chunk_centroids * (DIM + 1);
+        uint32_t *local_sums = partials;
+        uint32_t *local_counts = &partials[chunk_centroids * DIM];
+        for (uint32_t v = 0; v < num_values; v++) {
+            partials[v] = 0;
+        }
 
-    // Barrier to ensure all tasklets have finished calculating
-    barrier_wait(&my_barrier);
+        for (uint32_t b = tasklet_id; b < num_blocks; b += NR_TASKLETS) {
+            mram_read(&labels[b * TILE_POINTS], label_block, TILE_POINTS * sizeof(uint16_t));
+
+            // The last block may be partially filled
+            uint32_t count = num_points - b * TILE_POINTS;
+            if (count > TILE_POINTS) {
+                count = TILE_POINTS;
+            }
+
+            // Labels below the chunk wrap around, like unassigned points they fall outside it
+            uint32_t in_chunk = 0;
+            for (uint32_t i = 0; i < count; i++) {
+                in_chunk |= (uint32_t)(label_block[i] - first) < chunk_centroids;
+            }
+            if (!in_chunk) {
+                continue;
+            }
+
+            mram_read(&points[b * TILE_POINTS * DIM], point_block, TILE_POINTS * DIM);
+            for (uint32_t i = 0; i < count; i++) {
+                uint32_t k = label_block[i] - first;
+                if (k >= chunk_centroids) {
+                    continue;
+                }
+                sum_values(&point_block[i * DIM], &local_sums[k * DIM]);
+                local_counts[k]++;
+            }
+        }
 
-    // Tasklet 0 aggregates the results
-    if (tasklet_id == 0) {
+        merge_partials(tasklet_id, partials, num_values);
 
-        for (int i = 0; i < NR_TASKLETS; i++) {
-            total[0] += x_sum[i];
-            total[1] += y_sum[i];
+        uint32_t *totals = tasklet_partials[0];
+        for (uint32_t v = tasklet_id; v < chunk_centroids * DIM; v += NR_TASKLETS) {
+            sums[first * DIM + v] = totals[v];
         }
+        for (uint32_t k = tasklet_id; k < chunk_centroids; k += NR_TASKLETS) {
+            counts[first + k] = totals[chunk_centroids * DIM + k];
+        }
+
+        // Tasklet 0 clears its partial results for the next chunk once all tasklets copied them
+        barrier_wait(&my_barrier);
     }
+}
+
+int main() {
+    // Get tasklet ID
+    uint32_t tasklet_id = me();
 
-    // Print the total x and y sum
+    // Tasklet 0 resets the cycle counter, a second reset by another tasklet would lose cycles.
+    // It also resets the WRAM heap, which is only reset by a load and this binary may be
+    // launched again without one, the barrier keeps the tiles from being taken before it.
     if (tasklet_id == 0) {
-        printf("Total x sum: %lu\n", total[0]);
-        printf("Total y sum: %lu\n", total[1]);
+        mem_reset();
+        perfcounter_config(COUNT_CYCLES, true);
+    }
+    barrier_wait(&my_barrier);
+
+    // Points and their nearest centroid are resident in the MRAM heap
+    __mram_ptr uint8_t *points = (__mram_ptr uint8_t *)DPU_MRAM_HEAP_POINTER + POINTS_OFFSET;
+    __mram_ptr uint16_t *labels = (__mram_ptr uint16_t *)((__mram_ptr uint8_t *)DPU_MRAM_HEAP_POINTER + LABELS_OFFSET);
+
+    // num_centroids is the same for every tasklet, so they all take the same path
+    if (num_centroids * (DIM + 1) * sizeof(uint32_t) * NR_TASKLETS <= PARTIALS_BYTES) {
+        sum_by_tiles(tasklet_id, points, labels);
+    } else {
+        sum_by_chunks(tasklet_id, points, labels);
     }
 
     // Barrier to ensure all tasklets have finished aggregating
     barrier_wait(&my_barrier);
 
+    if (tasklet_id == 0) {
+        cycles = perfcounter_get();
+    }
 
     return 0;
 }
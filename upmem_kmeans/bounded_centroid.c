@@ -0,0 +1,217 @@
+#include <defs.h>
+#include <mram.h>
+#include <alloc.h>
+#include <perfcounter.h>
+#include <stdint.h>
+#include <barrier.h>
+#include <vmutex.h>
+
+#include "common.h"
+
+// The tasklet count comes from the build, see common.h
+#ifndef NR_TASKLETS
+#error "NR_TASKLETS must be set by the build, e.g. -DNR_TASKLETS=16"
+#endif
+
+// Number of points resident on this DPU, set by the host after each load
+__host uint32_t num_points;
+
+// All centroids, DIM Q16.16 coordinates each, and their squared norms in Q32.32,
+// broadcast by the host before each launch
+__host uint32_t num_centroids;
+__host uint32_t centroids[MAX_CENTROID_VALUES];
+__host int64_t centroid_norms[MAX_CENTROIDS];
+
+// Q16.16 distance every centroid moved since the previous launch, rounded up, and the largest of them
+__host uint32_t centroid_drift[MAX_CENTROIDS];
+__host uint32_t max_drift;
+
+// Half the Q16.16 distance from every centroid to the nearest other centroid, rounded down
+__host uint32_t half_gap[MAX_CENTROIDS];
+
+// Number of points whose nearest centroid changed, and of distances the bounds made unnecessary
+__host uint32_t changed;
+__host uint32_t skipped;
+
+// Cycles of this launch, from the start of tasklet 0 to the end of the reduction
+__host uint64_t cycles;
+uint32_t changed_tasklet[NR_TASKLETS];
+uint32_t evaluated_tasklet[NR_TASKLETS];
+
+// Barrier for synchronization
+BARRIER_INIT(my_barrier, NR_TASKLETS);
+
+// Largest r with r * r <= x, bit by bit with shifts and adds only
+uint32_t sqrt_floor(uint64_t x) {
+    uint64_t root = 0;
+    uint64_t bit = 1ULL << 62;
+    while (bit > x) {
+        bit >>= 2;
+    }
+    while (bit != 0) {
+        if (x >= root + bit) {
+            x -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return root;
+}
+
+// Smallest r with r * r >= x
+uint32_t sqrt_ceil(uint64_t x) {
+    uint32_t root = sqrt_floor(x);
+    return (uint64_t)root * root < x ? root + 1 : root;
+}
+
+// |c|^2 - 2 p.c of a point and centroid j, the squared distance without |p|^2, in Q32.32
+int64_t partial_distance(uint8_t *point, uint32_t j) {
+    uint32_t *centroid = &centroids[j * DIM];
+    uint64_t dot = 0;
+    #pragma unroll
+    for (uint32_t d = 0; d < DIM; d++) {
+        dot += point[d] * centroid[d];
+    }
+    return centroid_norms[j] - (int64_t)(dot << (FIXED_SHIFT + 1));
+}
+
+/*
+    Assign a point with the Hamerly bounds of the previous launch
+        1. Move the bounds by the centroid drift: upper grows by the drift of the assigned
+           centroid, lower shrinks by the largest drift
+        2. The label stays when upper is below lower or below half the gap to the nearest
+           other centroid, first with the moved upper bound and then with the exact one
+        3. Otherwise compare all centroids and reset both bounds to the exact distances
+    The tests are strict and the bounds are rounded outwards, so the label is always the one
+    nearest_centroid would find, ties included. A point without a label takes step 3.
+    Returns the number of distances evaluated.
+*/
+uint32_t assign_point(uint8_t *point, uint16_t *label, struct point_bounds *bounds) {
+    // |p|^2 in Q32.32 completes the partial distances to squared distances
+    uint32_t point_norm = 0;
+    #pragma unroll
+    for (uint32_t d = 0; d < DIM; d++) {
+        point_norm += point[d] * point[d];
+    }
+    uint64_t norm = (uint64_t)point_norm << (2 * FIXED_SHIFT);
+
+    uint16_t current = *label;
+    int64_t current_distance = 0;
+    if (current < num_centroids) {
+        uint32_t upper = bounds->upper + centroid_drift[current];
+        if (upper < bounds->upper) {
+            upper = UINT32_MAX;
+        }
+        uint32_t lower = bounds->lower > max_drift ? bounds->lower - max_drift : 0;
+        uint32_t limit = lower > half_gap[current] ? lower : half_gap[current];
+        bounds->lower = lower;
+        if (upper < limit) {
+            bounds->upper = upper;
+            return 0;
+        }
+
+        current_distance = partial_distance(point, current);
+        bounds->upper = sqrt_ceil(norm + current_distance);
+        if (bounds->upper < limit) {
+            return 1;
+        }
+    }
+
+    // The scan reuses the distance of the tightened bound, so it evaluates num_centroids distances in all
+    int64_t min_distance = INT64_MAX;
+    int64_t second_distance = INT64_MAX;
+    uint16_t min_centroid = 0;
+    for (uint32_t j = 0; j < num_centroids; j++) {
+        int64_t distance = j == current ? current_distance : partial_distance(point, j);
+        if (distance < min_distance) {
+            second_distance = min_distance;
+            min_distance = distance;
+            min_centroid = j;
+        } else if (distance < second_distance) {
+            second_distance = distance;
+        }
+    }
+    *label = min_centroid;
+    bounds->upper = sqrt_ceil(norm + min_distance);
+    bounds->lower = second_distance == INT64_MAX ? UINT32_MAX : sqrt_floor(norm + second_distance);
+    return num_centroids;
+}
+
+int main() {
+    // Get tasklet ID
+    uint32_t tasklet_id = me();
+
+    // Tasklet 0 resets the cycle counter, a second reset by another tasklet would lose cycles.
+    // It also resets the WRAM heap, which is only reset by a load and this binary may be
+    // launched again without one, the barrier keeps the tiles from being taken before it.
+    if (tasklet_id == 0) {
+        mem_reset();
+        perfcounter_config(COUNT_CYCLES, true);
+    }
+    barrier_wait(&my_barrier);
+
+    // Points, the labels and the bounds of the previous launch are resident in the MRAM heap
+    __mram_ptr uint8_t *points = (__mram_ptr uint8_t *)DPU_MRAM_HEAP_POINTER + POINTS_OFFSET;
+    __mram_ptr uint16_t *labels = (__mram_ptr uint16_t *)((__mram_ptr uint8_t *)DPU_MRAM_HEAP_POINTER + LABELS_OFFSET);
+    __mram_ptr struct point_bounds *bounds = (__mram_ptr struct point_bounds *)((__mram_ptr uint8_t *)DPU_MRAM_HEAP_POINTER + BOUNDS_OFFSET);
+
+    // WRAM tiles of this tasklet
+    uint8_t *point_block = mem_alloc(TILE_POINTS * DIM);
+    uint16_t *label_block = mem_alloc(TILE_POINTS * sizeof(uint16_t));
+    struct point_bounds *bound_block = mem_alloc(BOUND_POINTS * sizeof(struct point_bounds));
+    uint32_t local_changed = 0;
+    uint32_t local_evaluated = 0;
+
+    // Tasklets take the tiles in turn, a tile is never shared so no two tasklets write the same labels.
+    // When the tiles do not divide evenly the first tasklets take one tile more.
+    uint32_t num_blocks = (num_points + TILE_POINTS - 1) / TILE_POINTS;
+    for (uint32_t b = tasklet_id; b < num_blocks; b += NR_TASKLETS) {
+        mram_read(&points[b * TILE_POINTS * DIM], point_block, TILE_POINTS * DIM);
+        mram_read(&labels[b * TILE_POINTS], label_block, TILE_POINTS * sizeof(uint16_t));
+
+        // The last block may be partially filled
+        uint32_t count = num_points - b * TILE_POINTS;
+        if (count > TILE_POINTS) {
+            count = TILE_POINTS;
+        }
+
+        // The bounds of the tile in sub-tiles, only the bounds of resident points are written
+        for (uint32_t first = 0; first < count; first += BOUND_POINTS) {
+            uint32_t bound_count = count - first < BOUND_POINTS ? count - first : BOUND_POINTS;
+            mram_read(&bounds[b * TILE_POINTS + first], bound_block, bound_count * sizeof(struct point_bounds));
+
+            for (uint32_t i = first; i < first + bound_count; i++) {
+                uint16_t label = label_block[i];
+                local_evaluated += assign_point(&point_block[i * DIM], &label_block[i], &bound_block[i - first]);
+                local_changed += label != label_block[i];
+            }
+
+            mram_write(bound_block, &bounds[b * TILE_POINTS + first], bound_count * sizeof(struct point_bounds));
+        }
+
+        mram_write(label_block, &labels[b * TILE_POINTS], TILE_POINTS * sizeof(uint16_t));
+    }
+
+    changed_tasklet[tasklet_id] = local_changed;
+    evaluated_tasklet[tasklet_id] = local_evaluated;
+
+    // Synchronize all tasklets
+    barrier_wait(&my_barrier);
+
+    // Tasklet 0 aggregates the number of changed labels and skipped distances
+    if (tasklet_id == 0) {
+        uint32_t total_changed = 0;
+        uint32_t total_evaluated = 0;
+        for (int i = 0; i < NR_TASKLETS; i++) {
+            total_changed += changed_tasklet[i];
+            total_evaluated += evaluated_tasklet[i];
+        }
+        changed = total_changed;
+        skipped = num_points * num_centroids - total_evaluated;
+        cycles = perfcounter_get();
+    }
+
+    return 0;
+}
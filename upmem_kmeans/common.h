@@ -0,0 +1,120 @@
+#ifndef _COMMON_H_
+#define _COMMON_H_
+
+/*
+    Definitions shared by the host program and the DPU kernels.
+
+    The data of a k-means run lives in the MRAM heap (DPU_MRAM_HEAP_POINTER) at
+    fixed offsets, so it survives switching between kernels with dpu_load. For the heap to start at the same address in every
+    program, the kernels must not declare __mram variables or use printf.
+*/
+
+/*
+    Coordinates per point on the DPU, every kernel is built once per dimension bucket
+    (make builds nearest_centroid_d2 ... nearest_centroid_d128) so its loops over the
+    coordinates have a compile time trip count and are unrolled. The host pads the points
+    to the next bucket with zero coordinates, which add nothing to distances or sums.
+*/
+#ifndef DIM
+#define DIM 2
+#endif
+#define MAX_DIM 128
+#if DIM < 2 || DIM > MAX_DIM || (DIM & (DIM - 1)) != 0
+#error "DIM must be a power of two between 2 and 128"
+#endif
+
+/*
+    Maximum number of points one DPU holds, bound by the 64 MB of MRAM:
+    at most MAX_POINT_BYTES of coordinates, 2 bytes of label, 8 bytes of distance and
+    8 bytes of distance bounds per point, and 8 bytes of distance sum per tile of at least 4 points,
+    then the 256 KB of a 2-D histogram
+*/
+#define MAX_POINTS_PER_DPU (1 << 21)
+#define MAX_POINT_BYTES (1 << 24)
+
+/*
+    Points streamed between MRAM and WRAM per DMA transfer by each tasklet.
+    A tile of distances is BLOCK_POINTS * 8 bytes and one DMA moves at most 2048 bytes.
+*/
+#ifndef BLOCK_POINTS
+#define BLOCK_POINTS 128
+#endif
+#if BLOCK_POINTS % 4 != 0 || BLOCK_POINTS * 8 > 2048
+#error "BLOCK_POINTS must be a multiple of 4 and at most 256"
+#endif
+
+/*
+    Tasklets per DPU of the kernels, set by the build with -DNR_TASKLETS. The DPU pipeline
+    needs at least 11 tasklets to stay full. The WRAM budgets below (tiles, centroids,
+    partial results) are sized so 24 tasklets with their stacks fit in the 64 KB of WRAM.
+*/
+#if defined(NR_TASKLETS) && (NR_TASKLETS < 1 || NR_TASKLETS > 24)
+#error "NR_TASKLETS must be between 1 and 24"
+#endif
+
+/* Points per tile of the DIM kernels, wide points use fewer points so a tile of coordinates stays within 512 bytes of WRAM */
+#define TILE_POINTS (BLOCK_POINTS * DIM <= 512 ? BLOCK_POINTS : 512 / DIM)
+
+/*
+    Centroids are true cluster means in Q16.16 fixed point, the DPU has no FPU.
+    A mean of uint8_t coordinates is between 0 and 255 << FIXED_SHIFT, so a point
+    coordinate times a centroid coordinate still fits in unsigned 32 bits.
+*/
+#define FIXED_SHIFT 16
+#define FIXED_ONE (1 << FIXED_SHIFT)
+
+/* Maximum number of centroids, and of centroid coordinates the kernels keep in WRAM */
+#define MAX_CENTROIDS 256
+#define MAX_CENTROID_VALUES 4096
+
+/*
+    Distance bounds of the bounded (Hamerly) assignment, Q16.16 Euclidean distances:
+    upper is at least the distance to the assigned centroid and lower at most the distance to
+    any other centroid. The bounds are streamed in sub-tiles of BOUND_POINTS points so the
+    extra WRAM per tasklet stays at 256 bytes.
+*/
+struct point_bounds {
+    uint32_t upper;
+    uint32_t lower;
+};
+#define BOUND_POINTS (TILE_POINTS < 32 ? TILE_POINTS : 32)
+
+/*
+    Occupancy histogram of 2-D points, the count of the points at (x, y) is cell x * HISTOGRAM_SIDE + y.
+    A DPU counts at most MAX_POINTS_PER_DPU points, so a uint32_t count never overflows. The
+    histogram kernel builds it in bands of HISTOGRAM_BAND_ROWS values of x, a band of 16 KB of
+    WRAM, and writes every band to MRAM.
+*/
+#define HISTOGRAM_SIDE 256
+#define HISTOGRAM_CELLS (HISTOGRAM_SIDE * HISTOGRAM_SIDE)
+#define HISTOGRAM_BAND_ROWS 16
+
+/*
+    Distances between queries and the resident points, see distance_matrix.c. A launch takes
+    at most KNN_MAX_QUERIES queries of at most KNN_QUERY_BYTES padded coordinates in total.
+    The top-k mode keeps a heap of k candidates per query in WRAM, at most KNN_MAX_CANDIDATES
+    over all queries of the launch. The matrix mode writes a row of uint32_t distances per
+    query to MATRIX_OFFSET instead, in the MATRIX_BYTES of the squared distances.
+*/
+#define KNN_MAX_QUERIES 256
+#define KNN_QUERY_BYTES 4096
+#define KNN_MAX_CANDIDATES 1024
+struct knn_candidate {
+    uint32_t distance;      // Squared distance, at most MAX_DIM * 255^2
+    uint32_t index;         // Point of the DPU, UINT32_MAX for an empty slot
+};
+
+/* Round a transfer size up to the 8 bytes required by MRAM transfers */
+#define ALIGN8(x) (((x) + 7) & ~7)
+
+/* MRAM heap layout, offsets in bytes, the same for every dimension bucket */
+#define POINTS_OFFSET 0                                                   // uint8_t DIM coordinates per point
+#define LABELS_OFFSET (POINTS_OFFSET + MAX_POINT_BYTES)                   // uint16_t nearest centroid
+#define DISTANCE_OFFSET (LABELS_OFFSET + ALIGN8(MAX_POINTS_PER_DPU * 2))  // uint64_t squared distance
+#define BOUNDS_OFFSET (DISTANCE_OFFSET + MAX_POINTS_PER_DPU * 8)          // struct point_bounds
+#define TILE_SUMS_OFFSET (BOUNDS_OFFSET + MAX_POINTS_PER_DPU * 8)         // uint64_t distance sum per tile
+#define HISTOGRAM_OFFSET (TILE_SUMS_OFFSET + MAX_POINTS_PER_DPU / 4 * 8)  // uint32_t count per histogram cell
+#define MATRIX_OFFSET DISTANCE_OFFSET                                     // uint32_t distance per query and point
+#define MATRIX_BYTES (MAX_POINTS_PER_DPU * 8)
+
+#endif
@@ -0,0 +1,252 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "common.h"
+#include "cpu_engine.h"
+
+/*
+    Centroids split for the 32 bit SIMD multiplies, c = (hi << 16) + lo with hi < 256 and
+    lo < 65536. For every point sum(p * hi) < 2^23 and sum(p * lo) < 2^31 fit in 32 bits, the
+    exact dot product is (sum(p * hi) << 16) + sum(p * lo).
+*/
+struct centroid_table {
+    uint32_t num_centroids;
+    uint32_t dim;
+    int64_t norms[MAX_CENTROIDS];       // |c|^2 in Q32.32
+    int32_t hi[MAX_CENTROID_VALUES];
+    int32_t lo[MAX_CENTROID_VALUES];
+    const int32_t *centroids;
+};
+
+void cpu_engine_init(struct cpu_engine *engine, const uint8_t *points, uint32_t total_num_points, uint32_t dim) {
+    engine->total_num_points = total_num_points;
+    engine->dim = dim;
+    engine->padded_points = (total_num_points + CPU_BLOCK_POINTS - 1) / CPU_BLOCK_POINTS * CPU_BLOCK_POINTS;
+    engine->coords = calloc((size_t)engine->padded_points * dim, sizeof(uint8_t));
+    engine->labels = malloc((size_t)engine->padded_points * sizeof(uint16_t));
+    assert(engine->coords != NULL && engine->labels != NULL);
+
+    for (uint32_t j = 0; j < total_num_points; j++) {
+        for (uint32_t d = 0; d < dim; d++) {
+            engine->coords[(size_t)d * engine->padded_points + j] = points[(size_t)j * dim + d];
+        }
+    }
+    memset(engine->labels, 0xff, (size_t)engine->padded_points * sizeof(uint16_t));
+}
+
+void cpu_engine_free(struct cpu_engine *engine) {
+    free(engine->coords);
+    free(engine->labels);
+}
+
+int cpu_engine_threads(void) {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+#if defined(__AVX512F__)
+
+const char *cpu_engine_kernel(void) {
+    return "avx512";
+}
+
+// Nearest centroid of the 16 points of a block, one point per 32 bit lane
+static void nearest_block(const struct cpu_engine *engine, const struct centroid_table *table, uint32_t first, uint16_t *labels) {
+    const uint8_t *coords = &engine->coords[first];
+    __m512i best[2] = { _mm512_set1_epi64(INT64_MAX), _mm512_set1_epi64(INT64_MAX) };
+    __m512i best_label[2] = { _mm512_setzero_si512(), _mm512_setzero_si512() };
+
+    for (uint32_t j = 0; j < table->num_centroids; j++) {
+        __m512i hi = _mm512_setzero_si512();
+        __m512i lo = _mm512_setzero_si512();
+        for (uint32_t d = 0; d < table->dim; d++) {
+            __m512i p = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)&coords[(size_t)d * engine->padded_points]));
+            hi = _mm512_add_epi32(hi, _mm512_mullo_epi32(p, _mm512_set1_epi32(table->hi[j * table->dim + d])));
+            lo = _mm512_add_epi32(lo, _mm512_mullo_epi32(p, _mm512_set1_epi32(table->lo[j * table->dim + d])));
+        }
+
+        // Widen to 64 bits, 8 points per half
+        __m256i hi_half[2] = { _mm512_castsi512_si256(hi), _mm512_extracti64x4_epi64(hi, 1) };
+        __m256i lo_half[2] = { _mm512_castsi512_si256(lo), _mm512_extracti64x4_epi64(lo, 1) };
+        for (int h = 0; h < 2; h++) {
+            __m512i dot = _mm512_add_epi64(_mm512_slli_epi64(_mm512_cvtepi32_epi64(hi_half[h]), 16), _mm512_cvtepi32_epi64(lo_half[h]));
+            __m512i distance = _mm512_sub_epi64(_mm512_set1_epi64(table->norms[j]), _mm512_slli_epi64(dot, FIXED_SHIFT + 1));
+            __mmask8 closer = _mm512_cmpgt_epi64_mask(best[h], distance);
+            best[h] = _mm512_mask_mov_epi64(best[h], closer, distance);
+            best_label[h] = _mm512_mask_mov_epi64(best_label[h], closer, _mm512_set1_epi64(j));
+        }
+    }
+
+    int64_t lanes[CPU_BLOCK_POINTS];
+    _mm512_storeu_si512(&lanes[0], best_label[0]);
+    _mm512_storeu_si512(&lanes[8], best_label[1]);
+    for (int i = 0; i < CPU_BLOCK_POINTS; i++) {
+        labels[i] = lanes[i];
+    }
+}
+
+#elif defined(__AVX2__)
+
+const char *cpu_engine_kernel(void) {
+    return "avx2";
+}
+
+// Nearest centroid of the 16 points of a block, two groups of 8 points, one point per 32 bit lane
+static void nearest_block(const struct cpu_engine *engine, const struct centroid_table *table, uint32_t first, uint16_t *labels) {
+    for (int g = 0; g < 2; g++) {
+        const uint8_t *coords = &engine->coords[first + g * 8];
+        __m256i best[2] = { _mm256_set1_epi64x(INT64_MAX), _mm256_set1_epi64x(INT64_MAX) };
+        __m256i best_label[2] = { _mm256_setzero_si256(), _mm256_setzero_si256() };
+
+        for (uint32_t j = 0; j < table->num_centroids; j++) {
+            __m256i hi = _mm256_setzero_si256();
+            __m256i lo = _mm256_setzero_si256();
+            for (uint32_t d = 0; d < table->dim; d++) {
+                __m256i p = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&coords[(size_t)d * engine->padded_points]));
+                hi = _mm256_add_epi32(hi, _mm256_mullo_epi32(p, _mm256_set1_epi32(table->hi[j * table->dim + d])));
+                lo = _mm256_add_epi32(lo, _mm256_mullo_epi32(p, _mm256_set1_epi32(table->lo[j * table->dim + d])));
+            }
+
+            // Widen to 64 bits, 4 points per half
+            __m128i hi_half[2] = { _mm256_castsi256_si128(hi), _mm256_extracti128_si256(hi, 1) };
+            __m128i lo_half[2] = { _mm256_castsi256_si128(lo), _mm256_extracti128_si256(lo, 1) };
+            for (int h = 0; h < 2; h++) {
+                __m256i dot = _mm256_add_epi64(_mm256_slli_epi64(_mm256_cvtepi32_epi64(hi_half[h]), 16), _mm256_cvtepi32_epi64(lo_half[h]));
+                __m256i distance = _mm256_sub_epi64(_mm256_set1_epi64x(table->norms[j]), _mm256_slli_epi64(dot, FIXED_SHIFT + 1));
+                __m256i closer = _mm256_cmpgt_epi64(best[h], distance);
+                best[h] = _mm256_blendv_epi8(best[h], distance, closer);
+                best_label[h] = _mm256_blendv_epi8(best_label[h], _mm256_set1_epi64x(j), closer);
+            }
+        }
+
+        int64_t lanes[8];
+        _mm256_storeu_si256((__m256i *)&lanes[0], best_label[0]);
+        _mm256_storeu_si256((__m256i *)&lanes[4], best_label[1]);
+        for (int i = 0; i < 8; i++) {
+            labels[g * 8 + i] = lanes[i];
+        }
+    }
+}
+
+#else
+
+const char *cpu_engine_kernel(void) {
+    return "scalar";
+}
+
+// Nearest centroid of the 16 points of a block, the first centroid wins a tie like on the DPUs
+static void nearest_block(const struct cpu_engine *engine, const struct centroid_table *table, uint32_t first, uint16_t *labels) {
+    int64_t min_distance[CPU_BLOCK_POINTS];
+    for (uint32_t i = 0; i < CPU_BLOCK_POINTS; i++) {
+        min_distance[i] = INT64_MAX;
+        labels[i] = 0;
+    }
+
+    for (uint32_t j = 0; j < table->num_centroids; j++) {
+        int64_t dot[CPU_BLOCK_POINTS] = { 0 };
+        for (uint32_t d = 0; d < table->dim; d++) {
+            const uint8_t *coords = &engine->coords[(size_t)d * engine->padded_points + first];
+            int64_t c = table->centroids[j * table->dim + d];
+            for (uint32_t i = 0; i < CPU_BLOCK_POINTS; i++) {
+                dot[i] += coords[i] * c;
+            }
+        }
+        for (uint32_t i = 0; i < CPU_BLOCK_POINTS; i++) {
+            int64_t distance = table->norms[j] - (dot[i] << (FIXED_SHIFT + 1));
+            if (distance < min_distance[i]) {
+                min_distance[i] = distance;
+                labels[i] = j;
+            }
+        }
+    }
+}
+
+#endif
+
+uint32_t cpu_engine_step(struct cpu_engine *engine, const int32_t *centroids, uint32_t num_centroids,
+                         uint64_t *total_sum, uint32_t *num_points_per_centroid) {
+    uint32_t dim = engine->dim;
+    uint32_t num_values = num_centroids * dim;
+    uint32_t num_blocks = engine->padded_points / CPU_BLOCK_POINTS;
+    uint32_t changed = 0;
+    struct centroid_table table;
+
+    assert(num_centroids <= MAX_CENTROIDS && num_values <= MAX_CENTROID_VALUES);
+    table.num_centroids = num_centroids;
+    table.dim = dim;
+    table.centroids = centroids;
+    for (uint32_t j = 0; j < num_centroids; j++) {
+        table.norms[j] = 0;
+        for (uint32_t d = 0; d < dim; d++) {
+            int32_t c = centroids[j * dim + d];
+            table.norms[j] += (int64_t)c * c;
+            table.hi[j * dim + d] = c >> FIXED_SHIFT;
+            table.lo[j * dim + d] = c & (FIXED_ONE - 1);
+        }
+    }
+
+    memset(total_sum, 0, num_values * sizeof(uint64_t));
+    memset(num_points_per_centroid, 0, num_centroids * sizeof(uint32_t));
+
+    #pragma omp parallel
+    {
+        // Partial results of this thread
+        uint64_t *local_sums = calloc(num_values, sizeof(uint64_t));
+        uint32_t *local_counts = calloc(num_centroids, sizeof(uint32_t));
+        uint32_t local_changed = 0;
+        uint16_t block_labels[CPU_BLOCK_POINTS];
+        assert(local_sums != NULL && local_counts != NULL);
+
+        #pragma omp for schedule(static)
+        for (uint32_t b = 0; b < num_blocks; b++) {
+            uint32_t first = b * CPU_BLOCK_POINTS;
+            nearest_block(engine, &table, first, block_labels);
+
+            // The last block may be partially filled
+            uint32_t count = engine->total_num_points - first;
+            if (count > CPU_BLOCK_POINTS) {
+                count = CPU_BLOCK_POINTS;
+            }
+
+            for (uint32_t i = 0; i < count; i++) {
+                local_changed += engine->labels[first + i] != block_labels[i];
+                engine->labels[first + i] = block_labels[i];
+                local_counts[block_labels[i]]++;
+            }
+            for (uint32_t d = 0; d < dim; d++) {
+                const uint8_t *coords = &engine->coords[(size_t)d * engine->padded_points + first];
+                for (uint32_t i = 0; i < count; i++) {
+                    local_sums[block_labels[i] * dim + d] += coords[i];
+                }
+            }
+        }
+
+        // Merge the partial results, one thread at a time
+        #pragma omp critical
+        {
+            for (uint32_t v = 0; v < num_values; v++) {
+                total_sum[v] += local_sums[v];
+            }
+            for (uint32_t j = 0; j < num_centroids; j++) {
+                num_points_per_centroid[j] += local_counts[j];
+            }
+            changed += local_changed;
+        }
+
+        free(local_sums);
+        free(local_counts);
+    }
+
+    return changed;
+}
@@ -0,0 +1,47 @@
+#ifndef CPU_ENGINE_H
+#define CPU_ENGINE_H
+
+#include <stdint.h>
+
+/* Points per block of the distance kernels, the SIMD width of the widest kernel */
+#define CPU_BLOCK_POINTS 16
+
+/*
+    k-means on the host CPU with the data model of the DPU path
+        uint8_t coordinates, Q16.16 centroids, uint16_t labels and the distance |c|^2 - 2 p.c
+        computed exactly in 64 bits, so the labels and sums match the DPUs bit for bit
+
+    The points are kept as a structure of arrays, one array of padded_points coordinates per
+    dimension, so a SIMD lane holds one point. The blocks are split over the OpenMP threads,
+    every thread sums into its own partial results which are merged at the end of the pass.
+*/
+struct cpu_engine {
+    uint32_t total_num_points;
+    uint32_t dim;
+    uint32_t padded_points;     // total_num_points rounded up to CPU_BLOCK_POINTS
+    uint8_t *coords;            // dim arrays of padded_points coordinates, the padding is zero
+    uint16_t *labels;           // Nearest centroid of every point, UINT16_MAX before the first pass
+};
+
+// Copy the total_num_points * dim point coordinates into the structure of arrays layout
+void cpu_engine_init(struct cpu_engine *engine, const uint8_t *points, uint32_t total_num_points, uint32_t dim);
+
+void cpu_engine_free(struct cpu_engine *engine);
+
+/*
+    One k-means pass over all points
+        1. Label every point with its nearest centroid, num_centroids * dim Q16.16 coordinates
+        2. Sum the coordinates and count the points of every cluster into total_sum and
+           num_points_per_centroid, dim sums per cluster
+    Returns how many points changed their label
+*/
+uint32_t cpu_engine_step(struct cpu_engine *engine, const int32_t *centroids, uint32_t num_centroids,
+                         uint64_t *total_sum, uint32_t *num_points_per_centroid);
+
+// Name of the distance kernel selected at build time
+const char *cpu_engine_kernel(void);
+
+// Number of threads a pass runs on
+int cpu_engine_threads(void);
+
+#endif
@@ -0,0 +1,101 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dataset.h"
+
+int dataset_write_header(FILE *file, uint64_t num_points, uint32_t dim) {
+    struct dataset_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DATASET_MAGIC, sizeof(header.magic));
+    header.version = DATASET_VERSION;
+    header.num_points = num_points;
+    header.dim = dim;
+    header.dtype = DATASET_UINT8;
+    return fwrite(&header, sizeof(header), 1, file) != 1;
+}
+
+// Check a header against the size of its file
+static int check_header(const struct dataset_header *header, const char *path, uint64_t file_size) {
+    if (memcmp(header->magic, DATASET_MAGIC, sizeof(header->magic)) != 0 || header->version != DATASET_VERSION) {
+        fprintf(stderr, "%s: not a version %d dataset file\n", path, DATASET_VERSION);
+        return 1;
+    }
+    if (header->dtype != DATASET_UINT8) {
+        fprintf(stderr, "%s: coordinates of dtype %u, only uint8 (%d) is supported\n", path, header->dtype, DATASET_UINT8);
+        return 1;
+    }
+    if (header->dim == 0 || header->num_points > (file_size - DATASET_HEADER_SIZE) / header->dim ||
+        DATASET_HEADER_SIZE + header->num_points * header->dim != file_size) {
+        fprintf(stderr, "%s: %" PRIu64 " bytes do not hold %" PRIu64 " points of %u coordinates\n", path, file_size,
+                header->num_points, header->dim);
+        return 1;
+    }
+    return 0;
+}
+
+int dataset_read_header(FILE *file, const char *path, struct dataset_header *header) {
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0) {
+        perror(path);
+        return 1;
+    }
+    if ((uint64_t)st.st_size < DATASET_HEADER_SIZE || fread(header, sizeof(*header), 1, file) != 1) {
+        fprintf(stderr, "%s: no dataset header\n", path);
+        return 1;
+    }
+    return check_header(header, path, st.st_size);
+}
+
+int dataset_open(struct dataset *dataset, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror(path);
+        close(fd);
+        return 1;
+    }
+    if ((uint64_t)st.st_size < DATASET_HEADER_SIZE) {
+        fprintf(stderr, "%s: no dataset header\n", path);
+        close(fd);
+        return 1;
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(path);
+        return 1;
+    }
+    const struct dataset_header *header = map;
+    if (check_header(header, path, st.st_size) != 0) {
+        munmap(map, st.st_size);
+        return 1;
+    }
+    posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    dataset->num_points = header->num_points;
+    dataset->dim = header->dim;
+    dataset->points = (uint8_t *)map + DATASET_HEADER_SIZE;
+    dataset->map = map;
+    dataset->map_size = st.st_size;
+    return 0;
+}
+
+void dataset_close(struct dataset *dataset) {
+    munmap(dataset->map, dataset->map_size);
+    dataset->map = NULL;
+    dataset->points = NULL;
+}
@@ -0,0 +1,62 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+    Dataset file format, all integers little endian
+        offset  0   char[4]   magic "KMPT"
+        offset  4   uint32_t  version, DATASET_VERSION
+        offset  8   uint64_t  N, number of points
+        offset 16   uint32_t  D, coordinates per point
+        offset 20   uint32_t  dtype of the coordinates, DATASET_UINT8 is the only one
+        offset 24   zero up to DATASET_HEADER_SIZE
+        offset 64   N rows of D coordinates, point after point, nothing in between
+
+    The rows start on a cache line and are exactly the layout kmeans.c works on, so a mapped
+    file is used in place: the DPU transfers point into the mapping, the only copies are the
+    padding to the kernel dimension bucket when D is not a power of two and the last,
+    partially filled slice.
+*/
+#define DATASET_MAGIC "KMPT"
+#define DATASET_VERSION 1
+#define DATASET_HEADER_SIZE 64
+#define DATASET_UINT8 1
+
+struct dataset_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t num_points;
+    uint32_t dim;
+    uint32_t dtype;
+    uint8_t reserved[DATASET_HEADER_SIZE - 24];
+};
+
+/* A dataset file mapped read only */
+struct dataset {
+    uint64_t num_points;
+    uint32_t dim;
+    uint8_t *points;        // num_points * dim coordinates inside the mapping
+    void *map;
+    size_t map_size;
+};
+
+// Write the header of a dataset of num_points points of dim uint8_t coordinates, returns 0 on success
+int dataset_write_header(FILE *file, uint64_t num_points, uint32_t dim);
+
+/*
+    Read and check the header of a dataset file, file is left at the first row
+    Returns 0 on success, otherwise prints why the file is rejected
+*/
+int dataset_read_header(FILE *file, const char *path, struct dataset_header *header);
+
+/*
+    Map a dataset file, the pages are read in on first touch with sequential read ahead
+    Returns 0 on success, otherwise prints why the file is rejected
+*/
+int dataset_open(struct dataset *dataset, const char *path);
+
+void dataset_close(struct dataset *dataset);
+
+#endif
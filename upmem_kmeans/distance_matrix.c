@@ -1,51 +1,156 @@
 #include <defs.h>
 #include <mram.h>
+#include <alloc.h>
 #include <perfcounter.h>
 #include <stdint.h>
-#include <stdio.h>
 #include <barrier.h>
 #include <vmutex.h>
-//Total number of points
-// How many points for one WRAM buffer
-#define TOTAL_NUM_POINTS 1024
-#define NR_TASKLETS 4
 
+#include "common.h"
 
-__mram_noinit uint8_t points[TOTAL_NUM_POINTS*2];
-__mram uint64_t distance[TOTAL_NUM_POINTS];
+// The tasklet count comes from the build, see common.h
+#ifndef NR_TASKLETS
+#error "NR_TASKLETS must be set by the build, e.g. -DNR_TASKLETS=16"
+#endif
+
+// Number of points resident on this DPU, set by the host after each load
+__host uint32_t num_points;
+
+// Queries of this launch, DIM coordinates each, broadcast by the host before each launch
+__host uint32_t num_queries;
+__host uint8_t queries[KNN_QUERY_BYTES];
+
+// Candidates kept per query, or 0 to write the distance matrix
+__host uint32_t k;
+
+// Distances per row of the matrix, the same on every DPU
+__host uint32_t pitch;
+
+// Heap of the k nearest points of every query, the farthest one first, read back by the host
+__host struct knn_candidate candidates[KNN_MAX_CANDIDATES];
+
+// Cycles of this launch, from the start of tasklet 0 to the end of the last tile
+__host uint64_t cycles;
+
+// A virtual mutex per query, tasklets insert into the heaps of different queries concurrently
+VMUTEX_INIT(query_mutex, KNN_MAX_QUERIES, 8);
 
 // Barrier for synchronization
 BARRIER_INIT(my_barrier, NR_TASKLETS);
 
+// Squared distance between a point and a query, at most MAX_DIM * 255^2
+uint32_t point_distance(uint8_t *point, uint8_t *query) {
+    uint32_t distance = 0;
+    #pragma unroll
+    for (uint32_t d = 0; d < DIM; d++) {
+        int32_t diff = point[d] - query[d];
+        distance += diff * diff;
+    }
+    return distance;
+}
 
-// Calculate the distance matrix
-uint64_t calculate_distance(int A) {
-    uint64_t dx = points[A] - points[0];
-    uint64_t dy = points[A + 1] - points[1];
-    return (dx * dx + dy * dy);
+// Whether a candidate is farther than (distance, index), the higher index on a tie
+int candidate_after(const struct knn_candidate *candidate, uint32_t distance, uint32_t index) {
+    return candidate->distance > distance || (candidate->distance == distance && candidate->index > index);
 }
 
+// Replace the farthest candidate of a heap of k candidates with (distance, index)
+void heap_replace(struct knn_candidate *heap, uint32_t distance, uint32_t index) {
+    uint32_t i = 0;
+    for (uint32_t child = 1; child < k; child = 2 * i + 1) {
+        if (child + 1 < k && candidate_after(&heap[child + 1], heap[child].distance, heap[child].index)) {
+            child++;
+        }
+        if (!candidate_after(&heap[child], distance, index)) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i].distance = distance;
+    heap[i].index = index;
+}
+
+/*
+    Distances between every query and every resident point
+        1. Tasklets take the tiles of points in turn, a tile is read once for all the queries
+        2. Matrix mode (k == 0): write the distances of the tile to the row of every query
+        3. Top-k mode: offer every point to the heap of the query, most points are rejected
+           against the farthest candidate without the mutex, which is checked again under it
+    The host merges the k candidates of every DPU, only num_queries * k of them per DPU cross
+    the bus. Ties keep the lower index, so the merge is the same as a search over all points.
+*/
 int main() {
     // Get tasklet ID
     uint32_t tasklet_id = me();
 
-    // Each Tasklet is to handle TOTAL_NUM_POINTS/NUM_POINTS points
-    int num_points_per_tasklet = TOTAL_NUM_POINTS / NR_TASKLETS;
+    // Tasklet 0 resets the cycle counter, a second reset by another tasklet would lose cycles.
+    // It also resets the WRAM heap, which is only reset by a load and this binary may be
+    // launched again without one, the barrier keeps the tiles from being taken before it.
+    if (tasklet_id == 0) {
+        mem_reset();
+        perfcounter_config(COUNT_CYCLES, true);
+    }
+    barrier_wait(&my_barrier);
+
+    // The points stay in the MRAM heap across launches, the matrix is written next to them
+    __mram_ptr uint8_t *points = (__mram_ptr uint8_t *)DPU_MRAM_HEAP_POINTER + POINTS_OFFSET;
+    __mram_ptr uint32_t *matrix = (__mram_ptr uint32_t *)((__mram_ptr uint8_t *)DPU_MRAM_HEAP_POINTER + MATRIX_OFFSET);
+
+    // WRAM tiles of this tasklet
+    uint8_t *point_block = mem_alloc(TILE_POINTS * DIM);
+    uint32_t *distance_block = mem_alloc(TILE_POINTS * sizeof(uint32_t));
+
+    // Every heap starts with k empty slots, farther than any point
+    for (uint32_t c = tasklet_id; c < num_queries * k; c += NR_TASKLETS) {
+        candidates[c].distance = UINT32_MAX;
+        candidates[c].index = UINT32_MAX;
+    }
+    barrier_wait(&my_barrier);
 
-    // Calculate the distance matrix
-    for (int i = tasklet_id * num_points_per_tasklet * 2; i < (tasklet_id + 1) * num_points_per_tasklet * 2 ; i+=2) {;
-        uint64_t dis = calculate_distance(i);
-        distance[i/2] = dis;  
+    uint32_t num_blocks = (num_points + TILE_POINTS - 1) / TILE_POINTS;
+    for (uint32_t b = tasklet_id; b < num_blocks; b += NR_TASKLETS) {
+        mram_read(&points[b * TILE_POINTS * DIM], point_block, TILE_POINTS * DIM);
+
+        // The last block may be partially filled
+        uint32_t count = num_points - b * TILE_POINTS;
+        if (count > TILE_POINTS) {
+            count = TILE_POINTS;
+        }
+
+        for (uint32_t q = 0; q < num_queries; q++) {
+            uint8_t *query = &queries[q * DIM];
+            if (k == 0) {
+                for (uint32_t i = 0; i < count; i++) {
+                    distance_block[i] = point_distance(&point_block[i * DIM], query);
+                }
+                mram_write(distance_block, &matrix[q * pitch + b * TILE_POINTS], ALIGN8(count * sizeof(uint32_t)));
+                continue;
+            }
+
+            // The farthest candidate only gets nearer, a stale one just takes the mutex for nothing
+            struct knn_candidate *heap = &candidates[q * k];
+            for (uint32_t i = 0; i < count; i++) {
+                uint32_t distance = point_distance(&point_block[i * DIM], query);
+                if (distance > heap[0].distance) {
+                    continue;
+                }
+                uint32_t index = b * TILE_POINTS + i;
+                vmutex_lock(&query_mutex, q);
+                if (candidate_after(&heap[0], distance, index)) {
+                    heap_replace(heap, distance, index);
+                }
+                vmutex_unlock(&query_mutex, q);
+            }
+        }
     }
 
     // Synchronize all tasklets
     barrier_wait(&my_barrier);
 
-    // For the first tasklet, print the distance matrix
     if (tasklet_id == 0) {
-        for (int i = 0; i < TOTAL_NUM_POINTS; i++) {
-            printf("Distance[%d]: %lu", i, distance[i]);
-        }
+        cycles = perfcounter_get();
     }
+
     return 0;
 }
@@ -0,0 +1,111 @@
+#include <defs.h>
+#include <mram.h>
+#include <alloc.h>
+#include <perfcounter.h>
+#include <stdint.h>
+#include <barrier.h>
+#include <vmutex.h>
+
+#include "common.h"
+
+// The tasklet count comes from the build, see common.h
+#ifndef NR_TASKLETS
+#error "NR_TASKLETS must be set by the build, e.g. -DNR_TASKLETS=16"
+#endif
+
+// A cell per (x, y) pair, only 2-D points have a histogram that fits the MRAM
+#if DIM != 2
+#error "The histogram kernel is built for 2-D points only, DIM=2"
+#endif
+
+// Number of points resident on this DPU, set by the host after each load
+__host uint32_t num_points;
+
+// Cycles of this launch, from the start of tasklet 0 to the end of the last band
+__host uint64_t cycles;
+
+// The band of the histogram being counted, shared by all tasklets
+uint32_t *band;
+
+// A virtual mutex per row of the band, points of different rows are counted concurrently
+VMUTEX_INIT(row_mutex, HISTOGRAM_BAND_ROWS, 8);
+
+// Barrier for synchronization
+BARRIER_INIT(my_barrier, NR_TASKLETS);
+
+/*
+    Count the resident points of every (x, y) cell into the histogram in MRAM
+        1. The histogram is counted HISTOGRAM_BAND_ROWS rows of x at a time in WRAM, every
+           band reads the points again
+        2. Tasklets take the tiles in turn and count the points of the band, a row at a time
+           under its mutex
+        3. The tasklets write the band to MRAM in 2048 byte chunks
+    Once built the histogram replaces the points, the host iterates over its occupied cells.
+*/
+int main() {
+    // Get tasklet ID
+    uint32_t tasklet_id = me();
+
+    // Tasklet 0 resets the cycle counter and allocates the band for all tasklets. It resets
+    // the WRAM heap first, which is only reset by a load and this binary may be launched
+    // again without one, the barrier keeps the tiles from being taken before it.
+    if (tasklet_id == 0) {
+        mem_reset();
+        perfcounter_config(COUNT_CYCLES, true);
+        band = mem_alloc(HISTOGRAM_BAND_ROWS * HISTOGRAM_SIDE * sizeof(uint32_t));
+    }
+    barrier_wait(&my_barrier);
+
+    // Points are resident in the MRAM heap, the histogram goes after the other regions
+    __mram_ptr uint8_t *points = (__mram_ptr uint8_t *)DPU_MRAM_HEAP_POINTER + POINTS_OFFSET;
+    __mram_ptr uint32_t *histogram = (__mram_ptr uint32_t *)((__mram_ptr uint8_t *)DPU_MRAM_HEAP_POINTER + HISTOGRAM_OFFSET);
+
+    // WRAM tile of this tasklet
+    uint8_t *point_block = mem_alloc(TILE_POINTS * DIM);
+
+    const uint32_t band_cells = HISTOGRAM_BAND_ROWS * HISTOGRAM_SIDE;
+    const uint32_t chunk_cells = 2048 / sizeof(uint32_t);
+    uint32_t num_blocks = (num_points + TILE_POINTS - 1) / TILE_POINTS;
+    for (uint32_t first_row = 0; first_row < HISTOGRAM_SIDE; first_row += HISTOGRAM_BAND_ROWS) {
+        // The previous band is written, clear it, the first barrier also publishes band
+        barrier_wait(&my_barrier);
+        for (uint32_t c = tasklet_id; c < band_cells; c += NR_TASKLETS) {
+            band[c] = 0;
+        }
+        barrier_wait(&my_barrier);
+
+        for (uint32_t b = tasklet_id; b < num_blocks; b += NR_TASKLETS) {
+            mram_read(&points[b * TILE_POINTS * DIM], point_block, TILE_POINTS * DIM);
+
+            // The last block may be partially filled
+            uint32_t count = num_points - b * TILE_POINTS;
+            if (count > TILE_POINTS) {
+                count = TILE_POINTS;
+            }
+
+            for (uint32_t i = 0; i < count; i++) {
+                uint32_t row = point_block[i * DIM] - first_row;
+                if (row >= HISTOGRAM_BAND_ROWS) {
+                    continue;
+                }
+                vmutex_lock(&row_mutex, row);
+                band[row * HISTOGRAM_SIDE + point_block[i * DIM + 1]]++;
+                vmutex_unlock(&row_mutex, row);
+            }
+        }
+        barrier_wait(&my_barrier);
+
+        for (uint32_t c = tasklet_id * chunk_cells; c < band_cells; c += NR_TASKLETS * chunk_cells) {
+            mram_write(&band[c], &histogram[first_row * HISTOGRAM_SIDE + c], chunk_cells * sizeof(uint32_t));
+        }
+    }
+
+    // Barrier to ensure the last band is written
+    barrier_wait(&my_barrier);
+
+    if (tasklet_id == 0) {
+        cycles = perfcounter_get();
+    }
+
+    return 0;
+}
@@ -1,524 +1,928 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <dpu.h>
 #include <assert.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <math.h>
-// Record execution time
-#include <time.h>
-
-#ifndef DISTANCE_MATRIX
-#define DISTANCE_MATRIX "distance_matrix"
-#endif
-
-#ifndef AVG_COORDINATE
-#define AVG_COORDINATE "avg_coordinate"
-#endif
 
+#include "common.h"
+#include "cpu_engine.h"
+#include "dataset.h"
+#include "server.h"
+#include "upmem_kmeans.h"
 
-/* Number of points */
-#define TOTAL_NUM_POINTS 4092 // Example for 64 points
+/* Default number of points, overridden with -n */
+#define TOTAL_NUM_POINTS 4092
 
-/* Number of centroids */
+/* Default number of centroids, overridden with -k */
 #define NUM_CENTROIDS 4
 
+/* Default number of DPUs, overridden with -d */
 #define DPU_NUMBER 4
 
-/* NxN matrix */
-#define DISTANCE_MATRIX_SIZE NUM_CENTROIDS * (TOTAL_NUM_POINTS + 1)
-
-
-/* Populate the data to the DPUs for distance matrix calculation 
-    1. Calculate how many points each DPU will handle denote as num_points_per_dpu
-    2. Prepare a [number of points + 1] array for each DPU, the first element is the centroid
-    3. Populate the data to the DPUs
-*/
-void populate_mram(struct dpu_set_t set, struct dpu_set_t dpu, uint8_t *points, uint16_t centroid_index) {
-
-    uint16_t num_points_per_dpu = TOTAL_NUM_POINTS / DPU_NUMBER;
-    // Check if the number of points is exceed the limit with 1023 points per DPU
-    if (num_points_per_dpu > 1023) {
-        printf("The number of points per DPU is exceed the limit\n");
-        return;
+// Generate the dim coordinates of the points, the axis is uint8_t data type
+void generate_points(uint8_t *points, uint32_t total_num_points, uint32_t dim) {
+    for (size_t i = 0; i < (size_t)total_num_points * dim; i++) {
+        // Assign random values to the points
+        points[i] = rand() % 255;
     }
+}
 
-    // Assign a new points array for DPUs, which evenly insert the centroids before each num_points_per_dpu points
-    uint8_t new_points[(num_points_per_dpu + 1) * DPU_NUMBER * 2];
-
-    // Assign the current centroid to the first element of each DPU
-    for (int i = 0; i < DPU_NUMBER; i++) {
-        new_points[i * (num_points_per_dpu + 1) * 2] = points[centroid_index * 2];
-        new_points[i * (num_points_per_dpu + 1) * 2 + 1] = points[centroid_index * 2 + 1];
+/*
+    Write total_num_points random points of dim coordinates to a dataset file, see dataset.h.
+    The points are generated in chunks, so the file may be far larger than the host memory,
+    and are the same as generate_points for the same seed. Returns 0 on success.
+*/
+int write_dataset(const char *path, uint64_t total_num_points, uint32_t dim, unsigned seed) {
+    const uint32_t chunk_points = 1 << 20;
+    uint8_t *chunk = malloc((size_t)chunk_points * dim);
+    FILE *file = fopen(path, "wb");
+    assert(chunk != NULL);
+    if (file == NULL) {
+        perror(path);
+        free(chunk);
+        return 1;
     }
 
-    // Assign the rest of the points to the new points array
-    for (int i = 0; i < DPU_NUMBER; i++) {
-        for (int j = 0; j < num_points_per_dpu * 2; j++) {
-            new_points[i * (num_points_per_dpu + 1) * 2 + 2 + j] = points[i * num_points_per_dpu * 2 + j];
-        }
+    srand(seed);
+    int failed = dataset_write_header(file, total_num_points, dim);
+    for (uint64_t written = 0; written < total_num_points && !failed; written += chunk_points) {
+        uint32_t count = total_num_points - written < chunk_points ? total_num_points - written : chunk_points;
+        generate_points(chunk, count, dim);
+        failed = fwrite(chunk, dim, count, file) != count;
     }
-
-    uint32_t each_dpu;
-
-    DPU_FOREACH(set, dpu, each_dpu){
-
-        // Prepare the data for each DPU
-        DPU_ASSERT(dpu_prepare_xfer(dpu, &new_points[each_dpu * (num_points_per_dpu + 1) * 2]));
+    failed |= fclose(file) != 0;
+    if (failed) {
+        perror(path);
     }
-    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "points", 0, (num_points_per_dpu + 1) * 2 * sizeof(uint8_t), DPU_XFER_DEFAULT));
+    free(chunk);
+    return failed;
 }
 
-// Populate the points to the DPUs for average coordinate calculation
-void populate_mram_avg(struct dpu_set_t set, struct dpu_set_t dpu, uint8_t *points) {
-    uint32_t each_dpu;
-
-    DPU_FOREACH(set, dpu, each_dpu){
-        // Prepare the data for each DPU
-        DPU_ASSERT(dpu_prepare_xfer(dpu, &points[each_dpu * 1024 * 2]));
-    }
-    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "points", 0, 1024 * 2 * sizeof(uint8_t), DPU_XFER_DEFAULT));
-}
+/*
+    Double precision k-means on the CPU, the algorithm of CPU_kmeans.c started from the
+    given centroids and run for the same number of iterations as the DPUs.
+    The nearest centroid is the one with the smallest squared distance, the square root of
+    CPU_kmeans.c does not change it. Like on the DPUs an empty cluster keeps its centroid.
+    The points are split over the OpenMP threads like in cpu_engine, every thread sums into its
+    own partial results. The sums of uint8_t coordinates are integers well below 2^53, so they
+    are exact in any order and the result does not depend on the thread count.
+*/
+void cpu_kmeans(uint8_t *points, uint32_t total_num_points, uint32_t dim, double *centroids, uint32_t num_centroids,
+                int iterations, uint16_t *labels) {
+    double *sums = malloc((size_t)num_centroids * dim * sizeof(double));
+    uint32_t *counts = malloc(num_centroids * sizeof(uint32_t));
+    assert(sums != NULL && counts != NULL);
+
+    for (int iter = 0; iter <= iterations; iter++) {
+        memset(sums, 0, (size_t)num_centroids * dim * sizeof(double));
+        memset(counts, 0, num_centroids * sizeof(uint32_t));
+
+        // Assign each point to the nearest centroid
+        #pragma omp parallel
+        {
+            // Partial results of this thread
+            double *local_sums = calloc((size_t)num_centroids * dim, sizeof(double));
+            uint32_t *local_counts = calloc(num_centroids, sizeof(uint32_t));
+            assert(local_sums != NULL && local_counts != NULL);
+
+            #pragma omp for schedule(static)
+            for (uint32_t j = 0; j < total_num_points; j++) {
+                uint8_t *point = &points[(size_t)j * dim];
+                double min_distance = INFINITY;
+                uint16_t closest_centroid = 0;
+                for (uint32_t i = 0; i < num_centroids; i++) {
+                    double distance = 0;
+                    for (uint32_t d = 0; d < dim; d++) {
+                        double diff = point[d] - centroids[i * dim + d];
+                        distance += diff * diff;
+                    }
+                    if (distance < min_distance) {
+                        min_distance = distance;
+                        closest_centroid = i;
+                    }
+                }
+                labels[j] = closest_centroid;
+                local_counts[closest_centroid]++;
+                for (uint32_t d = 0; d < dim; d++) {
+                    local_sums[closest_centroid * dim + d] += point[d];
+                }
+            }
 
-/* 
-    From distance matrix find nearest points to the centroids
-        1. Loop through all the points
-        2. Find the nearest centroid to the point
-        3. For each point, record the the nearest centroid index
-*/ 
-void find_nearest_centroid(uint64_t *distance_matrix, uint16_t *nearest_centroid, uint16_t *centroids) {
-    for (int i = 0; i < TOTAL_NUM_POINTS; i++) {
-        // Every first element is the centroid
-        uint64_t min_distance = distance_matrix[i];
-        uint16_t min_centroid = 0;
-        for (int j = 1; j < NUM_CENTROIDS; j++) {
-            if (distance_matrix[i * NUM_CENTROIDS + j] < min_distance) {
-                min_distance = distance_matrix[i * NUM_CENTROIDS + j];
-                min_centroid = j;
+            // Merge the partial results, one thread at a time
+            #pragma omp critical
+            {
+                for (uint32_t v = 0; v < num_centroids * dim; v++) {
+                    sums[v] += local_sums[v];
+                }
+                for (uint32_t i = 0; i < num_centroids; i++) {
+                    counts[i] += local_counts[i];
+                }
             }
+
+            free(local_sums);
+            free(local_counts);
         }
-        nearest_centroid[i] = min_centroid;
-    }
-}
 
-// CPU version calculate the distance matrix
-void calculate_distance_matrix(uint8_t *points, uint64_t *distance_matrix, uint16_t *centroids) {
-    for (int i = 0; i < NUM_CENTROIDS; i++) {
-        for (int j = 0; j < TOTAL_NUM_POINTS; j++) {
-            // Calculate the distance between the centroid and the points
-            distance_matrix[i * (TOTAL_NUM_POINTS + 1) + j] = pow(points[centroids[i] * 2] - points[j * 2], 2) + pow(points[centroids[i] * 2 + 1] - points[j * 2 + 1], 2);
+        // Calculate the new centroid
+        for (uint32_t i = 0; i < num_centroids; i++) {
+            for (uint32_t d = 0; counts[i] != 0 && d < dim; d++) {
+                centroids[i * dim + d] = sums[i * dim + d] / counts[i];
+            }
         }
     }
+
+    free(sums);
+    free(counts);
 }
 
-/* 
-    Populate the data to the DPUs for average coordinate calculation
-        Input:
-            set: the DPU set
-            dpu: the DPU
-            points: the coordinates of the points
-            nearest_centroid: the nearest centroid to each point
-            x_sum: the sum of x coordinates for each centroid
-            y_sum: the sum of y coordinates for each centroid
+/*
+    Compare the result of the DPUs with cpu_kmeans from the same initial centroids
+    The DPU centroids are the means rounded to Q16.16, so with the same labels every coordinate
+    is within CENTROID_TOLERANCE of the double precision mean. A point closer than that to the
+    boundary between two clusters may be labelled differently, the check then reports it.
+    Returns 0 when every label matches and every centroid is within the tolerance, the
+    differences and the time of cpu_kmeans are recorded in result.
 */
-void calculate_avg_coordinate(struct dpu_set_t set, struct dpu_set_t dpu, uint8_t *points, uint16_t *nearest_centroid, uint64_t *x_sum, uint64_t *y_sum) {
-    uint32_t num_points_per_dpu = TOTAL_NUM_POINTS / DPU_NUMBER;
-    uint32_t each_dpu;
+#define CENTROID_TOLERANCE (1.0 / FIXED_ONE)
+
+struct cpu_check {
+    uint32_t mismatches;    // Labels that differ
+    double max_error;       // Largest difference of a centroid coordinate
+    double cpu_time;        // Wall time of cpu_kmeans
+};
+
+int check_against_cpu(uint8_t *points, uint32_t total_num_points, uint32_t dim, const int32_t *initial_centroids,
+                      const int32_t *centroids, uint32_t num_centroids, const uint16_t *labels, int iterations,
+                      struct cpu_check *result) {
+    double *cpu_centroids = malloc((size_t)num_centroids * dim * sizeof(double));
+    uint16_t *cpu_labels = malloc((size_t)total_num_points * sizeof(uint16_t));
+    assert(cpu_centroids != NULL && cpu_labels != NULL);
+
+    for (uint32_t v = 0; v < num_centroids * dim; v++) {
+        cpu_centroids[v] = (double)initial_centroids[v] / FIXED_ONE;
+    }
+    double start = kmeans_wall_time();
+    cpu_kmeans(points, total_num_points, dim, cpu_centroids, num_centroids, iterations, cpu_labels);
+    result->cpu_time = kmeans_wall_time() - start;
 
-    DPU_FOREACH(set, dpu, each_dpu){
-        // Prepare the data for each DPU
-        DPU_ASSERT(dpu_prepare_xfer(dpu, &points[each_dpu * num_points_per_dpu * 2]));
-        DPU_ASSERT(dpu_prepare_xfer(dpu, &nearest_centroid[each_dpu * num_points_per_dpu]));
+    uint32_t mismatches = 0;
+    for (uint32_t j = 0; j < total_num_points; j++) {
+        mismatches += labels[j] != cpu_labels[j];
+    }
+    double max_error = 0;
+    for (uint32_t v = 0; v < num_centroids * dim; v++) {
+        double error = fabs((double)centroids[v] / FIXED_ONE - cpu_centroids[v]);
+        if (error > max_error) {
+            max_error = error;
+        }
     }
-    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "points", 0, num_points_per_dpu * 2 * sizeof(uint8_t), DPU_XFER_DEFAULT));
-    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "nearest_centroid", 0, num_points_per_dpu * sizeof(uint16_t), DPU_XFER_DEFAULT));
 
-    // Execute the DPU program
-    DPU_ASSERT(dpu_launch(set, DPU_SYNCHRONOUS));
+    result->mismatches = mismatches;
+    result->max_error = max_error;
 
-    // Get the result from the DPUs
-    DPU_FOREACH(set, dpu, each_dpu){
-        // Prepare the data for each DPU
-        DPU_ASSERT(dpu_prepare_xfer(dpu, &x_sum[each_dpu]));
-        DPU_ASSERT(dpu_prepare_xfer(dpu, &y_sum[each_dpu]));
-    }
-    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "x_sum", 0, num_points_per_dpu * sizeof(uint64_t), DPU_XFER_DEFAULT));
-    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "y_sum", 0, num_points_per_dpu * sizeof(uint64_t), DPU_XFER_DEFAULT));
+    free(cpu_centroids);
+    free(cpu_labels);
+    return mismatches != 0 || max_error > CENTROID_TOLERANCE;
 }
 
+/*
+    Strong or weak scaling sweep over 1, 2, 4, ... DPUs up to max_dpus, printed as CSV
+        strong: the total number of points stays total_num_points
+        weak:   every DPU holds total_num_points points
+    The throughput is points processed per second per iteration. The transfer and launch
+    shares show where the host transfers start to dominate the iterations.
+*/
+void run_scaling(int weak, uint32_t total_num_points, uint32_t dim, uint32_t num_centroids, unsigned seed, const struct kmeans_options *options) {
+    uint32_t max_dpus = options->nr_dpus;
+    if (max_dpus == DPU_ALLOCATE_ALL) {
+        max_dpus = kmeans_available_dpus();
+    }
 
-// Generate the coordinates of the points, the axis is uint8_t data type
-void generate_points(uint8_t *points) {
-    for (int i = 0; i < TOTAL_NUM_POINTS * 2 - 1; i+=2) {
-        // Assign random values to the points
-        points[i] = rand() % 255;
-        points[i + 1] = rand() % 255;
+    printf("mode,launch,dpus,ranks,points,dims,centroids,iterations,setup_s,iteration_s,transfer_s,launch_s,points_per_s\n");
+    for (uint32_t nr_dpus = 1; ; nr_dpus *= 2) {
+        if (nr_dpus > max_dpus) {
+            nr_dpus = max_dpus;
+        }
+        uint32_t n = weak ? total_num_points * nr_dpus : total_num_points;
+        uint8_t *points = malloc((size_t)n * dim);
+        int32_t centroids[num_centroids * dim];
+        assert(points != NULL);
+
+        // The same data and seeds for every DPU count
+        srand(seed);
+        generate_points(points, n, dim);
+        kmeans_generate_centroids(centroids, num_centroids, points, n, dim);
+
+        struct kmeans_options run = *options;
+        run.nr_dpus = nr_dpus;
+        run.seeds = NULL;
+        run.verbose = 0;
+        run.report = NULL;
+        struct kmeans_stats stats;
+        kmeans_run(points, n, dim, centroids, num_centroids, NULL, &run, &stats);
+
+        // Per pass actually run, a sweep point may converge earlier than the iteration limit
+        int iterations = stats.iterations;
+        double iteration_time = (stats.total_time - stats.setup_time) / iterations;
+        printf("%s,%s,%u,%u,%u,%u,%u,%d,%f,%f,%f,%f,%.0f\n", weak ? "weak" : "strong", options->async ? "async" : "sync", stats.nr_dpus, stats.nr_ranks, n,
+               dim, num_centroids, iterations, stats.setup_time, iteration_time,
+               (stats.phase_time[KMEANS_PHASE_TO_DPU] + stats.phase_time[KMEANS_PHASE_FROM_DPU] - stats.setup_phase_time[KMEANS_PHASE_TO_DPU]) / iterations,
+               stats.phase_time[KMEANS_PHASE_LAUNCH] / iterations, n / iteration_time);
+        free(points);
+
+        if (nr_dpus == max_dpus) {
+            break;
+        }
     }
 }
 
+/*
+    One benchmark row comparing cpu_kmeans with the DPUs on the same data, printed as CSV
+        1. Generate the points and the initial centroids from seed, or seed with k-means++
+        2. Run k-means on the DPUs, then the double precision reference and the CPU engine
+           from the same centroids
+        3. Report the wall times and throughputs and whether the results match, the DPU
+           results must be identical to the CPU engine and within the tolerance of the reference
+    The speedup is against the CPU engine, the baseline a host without DPUs would run. The
+    DPU and engine throughputs leave out the setup. The header is printed first so
+    the rows of a sweep can be merged. Returns 0 when the results match.
+*/
+int run_benchmark(uint32_t total_num_points, uint32_t dim, uint32_t num_centroids, unsigned seed, const struct kmeans_options *options) {
+    uint8_t *points = malloc((size_t)total_num_points * dim);
+    uint16_t *labels = malloc((size_t)total_num_points * sizeof(uint16_t));
+    int32_t initial_centroids[num_centroids * dim];
+    int32_t centroids[num_centroids * dim];
+    assert(points != NULL && labels != NULL);
+
+    srand(seed);
+    generate_points(points, total_num_points, dim);
+    kmeans_generate_centroids(initial_centroids, num_centroids, points, total_num_points, dim);
+    memcpy(centroids, initial_centroids, sizeof(centroids));
+
+    // With k-means++ the DPUs seed the run and the references start from their seeds
+    struct kmeans_options run = *options;
+    run.seeds = initial_centroids;
+    run.verbose = 0;
+    run.report = NULL;
+    struct kmeans_stats stats;
+    kmeans_run(points, total_num_points, dim, centroids, num_centroids, labels, &run, &stats);
+    int iterations = stats.iterations;
+
+    // The reference runs as many passes as the DPUs did
+    struct cpu_check check;
+    int failed = check_against_cpu(points, total_num_points, dim, initial_centroids, centroids, num_centroids, labels,
+                                   iterations - 1, &check);
+
+    // The CPU engine shares the data model of the DPUs, its labels and centroids must be identical
+    uint16_t *engine_labels = malloc((size_t)total_num_points * sizeof(uint16_t));
+    int32_t engine_centroids[num_centroids * dim];
+    assert(engine_labels != NULL);
+    memcpy(engine_centroids, initial_centroids, sizeof(engine_centroids));
+    run.nr_dpus = 0;
+    run.plusplus = 0;
+    struct kmeans_stats engine_stats;
+    kmeans_run(points, total_num_points, dim, engine_centroids, num_centroids, engine_labels, &run, &engine_stats);
+    failed |= memcmp(engine_labels, labels, (size_t)total_num_points * sizeof(uint16_t)) != 0;
+    failed |= memcmp(engine_centroids, centroids, sizeof(centroids)) != 0;
+    failed |= engine_stats.iterations != iterations;
+
+    double dpu_time = stats.total_time - stats.setup_time;
+    double engine_time = engine_stats.total_time - engine_stats.setup_time;
+    printf("seed,points,dims,centroids,dpus,ranks,launch,engine,threads,iterations,cpu_s,engine_s,dpu_s,dpu_setup_s,"
+           "cpu_points_per_s,engine_points_per_s,dpu_points_per_s,speedup,label_mismatches,max_centroid_error,match\n");
+    printf("%u,%u,%u,%u,%u,%u,%s,%s,%d,%d,%f,%f,%f,%f,%.0f,%.0f,%.0f,%.2f,%u,%g,%s\n", seed, total_num_points, dim, num_centroids,
+           stats.nr_dpus, stats.nr_ranks, options->async ? "async" : "sync", cpu_engine_kernel(), cpu_engine_threads(), iterations,
+           check.cpu_time, engine_time, dpu_time, stats.setup_time, (double)total_num_points * iterations / check.cpu_time,
+           (double)total_num_points * iterations / engine_time, (double)total_num_points * iterations / dpu_time,
+           engine_time / dpu_time, check.mismatches, check.max_error, failed ? "FAIL" : "PASS");
+
+    free(points);
+    free(labels);
+    free(engine_labels);
+    return failed;
+}
 
+/* Names of enum kmeans_job_groups for -g */
+const char *group_names[] = { "dpu", "rank", "all" };
 
-int main() {
-    // Initialize the dataset
-    uint8_t points[TOTAL_NUM_POINTS * 2];
-
-    // Initialize the duplicate points array
-    uint8_t points_duplicate[TOTAL_NUM_POINTS * 2];
-
-    // Randomly generate the points
-    generate_points(points);
-
-    // Copy the points to the duplicate points array
-    for (int i = 0; i < TOTAL_NUM_POINTS * 2; i++) {
-        points_duplicate[i] = points[i];
+/*
+    Cluster nr_jobs independent random jobs at once on groups of DPUs, see kmeans_run_jobs
+    Every job has between max_points / 16 and max_points points of dim coordinates and between
+    2 and max_centroids centroids. Prints a CSV row per job, then the aggregate throughput.
+    Returns 0 when every job ran.
+*/
+int run_schedule(uint32_t nr_jobs, enum kmeans_job_groups groups, uint32_t max_points, uint32_t dim, uint32_t max_centroids, unsigned seed,
+                 const struct kmeans_options *options) {
+    struct kmeans_job *jobs = calloc(nr_jobs, sizeof(struct kmeans_job));
+    assert(jobs != NULL);
+
+    srand(seed);
+    uint32_t min_points = max_points / 16 > max_centroids ? max_points / 16 : max_centroids;
+    for (uint32_t i = 0; i < nr_jobs; i++) {
+        struct kmeans_job *job = &jobs[i];
+        job->num_points = min_points < max_points ? min_points + rand() % (max_points - min_points + 1) : max_points;
+        job->num_centroids = max_centroids > 2 ? 2 + rand() % (max_centroids - 1) : max_centroids;
+        job->dim = dim;
+        job->points = malloc((size_t)job->num_points * dim);
+        job->centroids = malloc((size_t)job->num_centroids * dim * sizeof(int32_t));
+        assert(job->points != NULL && job->centroids != NULL);
+        generate_points(job->points, job->num_points, dim);
+        kmeans_generate_centroids(job->centroids, job->num_centroids, job->points, job->num_points, dim);
     }
 
-    // Print the first 10 points
-    for (int i = 0; i < 19; i+=2) {
-        printf("Point %d: (%d, %d)\n", i/2, points[i], points[i + 1]);
+    struct kmeans_schedule_stats stats;
+    int failed = kmeans_run_jobs(jobs, nr_jobs, options->nr_dpus, groups, NULL, options, &stats);
+
+    printf("job,group,points,dims,centroids,iterations,converged,start_s,time_s,points_per_s,status\n");
+    for (uint32_t i = 0; i < nr_jobs; i++) {
+        const struct kmeans_job *job = &jobs[i];
+        printf("%u,%u,%u,%u,%u,%d,%d,%f,%f,%.0f,%s\n", i, job->group, job->num_points, job->dim, job->num_centroids, job->stats.iterations,
+               job->stats.converged, job->start, job->time, job->time > 0 ? job->num_points * job->stats.iterations / job->time : 0,
+               job->status ? "FAIL" : "PASS");
+        free(job->points);
+        free(job->centroids);
     }
+    printf("Jobs: %u on %u groups of %s, %u DPUs, %u failed\n", nr_jobs, stats.nr_groups, group_names[groups], stats.nr_dpus, stats.failed);
+    printf("Total time: %f s, alloc %f s, %.1f jobs/s, %.0f points/s, %.0f point passes/s\n", stats.total_time, stats.alloc_time,
+           nr_jobs / stats.total_time, stats.points / stats.total_time, stats.point_passes / stats.total_time);
 
-    // Start the timer
-    clock_t start, end;
-    start = clock();
+    free(jobs);
+    return failed;
+}
 
-    // Generate the centroids' index
-    uint16_t centroids[NUM_CENTROIDS];
-    for (int i = 0; i < NUM_CENTROIDS; i++){
-        // Generate random centroids index
-        centroids[i] = rand() % TOTAL_NUM_POINTS;
+/*
+    Run restarts k-means runs of the same points from different random initial centroids at
+    once on groups of DPUs, see kmeans_run_jobs. A group uploads the points once for all its restarts.
+    Every run computes the inertia of its final centroids on the DPUs and the run with the
+    lowest one is kept. Prints a CSV row per restart, then the best one, checked against the
+    CPU with check. Returns 0 when every restart ran and the check passed.
+*/
+int run_restarts(uint8_t *points, uint32_t total_num_points, uint32_t dim, uint32_t num_centroids, uint32_t restarts,
+                 enum kmeans_job_groups groups, int check, const struct kmeans_options *options) {
+    size_t values = (size_t)num_centroids * dim;
+    struct kmeans_job *jobs = calloc(restarts, sizeof(struct kmeans_job));
+    int32_t *initial_centroids = malloc(restarts * values * sizeof(int32_t));
+    int32_t *centroids = malloc(restarts * values * sizeof(int32_t));
+    assert(jobs != NULL && initial_centroids != NULL && centroids != NULL);
+    for (uint32_t r = 0; r < restarts; r++) {
+        struct kmeans_job *job = &jobs[r];
+        job->points = points;
+        job->num_points = total_num_points;
+        job->dim = dim;
+        job->num_centroids = num_centroids;
+        job->centroids = &centroids[r * values];
+        kmeans_generate_centroids(&initial_centroids[r * values], num_centroids, points, total_num_points, dim);
+        memcpy(job->centroids, &initial_centroids[r * values], values * sizeof(int32_t));
+        if (check) {
+            job->labels = malloc((size_t)total_num_points * sizeof(uint16_t));
+            assert(job->labels != NULL);
+        }
     }
 
-
-
-    /* Initialize the distance matrix: 
-            1. Each centroid is at the first elment of each row
-            2. The following elements are the distance between the centroid and the points
-            3. The distance is not euclidean distance, but the square of the euclidean distance
-    */
-    uint64_t distance_matrix[DISTANCE_MATRIX_SIZE];
-
-    // Calculate how many points each DPU will handle
-    int num_points_per_dpu = TOTAL_NUM_POINTS / DPU_NUMBER;
-
-    // Create a DPU set
-    struct dpu_set_t set, dpu;
-
-    // Calculate the distance matrix for each centroid, each time use all dpus to calculate
-    for (int i = 0; i < NUM_CENTROIDS; i++) {
-
-        DPU_ASSERT(dpu_alloc(DPU_NUMBER, NULL, &set));
-
-        // Load the distance matrix DPU
-        DPU_ASSERT(dpu_load(set, DISTANCE_MATRIX, NULL));
-        
-        // Populate the data to the DPUs
-        populate_mram(set, dpu, points, centroids[i]);
-
-        // Execute the DPU program
-        DPU_ASSERT(dpu_launch(set, DPU_SYNCHRONOUS));
-
-        // Initial dpu id
-        uint32_t each_dpu;
-
-        // Get the result from the DPUs
-        DPU_FOREACH(set, dpu, each_dpu){
-            // Prepare the data for each DPU
-            DPU_ASSERT(dpu_prepare_xfer(dpu, &distance_matrix[i * (TOTAL_NUM_POINTS + 1) + each_dpu * (num_points_per_dpu + 1)]));
+    struct kmeans_options run = *options;
+    run.inertia = 1;
+    struct kmeans_schedule_stats stats;
+    int failed = kmeans_run_jobs(jobs, restarts, options->nr_dpus, groups, NULL, &run, &stats);
+
+    // The best run has the lowest inertia
+    uint32_t best = restarts;
+    double worst = 0;
+    printf("restart,group,iterations,converged,inertia,time_s,status\n");
+    for (uint32_t r = 0; r < restarts; r++) {
+        const struct kmeans_job *job = &jobs[r];
+        printf("%u,%u,%d,%d,%f,%f,%s\n", r, job->group, job->stats.iterations, job->stats.converged, job->stats.inertia, job->time,
+               job->status ? "FAIL" : "PASS");
+        if (job->status == 0 && (best == restarts || job->stats.inertia < jobs[best].stats.inertia)) {
+            best = r;
         }
-
-        DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "distance", 0,  (num_points_per_dpu + 1) * sizeof(uint64_t), DPU_XFER_DEFAULT));
-
-        
-        // Free the DPUs
-        DPU_ASSERT(dpu_free(set));
-
-        // Copy duplicate points to the points array
-        for (int j = 0; j < TOTAL_NUM_POINTS * 2; j++) {
-            points[j] = points_duplicate[j];
+        if (job->status == 0 && job->stats.inertia > worst) {
+            worst = job->stats.inertia;
         }
     }
 
-    // End the timer
-    end = clock();
-
-
-    // Find the nearest centroid to each point
-    uint16_t nearest_centroid[TOTAL_NUM_POINTS];
-    find_nearest_centroid(distance_matrix, nearest_centroid, centroids);
-
-    // Calculate the number of points for each centroid
-    uint16_t num_points_per_centroid[NUM_CENTROIDS];
-    for (int i = 0; i < TOTAL_NUM_POINTS; i++) {
-        num_points_per_centroid[nearest_centroid[i]]++;
+    printf("Restarts: %u on %u groups of %s, %u DPUs, %u failed\n", restarts, stats.nr_groups, group_names[groups], stats.nr_dpus, stats.failed);
+    if (best < restarts) {
+        const struct kmeans_job *job = &jobs[best];
+        for (uint32_t i = 0; options->verbose && i < num_centroids; i++) {
+            printf("AVG Centroid %u: (", i);
+            for (uint32_t d = 0; d < dim; d++) {
+                printf(d == 0 ? "%.3f" : ", %.3f", (double)job->centroids[i * dim + d] / FIXED_ONE);
+            }
+            printf(")\n");
+        }
+        printf("Best restart: %u, inertia %f (worst %f), %d iterations%s\n", best, job->stats.inertia, worst, job->stats.iterations,
+               job->stats.converged ? ", converged" : "");
+    }
+    printf("Total time: %f s, alloc %f s, %.2f restarts/s\n", stats.total_time, stats.alloc_time, restarts / stats.total_time);
+
+    if (check && best < restarts) {
+        struct cpu_check result;
+        int check_failed = check_against_cpu(points, total_num_points, dim, &initial_centroids[best * values], jobs[best].centroids,
+                                             num_centroids, jobs[best].labels, jobs[best].stats.iterations - 1, &result);
+        printf("CPU check: %u of %u labels differ, largest centroid error %g (tolerance %g): %s\n", result.mismatches,
+               total_num_points, result.max_error, CENTROID_TOLERANCE, check_failed ? "FAIL" : "PASS");
+        failed |= check_failed;
     }
 
-    // Initialize the sum variables for each DPU
-    uint64_t dpu_sum[NUM_CENTROIDS * 2];
-
-    uint64_t total_sum[NUM_CENTROIDS * 2];
-
-    // Loop through all the centroids
-    for (int i = 0; i < NUM_CENTROIDS; i++) {
-
-        // For all 4 centroids, calculate the average coordinate
-        // Create a DPU set
-        DPU_ASSERT(dpu_alloc(DPU_NUMBER, NULL, &set));
-
-        // Load the average coordinate DPU
-        DPU_ASSERT(dpu_load(set, AVG_COORDINATE, NULL));
-
-        // Reconstruc the points array
-        
-        // Select the points that belong to current centroid
-        uint8_t points_centroid[TOTAL_NUM_POINTS * 2];
+    for (uint32_t r = 0; r < restarts; r++) {
+        free(jobs[r].labels);
+    }
+    free(jobs);
+    free(initial_centroids);
+    free(centroids);
+    return failed || best == restarts;
+}
 
-        // Initialize points_centroid
-        for (int j = 0; j < TOTAL_NUM_POINTS * 2; j++) {
-            points_centroid[j] = 0;
+/*
+    Search the points with num_queries random queries, the k nearest points of every query or,
+    with k 0, the whole distance matrix, on the DPUs of options->nr_dpus. Prints the time and
+    the queries per second, and with check compares every value with the CPU engine.
+    Returns 0 when the search ran and the check passed.
+*/
+int run_neighbours(uint8_t *points, uint32_t total_num_points, uint32_t dim, uint32_t num_queries, uint32_t k, int check,
+                   const struct kmeans_options *options) {
+    size_t values = (size_t)num_queries * (k != 0 ? k : total_num_points);
+    uint8_t *queries = malloc((size_t)num_queries * dim);
+    uint32_t *indices = calloc(values, sizeof(uint32_t));
+    uint32_t *distances = malloc(values * sizeof(uint32_t));
+    assert(queries != NULL && indices != NULL && distances != NULL);
+    generate_points(queries, num_queries, dim);
+
+    // The first search also loads the kernel, as the first fit does
+    struct kmeans_context *context = kmeans_create(options->nr_dpus, NULL);
+    if (context == NULL) {
+        fprintf(stderr, "Cannot allocate %u DPUs\n", options->nr_dpus);
+        return 1;
+    }
+    int failed = kmeans_set_points(context, points, total_num_points, dim);
+    double start = kmeans_wall_time();
+    if (!failed) {
+        failed = k != 0 ? kmeans_knn(context, queries, num_queries, k, indices, distances) : kmeans_distances(context, queries, num_queries, distances);
+    }
+    double time = kmeans_wall_time() - start;
+    uint32_t nr_dpus = kmeans_nr_dpus(context);
+    kmeans_destroy(context);
+
+    for (uint32_t q = 0; !failed && k != 0 && q < 3 && q < num_queries; q++) {
+        printf("Query %u:", q);
+        for (uint32_t c = 0; c < k && c < 8; c++) {
+            printf(" %u (%u)", indices[(size_t)q * k + c], distances[(size_t)q * k + c]);
         }
+        printf(k > 8 ? " ...\n" : "\n");
+    }
+    if (!failed) {
+        printf("%s: %u queries against %u points of %u coordinates in %f s, %.1f queries/s, %.0f distances/s, %u DPUs\n",
+               k != 0 ? "Nearest neighbours" : "Distance matrix", num_queries, total_num_points, dim, time, num_queries / time,
+               (double)num_queries * total_num_points / time, nr_dpus);
+    }
 
-        // Put the points belong to the current centroid to the points_centroid array
-        int index = 0;
-        for (int j = 0; j < TOTAL_NUM_POINTS; j++) {
-            if (nearest_centroid[j] == i) {
-                points_centroid[index] = points[j * 2];
-                points_centroid[index + 1] = points[j * 2 + 1];
-                index += 2;
-            }
+    // The CPU engine returns the same distances, ties and order
+    if (!failed && check) {
+        uint32_t *cpu_indices = calloc(values, sizeof(uint32_t));
+        uint32_t *cpu_distances = malloc(values * sizeof(uint32_t));
+        assert(cpu_indices != NULL && cpu_distances != NULL);
+        context = kmeans_create(0, NULL);
+        kmeans_set_points(context, points, total_num_points, dim);
+        start = kmeans_wall_time();
+        if (k != 0) {
+            kmeans_knn(context, queries, num_queries, k, cpu_indices, cpu_distances);
+        } else {
+            kmeans_distances(context, queries, num_queries, cpu_distances);
         }
-        
+        double cpu_time = kmeans_wall_time() - start;
+        kmeans_destroy(context);
 
-        // Populate the data to the DPUs
-        populate_mram_avg(set, dpu, points_centroid);
-
-        // Execute the DPU program
-        DPU_ASSERT(dpu_launch(set, DPU_SYNCHRONOUS));
+        size_t mismatches = 0;
+        for (size_t i = 0; i < values; i++) {
+            mismatches += indices[i] != cpu_indices[i] || distances[i] != cpu_distances[i];
+        }
+        failed = mismatches != 0;
+        printf("CPU check: %zu of %zu values differ, CPU %f s: %s\n", mismatches, values, cpu_time, failed ? "FAIL" : "PASS");
+        free(cpu_indices);
+        free(cpu_distances);
+    }
 
-        
+    free(queries);
+    free(indices);
+    free(distances);
+    return failed;
+}
 
-        uint32_t each_dpu;
-        // Get the result from the DPUs
-        DPU_FOREACH(set, dpu, each_dpu){
-            // Prepare the data for each DPU
-            DPU_ASSERT(dpu_prepare_xfer(dpu, &dpu_sum[each_dpu * 2]));
+/*
+    Usage: kmeans [-n points] [-D dims] [-k centroids] [-d dpus|all] [-i iterations] [-t fraction] [-e tolerance] [-r] [-a] [-p] [-P] [-H] [-b strong|weak|cpu] [-c] [-o report] [-s seed]
+              [-f dataset [-m batch]] [-w dataset] [-S socket [-B batch] [-W wait_us]] [-q socket [-C clients] [-R requests]]
+              [-j jobs [-g dpu|rank|all]] [-x restarts [-g dpu|rank|all]] [-N neighbours|-M [-Q queries]]
+        -n  number of points (default 4092), per DPU with -b weak
+        -D  coordinates per point (default 2, at most MAX_DIM)
+        -k  number of centroids (default 4, at most MAX_CENTROIDS and MAX_CENTROID_VALUES coordinates in total)
+        -d  number of DPUs or "all" for every available DPU (default 4), the largest count with -b.
+            0, or "all" without DPUs, runs on the CPU engine
+        -i  most refinement iterations after the first pass (default 9)
+        -t  stop once at most this fraction of the labels changed in a pass (default 0)
+        -e  stop once no centroid moved farther than this, in coordinate units (default 0,
+            the centroids stopped moving), -1 turns the check off
+        -r  recreate the DPU set (alloc, load, push points) before every launch,
+            like the original flow did, to benchmark the session against it
+        -a  launch asynchronously, each rank's results are fetched and reduced as soon as
+            it finishes while the other ranks keep computing
+        -p  prune the assignment with Hamerly distance bounds kept in MRAM, the labels are
+            the same but most distances of the later iterations are skipped
+        -P  seed with k-means++ instead of random points, the squared distances to the seeds
+            are computed on the DPUs and only one tile of them is copied back per seed
+        -H  2-D points only: count the points into a 256 x 256 histogram on the DPUs once,
+            iterate on the host over its occupied cells weighted with their counts and label
+            the points in one last launch, with the centroids and labels of a plain fit
+        -b  strong or weak scaling sweep over the DPU count, or one row comparing the DPUs
+            with the CPU baseline, printed as CSV
+        -c  check the labels and centroids against double precision k-means on the CPU
+        -o  write the phase times and DPU cycles of every iteration, CSV when the name ends
+            in .csv and JSON otherwise
+        -s  seed of the points and the initial centroids (default 1)
+        -f  read the points from a dataset file (see dataset.h) instead of generating -n
+            points of -D coordinates, the file is mapped and used in place
+        -m  mini-batch k-means streaming the dataset through the DPUs in batches of this many
+            points, -i and -e then count and stop the passes over the file, without -p, -P or -H
+        -w  write -n random points of -D coordinates to a dataset file and exit
+        -S  after the fit, serve predicts of the model on this Unix socket until interrupted
+            (see server.h), the DPUs keep the model between requests
+        -B  most points labelled in one batch of coalesced requests, and in one request
+            (default 65536)
+        -W  microseconds a batch that is not full waits for more requests (default 0)
+        -q  load the server on this socket with -C clients sending -R requests of -n points
+            of -D coordinates each, at most the -B of the server, print the latency and
+            throughput as CSV and exit
+        -j  cluster this many independent jobs at once, each of up to -n points and -k
+            centroids, and print the time of every job and the jobs per second
+        -x  run this many restarts from different random initial centroids at once, compute
+            the inertia of every run on the DPUs and keep the lowest, with -p every run ends
+            with one unbounded assignment for its inertia
+        -g  split the DPUs of -j or -x into a group per DPU, per rank, or a single group of all
+            of them, every group runs one job or restart at a time (default dpu with -j and
+            rank with -x). The DPUs of a rank fit their jobs in the same launches, without -p
+            or -H
+        -N  instead of a fit, find this many nearest points of every one of -Q random queries
+            (default 1024), every DPU keeps its best candidates per query and only those
+            are copied back
+        -M  instead of a fit, compute the distance matrix of the -Q queries to every point
+*/
+int main(int argc, char **argv) {
+    uint32_t total_num_points = TOTAL_NUM_POINTS;
+    uint32_t dim = 2;
+    uint32_t num_centroids = NUM_CENTROIDS;
+    struct kmeans_options options = {
+        .nr_dpus = DPU_NUMBER,
+        .iterations = 9,
+        .max_changed = 0,
+        .tolerance = 0,
+        .reload_per_launch = 0,
+        .async = 0,
+        .bounded = 0,
+        .plusplus = 0,
+        .seeds = NULL,
+        .inertia = 0,
+        .histogram = 0,
+        .verbose = 1,
+        .report = NULL,
+    };
+    const char *scaling = NULL;
+    int check = 0;
+    unsigned seed = 1;
+    const char *dataset = NULL;
+    const char *write_path = NULL;
+    uint32_t batch_points = 0;
+    const char *serve_path = NULL;
+    uint32_t serve_batch_points = 65536;
+    double serve_wait = 0;
+    const char *query_path = NULL;
+    uint32_t query_clients = 4;
+    uint32_t query_requests = 1000;
+    uint32_t nr_jobs = 0;
+    const char *job_groups = NULL;
+    uint32_t restarts = 0;
+    uint32_t neighbours = 0;
+    int matrix = 0;
+    uint32_t num_queries = 1024;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:D:k:d:i:t:e:rapPHb:co:s:f:m:w:S:B:W:q:C:R:j:g:x:N:MQ:")) != -1) {
+        switch (opt) {
+        case 'n': total_num_points = strtoul(optarg, NULL, 10); break;
+        case 'D': dim = strtoul(optarg, NULL, 10); break;
+        case 'k': num_centroids = strtoul(optarg, NULL, 10); break;
+        case 'd': options.nr_dpus = strcmp(optarg, "all") == 0 ? DPU_ALLOCATE_ALL : strtoul(optarg, NULL, 10); break;
+        case 'i': options.iterations = atoi(optarg); break;
+        case 't': options.max_changed = atof(optarg); break;
+        case 'e': options.tolerance = atof(optarg); break;
+        case 'r': options.reload_per_launch = 1; break;
+        case 'a': options.async = 1; break;
+        case 'p': options.bounded = 1; break;
+        case 'P': options.plusplus = 1; break;
+        case 'H': options.histogram = 1; break;
+        case 'b': scaling = optarg; break;
+        case 'c': check = 1; break;
+        case 'o': options.report = optarg; break;
+        case 's': seed = strtoul(optarg, NULL, 10); break;
+        case 'f': dataset = optarg; break;
+        case 'm': batch_points = strtoul(optarg, NULL, 10); break;
+        case 'w': write_path = optarg; break;
+        case 'S': serve_path = optarg; break;
+        case 'B': serve_batch_points = strtoul(optarg, NULL, 10); break;
+        case 'W': serve_wait = atof(optarg) * 1e-6; break;
+        case 'q': query_path = optarg; break;
+        case 'C': query_clients = strtoul(optarg, NULL, 10); break;
+        case 'R': query_requests = strtoul(optarg, NULL, 10); break;
+        case 'j': nr_jobs = strtoul(optarg, NULL, 10); break;
+        case 'g': job_groups = optarg; break;
+        case 'x': restarts = strtoul(optarg, NULL, 10); break;
+        case 'N': neighbours = strtoul(optarg, NULL, 10); break;
+        case 'M': matrix = 1; break;
+        case 'Q': num_queries = strtoul(optarg, NULL, 10); break;
+        default:
+            fprintf(stderr, "Usage: %s [-n points] [-D dims] [-k centroids] [-d dpus|all] [-i iterations] [-t fraction] [-e tolerance] [-r] [-a] [-p] [-P] [-H] [-b strong|weak|cpu] [-c] [-o report] [-s seed] "
+                            "[-f dataset [-m batch]] [-w dataset] [-S socket [-B batch] [-W wait_us]] [-q socket [-C clients] [-R requests]] [-j jobs [-g dpu|rank|all]] [-x restarts [-g dpu|rank|all]] "
+                            "[-N neighbours|-M [-Q queries]]\n", argv[0]);
+            return EXIT_FAILURE;
         }
+    }
 
-        DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "total", 0, 2 * sizeof(uint64_t), DPU_XFER_DEFAULT));
-        
-        // Free the DPUs
-        DPU_ASSERT(dpu_free(set));
-
-        // Calculate the total sum
-        total_sum[i * 2] = 0;
-        total_sum[i * 2 + 1] = 0;
-        for (int j = 0; j < DPU_NUMBER; j++) {
-            total_sum[i * 2] += dpu_sum[j * 2];
-            total_sum[i * 2 + 1] += dpu_sum[j * 2 + 1];
+    // The client only needs the shape of its requests
+    if (query_path != NULL) {
+        if (query_clients == 0 || dim == 0 || dim > MAX_DIM || total_num_points == 0) {
+            fprintf(stderr, "Invalid load: %u clients, %u points of %u coordinates per request\n", query_clients, total_num_points, dim);
+            return EXIT_FAILURE;
         }
-
+        return run_server_bench(query_path, dim, query_clients, query_requests, total_num_points, seed) ? EXIT_FAILURE : 0;
     }
-
-
-    // Print the total sum
-    for (int i = 0; i < NUM_CENTROIDS; i++) {
-        printf("Total sum Centroid %d: (%lu, %lu)\n", i, total_sum[i * 2], total_sum[i * 2 + 1]);
+    if (serve_path != NULL && (batch_points != 0 || scaling != NULL || serve_batch_points == 0)) {
+        fprintf(stderr, "-S serves the model of a single fit with batches of at least one point\n");
+        return EXIT_FAILURE;
+    }
+    if (batch_points != 0 && dataset == NULL) {
+        fprintf(stderr, "-m streams the dataset file of -f\n");
+        return EXIT_FAILURE;
+    }
+    if (batch_points != 0 && options.plusplus) {
+        fprintf(stderr, "-P seeds from the resident points and cannot be combined with -m\n");
+        return EXIT_FAILURE;
+    }
+    if (batch_points != 0 && options.bounded) {
+        fprintf(stderr, "-p keeps bounds of the resident points and cannot be combined with -m\n");
+        return EXIT_FAILURE;
+    }
+    if (nr_jobs != 0 && (dataset != NULL || scaling != NULL || serve_path != NULL || write_path != NULL || restarts != 0)) {
+        fprintf(stderr, "-j generates its own jobs and cannot be combined with -f, -b, -S, -w or -x\n");
+        return EXIT_FAILURE;
     }
-    
-    // Calculate the average coordinate for each centroid use total_sum
-    int avg[NUM_CENTROIDS * 2];
-    for (int i = 0; i < NUM_CENTROIDS; i++) {
-        avg[i * 2] = total_sum[i * 2] / num_points_per_centroid[i];
-        avg[i * 2 + 1] = total_sum[i * 2 + 1] / num_points_per_centroid[i];
+    if ((nr_jobs != 0 || restarts != 0) && (options.plusplus || options.reload_per_launch || options.report != NULL)) {
+        fprintf(stderr, "-j and -x run from random initial centroids, without -P, -r or -o\n");
+        return EXIT_FAILURE;
+    }
+    if (nr_jobs != 0 && check) {
+        fprintf(stderr, "-j cannot check its jobs with -c\n");
+        return EXIT_FAILURE;
+    }
+    if (restarts != 0 && (batch_points != 0 || scaling != NULL || serve_path != NULL || write_path != NULL)) {
+        fprintf(stderr, "-x restarts a single fit and cannot be combined with -m, -b, -S or -w\n");
+        return EXIT_FAILURE;
     }
 
-    // Print the average coordinates
-    for (int i = 0; i < NUM_CENTROIDS; i++) {
-        printf("AVG Centroid %d: (%d, %d)\n", i, avg[i * 2], avg[i * 2 + 1]);
+    if ((neighbours != 0 || matrix) && (batch_points != 0 || scaling != NULL || serve_path != NULL || nr_jobs != 0 || restarts != 0 ||
+                                        (neighbours != 0 && matrix) || num_queries == 0)) {
+        fprintf(stderr, "-N or -M searches the points with at least one query and cannot be combined with -m, -b, -S, -j or -x\n");
+        return EXIT_FAILURE;
     }
 
-    /*
-        Update the centroids index by finding the closest point to the average coordinate in each cluster
+    // Jobs are small enough for a DPU each, restarts cluster every point on a rank each
+    if (job_groups == NULL) {
+        job_groups = restarts != 0 ? "rank" : "dpu";
+    }
+    enum kmeans_job_groups groups = strcmp(job_groups, "rank") == 0 ? KMEANS_JOB_GROUP_RANK : strcmp(job_groups, "all") == 0 ? KMEANS_JOB_GROUP_ALL : KMEANS_JOB_GROUP_DPU;
+    if (strcmp(job_groups, "dpu") != 0 && groups == KMEANS_JOB_GROUP_DPU) {
+        fprintf(stderr, "Unknown groups %s, expected dpu, rank or all\n", job_groups);
+        return EXIT_FAILURE;
+    }
+    if ((nr_jobs != 0 || restarts != 0) && groups == KMEANS_JOB_GROUP_DPU && (options.bounded || options.histogram)) {
+        fprintf(stderr, "-g dpu fits the jobs of a rank in the same launches and cannot be combined with -p or -H\n");
+        return EXIT_FAILURE;
+    }
+    if (dataset != NULL && scaling != NULL) {
+        fprintf(stderr, "-b generates its own points and cannot read -f\n");
+        return EXIT_FAILURE;
+    }
 
-    */
-    for (int i = 0; i < NUM_CENTROIDS; i++)
-    {
-        // Loop through all the points belong to the current centroid
-        uint64_t min_distance = UINT64_MAX;
-        uint16_t min_index = 0;
-        for (int j = 0; j < TOTAL_NUM_POINTS; j++)
-        {
-            if (nearest_centroid[j] == i)
-            {
-                uint64_t dx = avg[i * 2] - points[j * 2];
-                uint64_t dy = avg[i * 2 + 1] - points[j * 2 + 1];
-                uint64_t dist = dx * dx + dy * dy;
-                if (dist < min_distance)
-                {
-                    min_distance = dist;
-                    min_index = j;
-                }
-            }
-            // Update the centroids
-            centroids[i] = min_index;
+    // The size of a dataset comes from its header, streamed files are only read in batches
+    struct dataset mapped = { .map = NULL };
+    if (dataset != NULL && batch_points != 0) {
+        FILE *file = fopen(dataset, "rb");
+        struct dataset_header header;
+        if (file == NULL) {
+            perror(dataset);
+            return EXIT_FAILURE;
+        }
+        int failed = dataset_read_header(file, dataset, &header);
+        fclose(file);
+        if (failed) {
+            return EXIT_FAILURE;
         }
+        dim = header.dim;
+    } else if (dataset != NULL) {
+        if (dataset_open(&mapped, dataset) != 0) {
+            return EXIT_FAILURE;
+        }
+        if (mapped.num_points > UINT32_MAX) {
+            fprintf(stderr, "%s: %" PRIu64 " points, stream them with -m\n", dataset, mapped.num_points);
+            return EXIT_FAILURE;
+        }
+        total_num_points = mapped.num_points;
+        dim = mapped.dim;
     }
 
+    if (total_num_points == 0 || num_centroids == 0 || num_centroids > MAX_CENTROIDS || num_centroids > total_num_points) {
+        fprintf(stderr, "Invalid sizes: %u points, %u centroids (at most %u), %u DPUs\n", total_num_points, num_centroids, MAX_CENTROIDS, options.nr_dpus);
+        return EXIT_FAILURE;
+    }
+    if (dim == 0 || dim > MAX_DIM || num_centroids * kmeans_dim_bucket(dim) > MAX_CENTROID_VALUES) {
+        fprintf(stderr, "Invalid dimension: %u coordinates (at most %u), at most %u centroid coordinates in total\n", dim, MAX_DIM, MAX_CENTROID_VALUES);
+        return EXIT_FAILURE;
+    }
 
-    // Go in the interactive mode
-    int iterations = 9;
-    for (int iter = 0; iter < iterations; iter++) {
-        // Calculate the distance matrix use DPUs
-        for (int i = 0; i < NUM_CENTROIDS; i++) {
+    if (write_path != NULL) {
+        return write_dataset(write_path, total_num_points, dim, seed) ? EXIT_FAILURE : 0;
+    }
 
-            DPU_ASSERT(dpu_alloc(DPU_NUMBER, NULL, &set));
+    // The bounds live only in MRAM, recreating the DPU set would lose them
+    if (options.bounded && options.reload_per_launch) {
+        fprintf(stderr, "-p keeps the distance bounds in MRAM and cannot be combined with -r\n");
+        return EXIT_FAILURE;
+    }
 
-            // Load the distance matrix DPU
-            DPU_ASSERT(dpu_load(set, DISTANCE_MATRIX, NULL));
-            
-            // Populate the data to the DPUs
-            populate_mram(set, dpu, points, centroids[i]);
+    // The iterations of the histogram run on the host, over cells of two coordinates
+    if (options.histogram && (dim != 2 || options.bounded || options.reload_per_launch || options.report != NULL || batch_points != 0)) {
+        fprintf(stderr, "-H clusters resident 2-D points and cannot be combined with -p, -r, -o or -m\n");
+        return EXIT_FAILURE;
+    }
 
-            // Execute the DPU program
-            DPU_ASSERT(dpu_launch(set, DPU_SYNCHRONOUS));
+    // Fall back to the CPU engine on hosts without DPUs
+    if (options.nr_dpus == DPU_ALLOCATE_ALL && kmeans_available_dpus() == 0) {
+        fprintf(stderr, "No DPUs available, running on the CPU\n");
+        options.nr_dpus = 0;
+    }
 
-            // Initial dpu id
-            uint32_t each_dpu;
+    if (nr_jobs != 0) {
+        return run_schedule(nr_jobs, groups, total_num_points, dim, num_centroids, seed, &options) ? EXIT_FAILURE : 0;
+    }
 
-            // Get the result from the DPUs
-            DPU_FOREACH(set, dpu, each_dpu){
-                // Prepare the data for each DPU
-                DPU_ASSERT(dpu_prepare_xfer(dpu, &distance_matrix[i * (TOTAL_NUM_POINTS + 1) + each_dpu * (num_points_per_dpu + 1)]));
+    if (batch_points != 0) {
+        int32_t centroids[num_centroids * dim];
+        uint64_t num_points;
+        struct kmeans_stats stats;
+        if (kmeans_run_minibatch(dataset, dim, num_centroids, batch_points, seed, NULL, &options, centroids, &num_points, &stats) != 0) {
+            return EXIT_FAILURE;
+        }
+        for (uint32_t i = 0; options.verbose && i < num_centroids; i++) {
+            printf("AVG Centroid %u: (", i);
+            for (uint32_t d = 0; d < dim; d++) {
+                printf(d == 0 ? "%.3f" : ", %.3f", (double)centroids[i * dim + d] / FIXED_ONE);
             }
+            printf(")\n");
+        }
+        printf("Mini-batch: %" PRIu64 " points in %d passes%s of %u point batches, %u DPUs\n", num_points, stats.iterations,
+               stats.converged ? ", converged" : "", batch_points, stats.nr_dpus);
+        printf("Total time: %f s, setup %f s, reading %f s overlapped, %.0f points/s\n", stats.total_time, stats.setup_time,
+               stats.read_time, num_points / (stats.total_time - stats.setup_time));
+        return 0;
+    }
 
-            DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "distance", 0,  (num_points_per_dpu + 1) * sizeof(uint64_t), DPU_XFER_DEFAULT));
-
-            
-            // Free the DPUs
-            DPU_ASSERT(dpu_free(set));
-
-            // Copy duplicate points to the points array
-            for (int j = 0; j < TOTAL_NUM_POINTS * 2; j++) {
-                points[j] = points_duplicate[j];
-            }
+    if (scaling != NULL && strcmp(scaling, "cpu") == 0) {
+        return run_benchmark(total_num_points, dim, num_centroids, seed, &options) ? EXIT_FAILURE : 0;
+    }
+    if (scaling != NULL) {
+        if (strcmp(scaling, "strong") != 0 && strcmp(scaling, "weak") != 0) {
+            fprintf(stderr, "Unknown benchmark %s, expected strong, weak or cpu\n", scaling);
+            return EXIT_FAILURE;
         }
+        run_scaling(strcmp(scaling, "weak") == 0, total_num_points, dim, num_centroids, seed, &options);
+        return 0;
+    }
 
-        // Find the nearest centroid to each point
-        find_nearest_centroid(distance_matrix, nearest_centroid, centroids);
+    // Use the mapped dataset in place, or randomly generate the points
+    uint8_t *points = mapped.points;
+    srand(seed);
+    if (points == NULL) {
+        points = malloc((size_t)total_num_points * dim);
+        assert(points != NULL);
+        generate_points(points, total_num_points, dim);
+    }
 
-        // Calculate the number of points for each centroid
-        for (int i = 0; i < NUM_CENTROIDS; i++) {
-            num_points_per_centroid[i] = 0;
+    // Print the first 10 points
+    for (uint32_t i = 0; i < 10 && i < total_num_points; i++) {
+        printf("Point %u: (", i);
+        for (uint32_t d = 0; d < dim; d++) {
+            printf(d == 0 ? "%d" : ", %d", points[(size_t)i * dim + d]);
         }
+        printf(")\n");
+    }
 
-        for (int i = 0; i < TOTAL_NUM_POINTS; i++) {
-            num_points_per_centroid[nearest_centroid[i]]++;
+    if (neighbours != 0 || matrix) {
+        int failed = run_neighbours(points, total_num_points, dim, num_queries, neighbours, check, &options);
+        if (mapped.map != NULL) {
+            dataset_close(&mapped);
+        } else {
+            free(points);
         }
+        return failed ? EXIT_FAILURE : 0;
+    }
 
-        // Initialize the sum variables for each DPU
-        for (int i = 0; i < NUM_CENTROIDS; i++) {
-            dpu_sum[i * 2] = 0;
-            dpu_sum[i * 2 + 1] = 0;
+    if (restarts != 0) {
+        int failed = run_restarts(points, total_num_points, dim, num_centroids, restarts, groups, check, &options);
+        if (mapped.map != NULL) {
+            dataset_close(&mapped);
+        } else {
+            free(points);
         }
+        return failed ? EXIT_FAILURE : 0;
+    }
 
-        // Loop through all the centroids
-        for (int i = 0; i < NUM_CENTROIDS; i++) {
-
-            // For all 4 centroids, calculate the average coordinate
-            // Create a DPU set
-            DPU_ASSERT(dpu_alloc(DPU_NUMBER, NULL, &set));
-
-            // Load the average coordinate DPU
-            DPU_ASSERT(dpu_load(set, AVG_COORDINATE, NULL));
-
-            // Reconstruc the points array
-            
-            // Select the points that belong to current centroid
-            uint8_t points_centroid[TOTAL_NUM_POINTS * 2];
-
-            // Initialize points_centroid
-            for (int j = 0; j < TOTAL_NUM_POINTS * 2; j++) {
-                points_centroid[j] = 0;
-            }
-
-            // Put the points belong to the current centroid to the points_centroid array
-            int index = 0;
-            for (int j = 0; j < TOTAL_NUM_POINTS; j++) {
-                if (nearest_centroid[j] == i) {
-                    points_centroid[index] = points[j * 2];
-                    points_centroid[index + 1] = points[j * 2 + 1];
-                    index += 2;
-                }
-            }
-            
-
-            // Populate the data to the DPUs
-            populate_mram_avg(set, dpu, points_centroid);
-
-            // Execute the DPU program
-            DPU_ASSERT(dpu_launch(set, DPU_SYNCHRONOUS));
-
-            
-
-            uint32_t each_dpu;
-            // Get the result from the DPUs
-            DPU_FOREACH(set, dpu, each_dpu){
-                // Prepare the data for each DPU
-                DPU_ASSERT(dpu_prepare_xfer(dpu, &dpu_sum[each_dpu * 2]));
-            }
-
-            DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "total", 0, 2 * sizeof(uint64_t), DPU_XFER_DEFAULT));
-            
-            // Free the DPUs
-            DPU_ASSERT(dpu_free(set));
-
-            // Calculate the total sum
-            total_sum[i * 2] = 0;
-            total_sum[i * 2 + 1] = 0;
-            for (int j = 0; j < DPU_NUMBER; j++) {
-                total_sum[i * 2] += dpu_sum[j * 2];
-                total_sum[i * 2 + 1] += dpu_sum[j * 2 + 1];
-            }
+    // Generate the initial centroids, k-means++ seeds them inside the run
+    int32_t initial_centroids[num_centroids * dim];
+    int32_t centroids[num_centroids * dim];
+    if (options.plusplus) {
+        options.seeds = initial_centroids;
+        memset(centroids, 0, sizeof(centroids));
+    } else {
+        kmeans_generate_centroids(initial_centroids, num_centroids, points, total_num_points, dim);
+        memcpy(centroids, initial_centroids, sizeof(centroids));
+    }
 
-        }
+    uint16_t *labels = NULL;
+    if (check) {
+        labels = malloc((size_t)total_num_points * sizeof(uint16_t));
+        assert(labels != NULL);
+    }
 
-        // Calculate the average coordinate for each centroid use total_sum
-        for (int i = 0; i < NUM_CENTROIDS; i++) {
-            avg[i * 2] = total_sum[i * 2] / num_points_per_centroid[i];
-            avg[i * 2 + 1] = total_sum[i * 2 + 1] / num_points_per_centroid[i];
-        }
+    // One fit on a context of its own, the DPUs stay allocated until it is destroyed
+    struct kmeans_context *context = kmeans_create(options.nr_dpus, NULL);
+    if (context == NULL) {
+        fprintf(stderr, "Cannot allocate %u DPUs\n", options.nr_dpus);
+        return EXIT_FAILURE;
+    }
+    struct kmeans_stats stats;
+    if (kmeans_set_points(context, points, total_num_points, dim) != 0 ||
+        kmeans_fit(context, centroids, num_centroids, labels, &options, &stats) != 0) {
+        kmeans_destroy(context);
+        return EXIT_FAILURE;
+    }
 
-        // Print the average coordinates
-        for (int i = 0; i < NUM_CENTROIDS; i++) {
-            printf("AVG Centroid %d: (%d, %d)\n", i, avg[i * 2], avg[i * 2 + 1]);
-        }
+    printf("Setup time: %f s\n", stats.setup_time);
+    if (options.plusplus) {
+        printf("Seeding time: %f s (k-means++, part of the setup)\n", stats.seed_time);
+    }
+    if (options.histogram) {
+        printf("Histogram: %u occupied cells of %u points, counted in %f s (part of the setup)\n", stats.cells, total_num_points,
+               stats.histogram_time);
+    }
+    printf("Total time: %f s (%d iterations%s, %u points of %u coordinates, %u centroids, %u DPUs, %s, %s)\n", stats.total_time, stats.iterations,
+           stats.converged ? ", converged" : "",
+           total_num_points, dim, num_centroids, stats.nr_dpus,
+           options.reload_per_launch ? "DPU set recreated per launch" : "persistent DPU session",
+           options.async ? "asynchronous" : "synchronous");
+    printf("Phases:");
+    for (int phase = 0; phase < KMEANS_NR_PHASES; phase++) {
+        printf(" %s %f s", kmeans_phase_names[phase], stats.phase_time[phase]);
+    }
+    printf("\n");
+    if (options.bounded && stats.nr_dpus != 0) {
+        uint64_t distances = (uint64_t)stats.iterations * total_num_points * num_centroids;
+        printf("Distances skipped: %" PRIu64 " of %" PRIu64 " (%.1f%%)\n", stats.skipped, distances, 100.0 * stats.skipped / distances);
+    }
 
-        /*
-            Update the centroids index by finding the closest point to the average coordinate in each cluster
+    int failed = 0;
+    if (check) {
+        struct cpu_check result;
+        failed = check_against_cpu(points, total_num_points, dim, initial_centroids, centroids, num_centroids, labels,
+                                   stats.iterations - 1, &result);
+        printf("CPU check: %u of %u labels differ, largest centroid error %g (tolerance %g): %s\n", result.mismatches,
+               total_num_points, result.max_error, CENTROID_TOLERANCE, failed ? "FAIL" : "PASS");
+        free(labels);
+    }
 
-        */
-        for (int i = 0; i < NUM_CENTROIDS; i++)
-        {
-            // Loop through all the points belong to the current centroid
-            uint64_t min_distance = UINT64_MAX;
-            uint16_t min_index = 0;
-            for (int j = 0; j < TOTAL_NUM_POINTS; j++)
-            {
-                if (nearest_centroid[j] == i)
-                {
-                    uint64_t dx = avg[i * 2] - points[j * 2];
-                    uint64_t dy = avg[i * 2 + 1] - points[j * 2 + 1];
-                    uint64_t dist = dx * dx + dy * dy;
-                    if (dist < min_distance)
-                    {
-                        min_distance = dist;
-                        min_index = j;
-                    }
-                }
-                // Update the centroids
-                centroids[i] = min_index;
-            }
-        }
+    // The context keeps the fitted model for the predicts of the server
+    if (serve_path != NULL && !failed) {
+        failed = run_server(context, serve_path, dim, serve_batch_points, serve_wait);
+    }
+    kmeans_destroy(context);
 
+    if (mapped.map != NULL) {
+        dataset_close(&mapped);
+    } else {
+        free(points);
     }
 
-    return 0;
+    return failed ? EXIT_FAILURE : 0;
 }
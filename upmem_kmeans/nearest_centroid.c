@@ -0,0 +1,139 @@
+#include <defs.h>
+#include <mram.h>
+#include <alloc.h>
+#include <perfcounter.h>
+#include <stdint.h>
+#include <barrier.h>
+#include <vmutex.h>
+
+#include "common.h"
+
+// The tasklet count comes from the build, see common.h
+#ifndef NR_TASKLETS
+#error "NR_TASKLETS must be set by the build, e.g. -DNR_TASKLETS=16"
+#endif
+
+// Number of points resident on this DPU, set by the host after each load
+__host uint32_t num_points;
+
+// All centroids, DIM Q16.16 coordinates each, and their squared norms in Q32.32,
+// broadcast by the host before each launch
+__host uint32_t num_centroids;
+__host uint32_t centroids[MAX_CENTROID_VALUES];
+__host int64_t centroid_norms[MAX_CENTROIDS];
+
+// Number of points whose nearest centroid changed in this launch
+__host uint32_t changed;
+
+// Sum of the squared distances of the points to their nearest centroid in Q16.16, the inertia
+__host uint64_t inertia;
+
+// Cycles of this launch, from the start of tasklet 0 to the end of the reduction
+__host uint64_t cycles;
+uint32_t changed_tasklet[NR_TASKLETS];
+uint64_t inertia_tasklet[NR_TASKLETS];
+
+// Barrier for synchronization
+BARRIER_INIT(my_barrier, NR_TASKLETS);
+
+/*
+    Find the index of the nearest centroid to a point of DIM coordinates
+    |p - c|^2 = |p|^2 - 2 p.c + |c|^2, |p|^2 is the same for every centroid, so the nearest
+    centroid minimizes |c|^2 - 2 p.c. In Q32.32 this is exact and needs only 32 bit products.
+    The squared distance itself, |p|^2 added back in Q32.32, is returned in Q16.16 through distance.
+*/
+uint16_t nearest_centroid(uint8_t *point, uint64_t *distance) {
+    uint32_t norm = 0;
+    int64_t min_distance = INT64_MAX;
+    uint16_t min_centroid = 0;
+    #pragma unroll
+    for (uint32_t d = 0; d < DIM; d++) {
+        norm += point[d] * point[d];
+    }
+    for (uint32_t j = 0; j < num_centroids; j++) {
+        uint32_t *centroid = &centroids[j * DIM];
+        uint64_t dot = 0;
+        #pragma unroll
+        for (uint32_t d = 0; d < DIM; d++) {
+            dot += point[d] * centroid[d];
+        }
+        int64_t partial = centroid_norms[j] - (int64_t)(dot << (FIXED_SHIFT + 1));
+        if (partial < min_distance) {
+            min_distance = partial;
+            min_centroid = j;
+        }
+    }
+    *distance = (uint64_t)(((int64_t)norm << 32) + min_distance) >> FIXED_SHIFT;
+    return min_centroid;
+}
+
+int main() {
+    // Get tasklet ID
+    uint32_t tasklet_id = me();
+
+    // Tasklet 0 resets the cycle counter, a second reset by another tasklet would lose cycles.
+    // It also resets the WRAM heap, which is only reset by a load and this binary may be
+    // launched again without one, the barrier keeps the tiles from being taken before it.
+    if (tasklet_id == 0) {
+        mem_reset();
+        perfcounter_config(COUNT_CYCLES, true);
+    }
+    barrier_wait(&my_barrier);
+
+    // Points and the labels of the previous launch are resident in the MRAM heap
+    __mram_ptr uint8_t *points = (__mram_ptr uint8_t *)DPU_MRAM_HEAP_POINTER + POINTS_OFFSET;
+    __mram_ptr uint16_t *labels = (__mram_ptr uint16_t *)((__mram_ptr uint8_t *)DPU_MRAM_HEAP_POINTER + LABELS_OFFSET);
+
+    // WRAM tiles of this tasklet
+    uint8_t *point_block = mem_alloc(TILE_POINTS * DIM);
+    uint16_t *label_block = mem_alloc(TILE_POINTS * sizeof(uint16_t));
+    uint32_t local_changed = 0;
+    uint64_t local_inertia = 0;
+
+    // Tasklets take the tiles in turn, a tile is never shared so no two tasklets write the same labels.
+    // When the tiles do not divide evenly the first tasklets take one tile more.
+    uint32_t num_blocks = (num_points + TILE_POINTS - 1) / TILE_POINTS;
+    for (uint32_t b = tasklet_id; b < num_blocks; b += NR_TASKLETS) {
+        mram_read(&points[b * TILE_POINTS * DIM], point_block, TILE_POINTS * DIM);
+        mram_read(&labels[b * TILE_POINTS], label_block, TILE_POINTS * sizeof(uint16_t));
+
+        // The last block may be partially filled
+        uint32_t count = num_points - b * TILE_POINTS;
+        if (count > TILE_POINTS) {
+            count = TILE_POINTS;
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            uint64_t distance;
+            uint16_t label = nearest_centroid(&point_block[i * DIM], &distance);
+            local_inertia += distance;
+            if (label != label_block[i]) {
+                local_changed++;
+                label_block[i] = label;
+            }
+        }
+
+        mram_write(label_block, &labels[b * TILE_POINTS], TILE_POINTS * sizeof(uint16_t));
+    }
+
+    changed_tasklet[tasklet_id] = local_changed;
+    inertia_tasklet[tasklet_id] = local_inertia;
+
+    // Synchronize all tasklets
+    barrier_wait(&my_barrier);
+
+    // Tasklet 0 aggregates the number of changed labels and the inertia, at most 2^21 points of 2^39 each
+    if (tasklet_id == 0) {
+        uint32_t total_changed = 0;
+        uint64_t total_inertia = 0;
+        for (int i = 0; i < NR_TASKLETS; i++) {
+            total_changed += changed_tasklet[i];
+            total_inertia += inertia_tasklet[i];
+        }
+        changed = total_changed;
+        inertia = total_inertia;
+        cycles = perfcounter_get();
+    }
+
+    return 0;
+}
@@ -0,0 +1,124 @@
+#include <defs.h>
+#include <mram.h>
+#include <alloc.h>
+#include <perfcounter.h>
+#include <stdint.h>
+#include <barrier.h>
+#include <vmutex.h>
+
+#include "common.h"
+
+// The tasklet count comes from the build, see common.h
+#ifndef NR_TASKLETS
+#error "NR_TASKLETS must be set by the build, e.g. -DNR_TASKLETS=16"
+#endif
+
+// Number of points resident on this DPU, set by the host after each load
+__host uint32_t num_points;
+
+// The seed chosen last, DIM integer coordinates, and whether it is the first seed,
+// broadcast by the host before each launch
+__host uint32_t seed[DIM];
+__host uint32_t first_seed;
+
+// Sum of the squared distances of all points of this DPU to their nearest seed
+__host uint64_t total;
+
+// Points per tile, the host needs it to walk the tile sums
+__host uint32_t tile_points = TILE_POINTS;
+
+// Cycles of this launch, from the start of tasklet 0 to the end of the reduction
+__host uint64_t cycles;
+uint64_t total_tasklet[NR_TASKLETS];
+
+// Barrier for synchronization
+BARRIER_INIT(my_barrier, NR_TASKLETS);
+
+// Squared distance between a point and the seed, at most 128 * 255^2
+uint32_t seed_distance(uint8_t *point) {
+    uint32_t distance = 0;
+    #pragma unroll
+    for (uint32_t d = 0; d < DIM; d++) {
+        int32_t diff = point[d] - seed[d];
+        distance += diff * diff;
+    }
+    return distance;
+}
+
+/*
+    One step of k-means++ seeding
+        1. Lower the squared distance of every point to its nearest seed with the new seed,
+           the distances stay in MRAM from one seed to the next
+        2. Write the sum of every tile next to the distances, and the sum of the DPU to total
+    The host samples the next seed with probability proportional to the distance from total,
+    then the tile sums and then the distances of a single tile of a single DPU.
+*/
+int main() {
+    // Get tasklet ID
+    uint32_t tasklet_id = me();
+
+    // Tasklet 0 resets the cycle counter, a second reset by another tasklet would lose cycles.
+    // It also resets the WRAM heap, which is only reset by a load and this binary may be
+    // launched again without one, the barrier keeps the tiles from being taken before it.
+    if (tasklet_id == 0) {
+        mem_reset();
+        perfcounter_config(COUNT_CYCLES, true);
+    }
+    barrier_wait(&my_barrier);
+
+    // The points and the distances of the previous seeds are resident in the MRAM heap
+    __mram_ptr uint8_t *points = (__mram_ptr uint8_t *)DPU_MRAM_HEAP_POINTER + POINTS_OFFSET;
+    __mram_ptr uint64_t *distance = (__mram_ptr uint64_t *)((__mram_ptr uint8_t *)DPU_MRAM_HEAP_POINTER + DISTANCE_OFFSET);
+    __mram_ptr uint64_t *tile_sums = (__mram_ptr uint64_t *)((__mram_ptr uint8_t *)DPU_MRAM_HEAP_POINTER + TILE_SUMS_OFFSET);
+
+    // WRAM tiles of this tasklet
+    uint8_t *point_block = mem_alloc(TILE_POINTS * DIM);
+    uint64_t *distance_block = mem_alloc(TILE_POINTS * sizeof(uint64_t));
+    uint64_t *tile_sum = mem_alloc(sizeof(uint64_t));
+    uint64_t local_total = 0;
+
+    // Tasklets take the tiles in turn, a tile is never shared
+    uint32_t num_blocks = (num_points + TILE_POINTS - 1) / TILE_POINTS;
+    for (uint32_t b = tasklet_id; b < num_blocks; b += NR_TASKLETS) {
+        mram_read(&points[b * TILE_POINTS * DIM], point_block, TILE_POINTS * DIM);
+        if (!first_seed) {
+            mram_read(&distance[b * TILE_POINTS], distance_block, TILE_POINTS * sizeof(uint64_t));
+        }
+
+        // The last block may be partially filled, the rest of its tile is zero
+        uint32_t count = num_points - b * TILE_POINTS;
+        if (count > TILE_POINTS) {
+            count = TILE_POINTS;
+        }
+
+        *tile_sum = 0;
+        for (uint32_t i = 0; i < TILE_POINTS; i++) {
+            uint64_t d = i < count ? seed_distance(&point_block[i * DIM]) : 0;
+            if (first_seed || d < distance_block[i]) {
+                distance_block[i] = d;
+            }
+            *tile_sum += distance_block[i];
+        }
+
+        mram_write(distance_block, &distance[b * TILE_POINTS], TILE_POINTS * sizeof(uint64_t));
+        mram_write(tile_sum, &tile_sums[b], sizeof(uint64_t));
+        local_total += *tile_sum;
+    }
+
+    total_tasklet[tasklet_id] = local_total;
+
+    // Synchronize all tasklets
+    barrier_wait(&my_barrier);
+
+    // Tasklet 0 aggregates the sum of this DPU
+    if (tasklet_id == 0) {
+        uint64_t dpu_total = 0;
+        for (int i = 0; i < NR_TASKLETS; i++) {
+            dpu_total += total_tasklet[i];
+        }
+        total = dpu_total;
+        cycles = perfcounter_get();
+    }
+
+    return 0;
+}
@@ -0,0 +1,465 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "server.h"
+
+// Most clients connected at once, the others wait in the listen backlog
+#define SERVER_MAX_CLIENTS 256
+
+/* Latencies in seconds, percentiles are taken once at the end */
+struct latency_log {
+    double *values;
+    size_t count;
+    size_t capacity;
+};
+
+static void latency_add(struct latency_log *log, double value) {
+    if (log->count == log->capacity) {
+        log->capacity = log->capacity ? log->capacity * 2 : 1024;
+        log->values = realloc(log->values, log->capacity * sizeof(double));
+        assert(log->values != NULL);
+    }
+    log->values[log->count++] = value;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest rank percentile, sorts the log
+static double latency_percentile(struct latency_log *log, double percentile) {
+    if (log->count == 0) {
+        return 0;
+    }
+    qsort(log->values, log->count, sizeof(double), compare_double);
+    size_t rank = (size_t)(percentile / 100 * log->count + 0.999999);
+    return log->values[rank == 0 ? 0 : rank - 1];
+}
+
+// Send or receive exactly size bytes, returns 0 on success
+static int send_all(int fd, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    while (size != 0) {
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return 1;
+        }
+        bytes += sent;
+        size -= sent;
+    }
+    return 0;
+}
+
+static int recv_all(int fd, void *data, size_t size) {
+    uint8_t *bytes = data;
+    while (size != 0) {
+        ssize_t received = recv(fd, bytes, size, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return 1;
+        }
+        bytes += received;
+        size -= received;
+    }
+    return 0;
+}
+
+/* A client connection and the request it is sending or waiting on */
+struct server_client {
+    int fd;                         // -1 when the slot is free
+    struct server_request request;
+    size_t received;                // Bytes of the request received, header included
+    uint8_t *points;                // num_points * dim coordinates of the request
+    int pending;                    // The request is complete and waits for its batch
+    double arrival;                 // When the request was complete
+};
+
+static volatile sig_atomic_t stopping;
+
+static void stop_server(int signal) {
+    (void)signal;
+    stopping = 1;
+}
+
+static void client_close(struct server_client *client) {
+    close(client->fd);
+    free(client->points);
+    client->fd = -1;
+    client->points = NULL;
+    client->received = 0;
+    client->pending = 0;
+}
+
+// Reject a request: answer with a nonzero status and close the connection
+static void client_reject(struct server_client *client) {
+    struct server_response response = { .status = 1, .num_points = 0 };
+    send_all(client->fd, &response, sizeof(response));
+    client_close(client);
+}
+
+/*
+    Read what a client sent without blocking, first the header and then the coordinates
+    The request becomes pending once complete. A closed connection or an invalid request,
+    of more than batch_points points among others, closes the client.
+*/
+static void client_receive(struct server_client *client, uint32_t dim, uint32_t batch_points) {
+    uint8_t *target;
+    size_t missing;
+    size_t header = sizeof(struct server_request);
+    if (client->received < header) {
+        target = (uint8_t *)&client->request + client->received;
+        missing = header - client->received;
+    } else {
+        size_t payload = client->received - header;
+        target = &client->points[payload];
+        missing = (size_t)client->request.num_points * dim - payload;
+    }
+
+    ssize_t received = recv(client->fd, target, missing, MSG_DONTWAIT);
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (received <= 0) {
+        client_close(client);
+        return;
+    }
+    client->received += received;
+
+    // The header is complete, check it before reading the coordinates
+    if (client->received == header) {
+        const struct server_request *request = &client->request;
+        if (request->magic != SERVER_MAGIC || request->dim != dim || request->num_points > batch_points) {
+            fprintf(stderr, "Rejected a request of %u points of %u coordinates\n", request->num_points, request->dim);
+            client_reject(client);
+            return;
+        }
+        client->points = malloc((size_t)request->num_points * dim + 1);
+        assert(client->points != NULL);
+    }
+    if (client->received == header + (size_t)client->request.num_points * dim) {
+        client->pending = 1;
+        client->arrival = kmeans_wall_time();
+    }
+}
+
+/* What the server did, the latency runs from a complete request to its answer */
+struct server_stats {
+    uint64_t requests;
+    uint64_t points;
+    uint64_t batches;
+    double busy_time;               // Seconds spent labelling batches
+    struct latency_log latency;
+};
+
+// Order pending clients by the arrival of their requests
+static int compare_arrival(const void *a, const void *b) {
+    const struct server_client *x = *(struct server_client *const *)a;
+    const struct server_client *y = *(struct server_client *const *)b;
+    return (x->arrival > y->arrival) - (x->arrival < y->arrival);
+}
+
+/*
+    Label the oldest pending requests in one predict of at most batch_points points, no request
+    is larger. batch and labels hold batch_points points. A failed predict rejects every request
+    of the batch. Returns the number of requests answered.
+*/
+static uint32_t serve_batch(struct kmeans_context *context, struct server_client **pending, uint32_t nr_pending, uint32_t dim,
+                            uint32_t batch_points, uint8_t *batch, uint16_t *labels, struct server_stats *stats) {
+    qsort(pending, nr_pending, sizeof(struct server_client *), compare_arrival);
+
+    uint32_t count = 0;
+    uint32_t num_points = 0;
+    while (count < nr_pending && num_points + pending[count]->request.num_points <= batch_points) {
+        num_points += pending[count]->request.num_points;
+        count++;
+    }
+
+    double start = kmeans_wall_time();
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        memcpy(&batch[(size_t)offset * dim], pending[i]->points, (size_t)pending[i]->request.num_points * dim);
+        offset += pending[i]->request.num_points;
+    }
+    int failed = num_points != 0 && kmeans_predict(context, batch, num_points, labels) != 0;
+    double end = kmeans_wall_time();
+    stats->busy_time += end - start;
+    stats->batches++;
+
+    offset = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        struct server_client *client = pending[i];
+        struct server_response response = { .status = 0, .num_points = client->request.num_points };
+        if (failed) {
+            client_reject(client);
+        } else if (send_all(client->fd, &response, sizeof(response)) != 0 ||
+                   send_all(client->fd, &labels[offset], (size_t)response.num_points * sizeof(uint16_t)) != 0) {
+            client_close(client);
+        } else {
+            latency_add(&stats->latency, kmeans_wall_time() - client->arrival);
+            stats->requests++;
+            stats->points += response.num_points;
+            free(client->points);
+            client->points = NULL;
+            client->received = 0;
+            client->pending = 0;
+        }
+        offset += pending[i]->request.num_points;
+    }
+    return count;
+}
+
+int run_server(struct kmeans_context *context, const char *path, uint32_t dim, uint32_t batch_points, double max_wait) {
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return 1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0) {
+        perror(path);
+        if (listener >= 0) {
+            close(listener);
+        }
+        return 1;
+    }
+
+    // Stop on SIGINT or SIGTERM, poll then returns with EINTR
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_server;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    stopping = 0;
+
+    struct server_client clients[SERVER_MAX_CLIENTS];
+    struct server_client *pending[SERVER_MAX_CLIENTS];
+    struct pollfd fds[SERVER_MAX_CLIENTS + 1];
+    uint32_t slot_of_fd[SERVER_MAX_CLIENTS + 1];
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        clients[i].fd = -1;
+        clients[i].points = NULL;
+        clients[i].received = 0;
+        clients[i].pending = 0;
+    }
+    uint8_t *batch = malloc((size_t)batch_points * dim);
+    uint16_t *labels = malloc((size_t)batch_points * sizeof(uint16_t));
+    assert(batch != NULL && labels != NULL);
+    struct server_stats stats;
+    memset(&stats, 0, sizeof(stats));
+
+    printf("Serving %u coordinate points on %s, batches of %u points, %u DPUs\n", dim, path, batch_points, kmeans_nr_dpus(context));
+    fflush(stdout);
+    double start = kmeans_wall_time();
+
+    while (!stopping) {
+        // Listen for new clients while there is a free slot, and for the clients without a pending request
+        uint32_t nr_fds = 0;
+        uint32_t nr_pending = 0;
+        uint32_t nr_clients = 0;
+        uint32_t pending_points = 0;
+        double oldest = 0;
+        for (uint32_t i = 0; i < SERVER_MAX_CLIENTS; i++) {
+            if (clients[i].fd < 0) {
+                continue;
+            }
+            nr_clients++;
+            if (clients[i].pending) {
+                pending_points += clients[i].request.num_points;
+                if (nr_pending == 0 || clients[i].arrival < oldest) {
+                    oldest = clients[i].arrival;
+                }
+                pending[nr_pending++] = &clients[i];
+            } else {
+                fds[nr_fds].fd = clients[i].fd;
+                fds[nr_fds].events = POLLIN;
+                slot_of_fd[nr_fds++] = i;
+            }
+        }
+        if (nr_clients < SERVER_MAX_CLIENTS) {
+            fds[nr_fds].fd = listener;
+            fds[nr_fds].events = POLLIN;
+            slot_of_fd[nr_fds++] = SERVER_MAX_CLIENTS;
+        }
+
+        // A batch that is full, or waited long enough, is labelled right away
+        double waited = nr_pending ? kmeans_wall_time() - oldest : 0;
+        if (nr_pending != 0 && (pending_points >= batch_points || waited >= max_wait)) {
+            serve_batch(context, pending, nr_pending, dim, batch_points, batch, labels, &stats);
+            // Read what arrived meanwhile before the next batch
+            if (poll(fds, nr_fds, 0) <= 0) {
+                continue;
+            }
+        } else {
+            int timeout = nr_pending ? (int)((max_wait - waited) * 1000) + 1 : -1;
+            if (poll(fds, nr_fds, timeout) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("poll");
+                break;
+            }
+        }
+
+        for (uint32_t f = 0; f < nr_fds; f++) {
+            if (fds[f].revents == 0) {
+                continue;
+            }
+            if (slot_of_fd[f] < SERVER_MAX_CLIENTS) {
+                client_receive(&clients[slot_of_fd[f]], dim, batch_points);
+                continue;
+            }
+            int fd = accept(listener, NULL, NULL);
+            for (uint32_t i = 0; fd >= 0 && i < SERVER_MAX_CLIENTS; i++) {
+                if (clients[i].fd < 0) {
+                    clients[i].fd = fd;
+                    fd = -1;
+                }
+            }
+        }
+    }
+    double end = kmeans_wall_time();
+
+    uint64_t nr_requests = stats.latency.count;
+    double p50 = latency_percentile(&stats.latency, 50);
+    double p99 = latency_percentile(&stats.latency, 99);
+    double max = nr_requests ? stats.latency.values[nr_requests - 1] : 0;
+    printf("Served %" PRIu64 " requests, %" PRIu64 " points in %" PRIu64 " batches (%.1f points per batch) over %f s, busy %f s\n",
+           stats.requests, stats.points, stats.batches, stats.batches ? (double)stats.points / stats.batches : 0, end - start, stats.busy_time);
+    printf("Latency: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", p50 * 1e3, p99 * 1e3, max * 1e3);
+    printf("Throughput: %.0f points/s, %.0f requests/s while busy\n", stats.busy_time ? stats.points / stats.busy_time : 0,
+           stats.busy_time ? stats.requests / stats.busy_time : 0);
+
+    for (uint32_t i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        if (clients[i].fd >= 0) {
+            client_close(&clients[i]);
+        }
+    }
+    close(listener);
+    unlink(path);
+    free(batch);
+    free(labels);
+    free(stats.latency.values);
+    return 0;
+}
+
+/* One client thread of run_server_bench */
+struct bench_client {
+    const char *path;
+    uint32_t dim;
+    uint32_t requests;
+    uint32_t request_points;
+    unsigned seed;
+    struct latency_log latency;
+    int failed;
+};
+
+static void *bench_client_run(void *arg) {
+    struct bench_client *client = arg;
+    size_t size = (size_t)client->request_points * client->dim;
+    uint8_t *points = malloc(size + 1);
+    uint16_t *labels = malloc((size_t)client->request_points * sizeof(uint16_t) + 2);
+    assert(points != NULL && labels != NULL);
+    for (size_t i = 0; i < size; i++) {
+        points[i] = rand_r(&client->seed) % 255;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, client->path, sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        perror(client->path);
+        client->failed = 1;
+    }
+
+    struct server_request request = { .magic = SERVER_MAGIC, .num_points = client->request_points, .dim = client->dim, .reserved = 0 };
+    for (uint32_t r = 0; r < client->requests && !client->failed; r++) {
+        struct server_response response;
+        double start = kmeans_wall_time();
+        if (send_all(fd, &request, sizeof(request)) != 0 || send_all(fd, points, size) != 0 ||
+            recv_all(fd, &response, sizeof(response)) != 0 || response.status != 0 || response.num_points != client->request_points ||
+            recv_all(fd, labels, (size_t)response.num_points * sizeof(uint16_t)) != 0) {
+            fprintf(stderr, "Request %u failed\n", r);
+            client->failed = 1;
+            break;
+        }
+        latency_add(&client->latency, kmeans_wall_time() - start);
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(points);
+    free(labels);
+    return NULL;
+}
+
+int run_server_bench(const char *path, uint32_t dim, uint32_t clients, uint32_t requests, uint32_t request_points, unsigned seed) {
+    struct bench_client *threads = calloc(clients, sizeof(struct bench_client));
+    pthread_t *ids = malloc(clients * sizeof(pthread_t));
+    assert(threads != NULL && ids != NULL);
+
+    double start = kmeans_wall_time();
+    for (uint32_t c = 0; c < clients; c++) {
+        threads[c].path = path;
+        threads[c].dim = dim;
+        threads[c].requests = requests;
+        threads[c].request_points = request_points;
+        threads[c].seed = seed + c;
+        if (pthread_create(&ids[c], NULL, bench_client_run, &threads[c]) != 0) {
+            fprintf(stderr, "Cannot start client %u\n", c);
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct latency_log latency = { NULL, 0, 0 };
+    int failed = 0;
+    for (uint32_t c = 0; c < clients; c++) {
+        pthread_join(ids[c], NULL);
+        failed |= threads[c].failed;
+        for (size_t i = 0; i < threads[c].latency.count; i++) {
+            latency_add(&latency, threads[c].latency.values[i]);
+        }
+        free(threads[c].latency.values);
+    }
+    double time = kmeans_wall_time() - start;
+
+    size_t nr_requests = latency.count;
+    double p50 = latency_percentile(&latency, 50);
+    double p99 = latency_percentile(&latency, 99);
+    printf("clients,request_points,dims,requests,p50_ms,p99_ms,max_ms,requests_per_s,points_per_s,status\n");
+    printf("%u,%u,%u,%zu,%.3f,%.3f,%.3f,%.0f,%.0f,%s\n", clients, request_points, dim, nr_requests, p50 * 1e3, p99 * 1e3,
+           nr_requests ? latency.values[nr_requests - 1] * 1e3 : 0, nr_requests / time, (double)nr_requests * request_points / time,
+           failed ? "FAIL" : "PASS");
+
+    free(latency.values);
+    free(threads);
+    free(ids);
+    return failed;
+}
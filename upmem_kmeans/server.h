@@ -0,0 +1,50 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+
+#include "upmem_kmeans.h"
+
+/*
+    Wire format of the k-means server, a byte stream over a Unix socket in native byte order
+        request   struct server_request, then num_points * dim uint8_t coordinates
+        response  struct server_response, then num_points uint16_t labels when status is 0
+    A connection carries any number of requests, each is answered before the next is read.
+    A request the server rejects, or fails to label, is answered with a nonzero status, then
+    the server closes the connection.
+*/
+#define SERVER_MAGIC 0x4b4d5351
+
+struct server_request {
+    uint32_t magic;         // SERVER_MAGIC
+    uint32_t num_points;    // At most the batch size of the server
+    uint32_t dim;           // Coordinates per point, those of the model
+    uint32_t reserved;
+};
+
+struct server_response {
+    uint32_t status;        // 0 when the labels follow
+    uint32_t num_points;
+};
+
+/*
+    Serve predicts against the model of a context on a Unix socket at path until SIGINT or SIGTERM
+        1. Read the requests of every client that has data, without blocking on any of them
+        2. Coalesce the complete requests, oldest first, into one predict of at most
+           batch_points points, a larger request is rejected before its points are read
+        3. Answer every request of the batch, the DPUs keep the kernel and the model in WRAM
+    While the DPUs label one batch the next requests queue up in the sockets, so under load the
+    batches fill up by themselves. max_wait seconds, 0 for none, holds back a batch that is not
+    full for more requests. Prints the latency percentiles and the throughput on exit.
+    Returns 0 on success.
+*/
+int run_server(struct kmeans_context *context, const char *path, uint32_t dim, uint32_t batch_points, double max_wait);
+
+/*
+    Load a server from clients threads, each sending requests requests of request_points random
+    points of dim coordinates over its own connection and waiting for every answer.
+    Prints one CSV row of the round trip latency percentiles and the throughput. Returns 0 on success.
+*/
+int run_server_bench(const char *path, uint32_t dim, uint32_t clients, uint32_t requests, uint32_t request_points, unsigned seed);
+
+#endif
@@ -0,0 +1,2877 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <dpu.h>
+#include <assert.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <math.h>
+// Record execution time
+#include <time.h>
+
+#include "common.h"
+#include "cpu_engine.h"
+#include "dataset.h"
+#include "upmem_kmeans.h"
+
+#ifndef NEAREST_CENTROID
+#define NEAREST_CENTROID "nearest_centroid"
+#endif
+
+#ifndef AVG_COORDINATE
+#define AVG_COORDINATE "avg_coordinate"
+#endif
+
+#ifndef BOUNDED_CENTROID
+#define BOUNDED_CENTROID "bounded_centroid"
+#endif
+
+#ifndef HISTOGRAM
+#define HISTOGRAM "histogram"
+#endif
+
+#ifndef DISTANCE_MATRIX
+#define DISTANCE_MATRIX "distance_matrix"
+#endif
+
+#ifndef SEED_DISTANCE
+#define SEED_DISTANCE "seed_distance"
+#endif
+
+// Longest path of a kernel build, and of the directory of the builds leaving room for the file name
+#define KERNEL_PATH_SIZE 256
+#define KERNEL_DIR_SIZE (KERNEL_PATH_SIZE - 32)
+
+// Per DPU results merged by a single thread below this many values, a parallel region costs a few microseconds
+#define PARALLEL_MERGE_VALUES (1 << 16)
+
+const char *kmeans_phase_names[KMEANS_NR_PHASES] = { "alloc", "load", "to_dpu", "launch", "from_dpu", "host_reduce" };
+
+/*
+    A DPU session keeps one DPU set for a whole k-means run
+        1. The set is allocated once and the points are pushed to the MRAM heap once
+        2. Switching between the assignment and the average kernels only reloads the program,
+           the MRAM heap (points, labels) is left untouched
+        3. Per launch only the changing centroids are broadcast
+
+    Every point has dim uint8_t coordinates. On the DPUs it takes stride bytes, dim rounded up
+    to the next dimension bucket of the kernels, the extra coordinates are zero.
+
+    The points are split into contiguous slices of num_points_per_dpu points, a multiple of 4
+    so every slice starts on an 8 byte boundary. The last slices may be partially filled or
+    empty, each DPU learns its own count through the num_points __host variable.
+
+    A bounded session assigns with the bounded_centroid kernel, which keeps Hamerly distance
+    bounds next to the points in MRAM. Per launch the host broadcasts how far every centroid
+    moved since the previous launch and half the gap to its nearest other centroid.
+
+    k-means++ seeding runs on the same session before the first pass, the seed_distance kernel
+    keeps the distance of every point to its nearest seed in MRAM.
+*/
+struct dpu_session {
+    struct dpu_set_t set;
+    int borrowed;                   // The set is a rank or a DPU of a larger set, session_free leaves it allocated
+    uint32_t nr_dpus;
+    uint32_t nr_ranks;
+    uint8_t *points;                // total_num_points points of stride coordinates
+    uint8_t *padded_points;         // Owned copy of the caller's points when dim < stride, else NULL
+    uint32_t total_num_points;
+    uint32_t dim;                   // Coordinates per point of the caller
+    uint32_t stride;                // Coordinates per point on the DPUs, the kernel dimension bucket
+    uint32_t num_points_per_dpu;    // Slice size, the same for every DPU
+    uint32_t *num_points;           // Points actually held by each DPU
+    uint8_t *tail_points;           // Zero padded copy of the slices that run past the end of points
+    uint16_t *labels;               // Nearest centroid of every point, nr_dpus * num_points_per_dpu
+    size_t padded_bytes;            // Sizes of the three buffers above, they only grow so uploads reuse them
+    size_t tail_bytes;
+    size_t labels_bytes;
+    uint32_t num_centroids;         // Centroids of the current launch
+    int bounded;                    // Assign with the distance bounds of bounded_centroid
+    int32_t *previous_centroids;    // Centroids of the previous assignment, to measure the drift
+    uint64_t skipped;               // Distances the bounds made unnecessary in the last assignment
+    uint64_t inertia;               // Sum of the squared distances of the last unbounded assignment, Q16.16
+    uint32_t *dpu_changed;          // Per DPU results of the nearest centroid kernel
+    uint32_t *dpu_skipped;
+    uint64_t *dpu_inertia;
+    uint64_t *dpu_cycles;           // Per DPU cycles of the last launch
+    uint64_t *dpu_totals;           // Per DPU results of the seed distance kernel
+    uint32_t *dpu_sums;             // Per DPU results of the average kernel
+    uint32_t *dpu_counts;
+    int async;                      // Launch asynchronously and collect the results per rank
+    uint32_t *rank_first_dpu;       // Index of the first DPU of every rank
+    uint32_t *rank_changed;         // Per rank reductions, index 0 holds the whole set when synchronous
+    uint64_t *rank_skipped;
+    uint64_t *rank_inertia;
+    uint64_t *rank_sums;
+    uint32_t *rank_counts;
+    double *rank_phase_time;        // Per rank phase times of the result callbacks, KMEANS_NR_PHASES each
+    const char *binary;             // Program currently loaded, NULL if none
+    double phase_time[KMEANS_NR_PHASES]; // Seconds spent in every phase
+};
+
+// Wall clock time in seconds
+double kmeans_wall_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Add the time since start to a phase and return the current time
+static double phase_end(double *phase_time, enum kmeans_phase phase, double start) {
+    double now = kmeans_wall_time();
+    phase_time[phase] += now - start;
+    return now;
+}
+
+// Smallest kernel dimension bucket that holds dim coordinates
+uint32_t kmeans_dim_bucket(uint32_t dim) {
+    uint32_t bucket = 2;
+    while (bucket < dim) {
+        bucket *= 2;
+    }
+    return bucket;
+}
+
+// Path of the build of a kernel for a dimension bucket in a directory, e.g. ./nearest_centroid_d8
+static void kernel_binary(char *binary, size_t size, const char *dir, const char *kernel, uint32_t stride) {
+    snprintf(binary, size, "%s/%s_d%u", dir, kernel, stride);
+}
+
+// Points of a slice, or the padded tail copy when the slice runs past the end of the points
+static uint8_t *session_slice_points(struct dpu_session *session, uint32_t each_dpu) {
+    uint64_t begin = (uint64_t)each_dpu * session->num_points_per_dpu;
+    if (begin + session->num_points_per_dpu <= session->total_num_points) {
+        return &session->points[begin * session->stride];
+    }
+    // Only one slice is partially filled, the empty ones share the zeroed second half
+    if (begin < session->total_num_points) {
+        return session->tail_points;
+    }
+    return &session->tail_points[(size_t)session->num_points_per_dpu * session->stride];
+}
+
+// Push the labels to the MRAM heap
+static void session_push_labels(struct dpu_session *session) {
+    struct dpu_set_t dpu;
+    uint32_t each_dpu;
+
+    double start = kmeans_wall_time();
+    DPU_FOREACH(session->set, dpu, each_dpu){
+        DPU_ASSERT(dpu_prepare_xfer(dpu, &session->labels[(size_t)each_dpu * session->num_points_per_dpu]));
+    }
+    DPU_ASSERT(dpu_push_xfer(session->set, DPU_XFER_TO_DPU, DPU_MRAM_HEAP_POINTER_NAME, LABELS_OFFSET, session->num_points_per_dpu * sizeof(uint16_t), DPU_XFER_DEFAULT));
+    phase_end(session->phase_time, KMEANS_PHASE_TO_DPU, start);
+}
+
+// Push the points to the MRAM heap
+static void session_push_points(struct dpu_session *session) {
+    struct dpu_set_t dpu;
+    uint32_t each_dpu;
+
+    double start = kmeans_wall_time();
+    DPU_FOREACH(session->set, dpu, each_dpu){
+        DPU_ASSERT(dpu_prepare_xfer(dpu, session_slice_points(session, each_dpu)));
+    }
+    DPU_ASSERT(dpu_push_xfer(session->set, DPU_XFER_TO_DPU, DPU_MRAM_HEAP_POINTER_NAME, POINTS_OFFSET, session->num_points_per_dpu * session->stride * sizeof(uint8_t), DPU_XFER_DEFAULT));
+    phase_end(session->phase_time, KMEANS_PHASE_TO_DPU, start);
+}
+
+/* Push the points and the labels to the MRAM heap */
+static void session_upload(struct dpu_session *session) {
+    session_push_points(session);
+    session_push_labels(session);
+}
+
+// Forget the labels of a previous run, the next pass counts every label as changed
+static void session_reset_labels(struct dpu_session *session) {
+    for (size_t i = 0; i < (size_t)session->nr_dpus * session->num_points_per_dpu; i++) {
+        session->labels[i] = UINT16_MAX;
+    }
+    session_push_labels(session);
+}
+
+// Record the index of the first DPU of every rank, DPU_FOREACH walks the ranks in order
+static void session_map_ranks(struct dpu_session *session) {
+    struct dpu_set_t rank;
+    uint32_t each_rank;
+    uint32_t first_dpu = 0;
+
+    DPU_RANK_FOREACH(session->set, rank, each_rank){
+        uint32_t nr_dpus;
+        DPU_ASSERT(dpu_get_nr_dpus(rank, &nr_dpus));
+        session->rank_first_dpu[each_rank] = first_dpu;
+        first_dpu += nr_dpus;
+    }
+}
+
+// Push the point count of every DPU to the loaded program
+static void session_push_counts(struct dpu_session *session) {
+    struct dpu_set_t dpu;
+    uint32_t each_dpu;
+
+    double start = kmeans_wall_time();
+    DPU_FOREACH(session->set, dpu, each_dpu){
+        DPU_ASSERT(dpu_prepare_xfer(dpu, &session->num_points[each_dpu]));
+    }
+    DPU_ASSERT(dpu_push_xfer(session->set, DPU_XFER_TO_DPU, "num_points", 0, sizeof(uint32_t), DPU_XFER_DEFAULT));
+    phase_end(session->phase_time, KMEANS_PHASE_TO_DPU, start);
+}
+
+// Most points of stride coordinates a DPU holds
+static uint32_t dpu_capacity(uint32_t stride) {
+    uint32_t max_points_per_dpu = MAX_POINT_BYTES / stride;
+    if (max_points_per_dpu > MAX_POINTS_PER_DPU) {
+        max_points_per_dpu = MAX_POINTS_PER_DPU;
+    }
+    return max_points_per_dpu;
+}
+
+// Grow a buffer kept across uploads to at least size bytes, its content is not kept
+static void *session_reserve(void *buffer, size_t *capacity, size_t size) {
+    if (size <= *capacity) {
+        return buffer;
+    }
+    free(buffer);
+    buffer = malloc(size);
+    assert(buffer != NULL);
+    *capacity = size;
+    return buffer;
+}
+
+/* Split the points between the session's DPUs, nothing is pushed yet
+    1. Calculate how many points each DPU will handle denote as num_points_per_dpu
+    2. Each DPU gets a contiguous slice of the points array, only the tail is copied
+       (and the whole array when the points are padded to the dimension bucket)
+    3. The copies go to buffers kept by the session, they are only reallocated to grow
+    Points of another dimension bucket than the previous ones unload the program.
+    Returns 1 and leaves the session unchanged when the points exceed the MRAM capacity.
+*/
+static int session_split_points(struct dpu_session *session, uint8_t *points, uint32_t total_num_points, uint32_t dim) {
+    uint32_t stride = kmeans_dim_bucket(dim);
+
+    // Round the slice up to 4 points so every transfer is a multiple of 8 bytes
+    uint32_t num_points_per_dpu = (total_num_points + session->nr_dpus - 1) / session->nr_dpus;
+    num_points_per_dpu = (num_points_per_dpu + 3) & ~3;
+
+    // Check if the number of points is exceed the MRAM capacity of a DPU
+    uint32_t max_points_per_dpu = dpu_capacity(stride);
+    if (num_points_per_dpu > max_points_per_dpu) {
+        fprintf(stderr, "%u points per DPU exceed the limit of %u for %u coordinates\n", num_points_per_dpu, max_points_per_dpu, dim);
+        return 1;
+    }
+
+    // The kernel builds are per dimension bucket
+    if (stride != session->stride) {
+        session->binary = NULL;
+    }
+
+    session->dim = dim;
+    session->stride = stride;
+    session->num_points_per_dpu = num_points_per_dpu;
+    session->total_num_points = total_num_points;
+    session->points = points;
+    if (session->stride != dim) {
+        session->padded_points = session_reserve(session->padded_points, &session->padded_bytes, (size_t)total_num_points * stride);
+        for (uint32_t i = 0; i < total_num_points; i++) {
+            memcpy(&session->padded_points[(size_t)i * stride], &points[(size_t)i * dim], dim);
+            memset(&session->padded_points[(size_t)i * stride + dim], 0, stride - dim);
+        }
+        session->points = session->padded_points;
+    }
+
+    size_t tail_bytes = (size_t)session->num_points_per_dpu * 2 * session->stride * sizeof(uint8_t);
+    session->tail_points = session_reserve(session->tail_points, &session->tail_bytes, tail_bytes);
+    session->labels = session_reserve(session->labels, &session->labels_bytes, (size_t)session->nr_dpus * session->num_points_per_dpu * sizeof(uint16_t));
+    memset(session->tail_points, 0, tail_bytes);
+
+    // The last DPUs hold the remainder, possibly nothing
+    for (uint32_t i = 0; i < session->nr_dpus; i++) {
+        uint64_t begin = (uint64_t)i * session->num_points_per_dpu;
+        uint64_t end = begin + session->num_points_per_dpu;
+        if (end > total_num_points) {
+            end = total_num_points;
+        }
+        session->num_points[i] = begin < end ? end - begin : 0;
+        if (begin < end && session->num_points[i] < session->num_points_per_dpu) {
+            memcpy(session->tail_points, &session->points[begin * session->stride], (size_t)session->num_points[i] * session->stride);
+        }
+    }
+    return 0;
+}
+
+/* Populate the points to the MRAM heap of the session's DPUs
+    The points are split by session_split_points and stay resident until the next
+    session_set_points or session_free, every label is reset.
+    Returns 1 and leaves the session unchanged when the points exceed the MRAM capacity.
+*/
+static int session_set_points(struct dpu_session *session, uint8_t *points, uint32_t total_num_points, uint32_t dim) {
+    if (session_split_points(session, points, total_num_points, dim) != 0) {
+        return 1;
+    }
+
+    // No point is assigned yet, so the first pass counts every label as changed
+    for (size_t i = 0; i < (size_t)session->nr_dpus * session->num_points_per_dpu; i++) {
+        session->labels[i] = UINT16_MAX;
+    }
+
+    session_upload(session);
+
+    // A loaded program keeps the counts of the previous points
+    if (session->binary != NULL) {
+        session_push_counts(session);
+    }
+    return 0;
+}
+
+/*
+    Replace the resident points with queries to label, only the queries and the counts are pushed
+    The labels left in MRAM are overwritten by the next assignment, its changed count is meaningless.
+    Returns 1 and leaves the session unchanged when the queries exceed the MRAM capacity.
+*/
+static int session_set_queries(struct dpu_session *session, uint8_t *queries, uint32_t num_queries, uint32_t dim) {
+    if (session_split_points(session, queries, num_queries, dim) != 0) {
+        return 1;
+    }
+    session_push_points(session);
+    if (session->binary != NULL) {
+        session_push_counts(session);
+    }
+    return 0;
+}
+
+/*
+    Start a session on an allocated set, a whole set or a rank or a DPU of one
+    A borrowed set stays allocated when the session is freed, its owner frees it.
+*/
+static void session_attach(struct dpu_session *session, struct dpu_set_t set, int borrowed) {
+    memset(session->phase_time, 0, sizeof(session->phase_time));
+    session->set = set;
+    session->borrowed = borrowed;
+    DPU_ASSERT(dpu_get_nr_dpus(session->set, &session->nr_dpus));
+    DPU_ASSERT(dpu_get_nr_ranks(session->set, &session->nr_ranks));
+
+    session->dim = 0;
+    session->stride = 0;
+    session->points = NULL;
+    session->total_num_points = 0;
+    session->num_points_per_dpu = 0;
+    session->padded_points = NULL;
+    session->tail_points = NULL;
+    session->labels = NULL;
+    session->padded_bytes = 0;
+    session->tail_bytes = 0;
+    session->labels_bytes = 0;
+    session->binary = NULL;
+    session->async = 0;
+    session->bounded = 0;
+    session->skipped = 0;
+    session->inertia = 0;
+
+    session->num_points = calloc(session->nr_dpus, sizeof(uint32_t));
+    session->dpu_changed = malloc(session->nr_dpus * sizeof(uint32_t));
+    session->dpu_skipped = calloc(session->nr_dpus, sizeof(uint32_t));
+    session->dpu_inertia = calloc(session->nr_dpus, sizeof(uint64_t));
+    session->previous_centroids = calloc(MAX_CENTROID_VALUES, sizeof(int32_t));
+    session->dpu_cycles = malloc(session->nr_dpus * sizeof(uint64_t));
+    session->dpu_totals = malloc(session->nr_dpus * sizeof(uint64_t));
+    session->dpu_sums = malloc((size_t)session->nr_dpus * MAX_CENTROID_VALUES * sizeof(uint32_t));
+    session->dpu_counts = malloc((size_t)session->nr_dpus * MAX_CENTROIDS * sizeof(uint32_t));
+    session->rank_first_dpu = malloc(session->nr_ranks * sizeof(uint32_t));
+    session->rank_changed = malloc(session->nr_ranks * sizeof(uint32_t));
+    session->rank_skipped = malloc(session->nr_ranks * sizeof(uint64_t));
+    session->rank_inertia = malloc(session->nr_ranks * sizeof(uint64_t));
+    session->rank_sums = malloc((size_t)session->nr_ranks * MAX_CENTROID_VALUES * sizeof(uint64_t));
+    session->rank_counts = malloc((size_t)session->nr_ranks * MAX_CENTROIDS * sizeof(uint32_t));
+    session->rank_phase_time = calloc((size_t)session->nr_ranks * KMEANS_NR_PHASES, sizeof(double));
+    assert(session->num_points && session->dpu_changed && session->dpu_cycles && session->dpu_sums && session->dpu_counts);
+    assert(session->dpu_skipped && session->previous_centroids && session->rank_skipped && session->dpu_totals);
+    assert(session->dpu_inertia && session->rank_inertia);
+    assert(session->rank_first_dpu && session->rank_changed && session->rank_sums && session->rank_counts && session->rank_phase_time);
+    session_map_ranks(session);
+}
+
+/*
+    Allocate the DPUs of a session, session_set_points populates their MRAM heap
+    Returns the error of dpu_alloc, the session only exists when it is DPU_OK
+*/
+static dpu_error_t session_init(struct dpu_session *session, uint32_t nr_dpus) {
+    // nr_dpus may be DPU_ALLOCATE_ALL, the set then spans every available rank
+    struct dpu_set_t set;
+    double start = kmeans_wall_time();
+    dpu_error_t error = dpu_alloc(nr_dpus, NULL, &set);
+    if (error != DPU_OK) {
+        return error;
+    }
+    double alloc_time = kmeans_wall_time() - start;
+    session_attach(session, set, 0);
+    session->phase_time[KMEANS_PHASE_ALLOC] = alloc_time;
+    return DPU_OK;
+}
+
+// Load a DPU program into the session, nothing happens if it is already loaded
+static void session_load(struct dpu_session *session, const char *binary) {
+    if (session->binary != NULL && strcmp(session->binary, binary) == 0) {
+        return;
+    }
+    double start = kmeans_wall_time();
+    DPU_ASSERT(dpu_load(session->set, binary, NULL));
+    phase_end(session->phase_time, KMEANS_PHASE_LOAD, start);
+
+    // The WRAM is reset by the load, every DPU gets its own point count again
+    session_push_counts(session);
+    session->binary = binary;
+}
+
+// Free the DPUs of the session
+static void session_free(struct dpu_session *session) {
+    if (!session->borrowed) {
+        DPU_ASSERT(dpu_free(session->set));
+    }
+    free(session->num_points);
+    free(session->padded_points);
+    free(session->tail_points);
+    free(session->labels);
+    free(session->dpu_changed);
+    free(session->dpu_skipped);
+    free(session->dpu_inertia);
+    free(session->previous_centroids);
+    free(session->dpu_cycles);
+    free(session->dpu_totals);
+    free(session->dpu_sums);
+    free(session->dpu_counts);
+    free(session->rank_first_dpu);
+    free(session->rank_changed);
+    free(session->rank_skipped);
+    free(session->rank_inertia);
+    free(session->rank_sums);
+    free(session->rank_counts);
+    free(session->rank_phase_time);
+    session->binary = NULL;
+}
+
+/* Copy the labels of every point back into session->labels, they otherwise stay in MRAM */
+static void session_read_labels(struct dpu_session *session) {
+    struct dpu_set_t dpu;
+    uint32_t each_dpu;
+
+    double start = kmeans_wall_time();
+    DPU_FOREACH(session->set, dpu, each_dpu){
+        DPU_ASSERT(dpu_prepare_xfer(dpu, &session->labels[(size_t)each_dpu * session->num_points_per_dpu]));
+    }
+    DPU_ASSERT(dpu_push_xfer(session->set, DPU_XFER_FROM_DPU, DPU_MRAM_HEAP_POINTER_NAME, LABELS_OFFSET, session->num_points_per_dpu * sizeof(uint16_t), DPU_XFER_DEFAULT));
+    phase_end(session->phase_time, KMEANS_PHASE_FROM_DPU, start);
+}
+
+/* Recreate the DPU set: copy the labels back, alloc, load and push the points and labels again
+    This is what the original flow paid before every launch, kept to benchmark against
+*/
+static void session_reload(struct dpu_session *session, const char *binary) {
+    assert(!session->borrowed);
+    session_read_labels(session);
+    DPU_ASSERT(dpu_free(session->set));
+    double start = kmeans_wall_time();
+    DPU_ASSERT(dpu_alloc(session->nr_dpus, NULL, &session->set));
+    phase_end(session->phase_time, KMEANS_PHASE_ALLOC, start);
+    session_map_ranks(session);
+    session_upload(session);
+    session->binary = NULL;
+    session_load(session, binary);
+}
+
+// Copy the cycle counts of the last launch back from a subset of the DPUs
+static void session_fetch_cycles(struct dpu_session *session, struct dpu_set_t set, uint32_t first_dpu) {
+    struct dpu_set_t dpu;
+    uint32_t each_dpu;
+
+    DPU_FOREACH(set, dpu, each_dpu){
+        DPU_ASSERT(dpu_prepare_xfer(dpu, &session->dpu_cycles[first_dpu + each_dpu]));
+    }
+    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "cycles", 0, sizeof(uint64_t), DPU_XFER_DEFAULT));
+}
+
+/*
+    Copy the number of changed labels back from a subset of the DPUs
+        set is the whole session or one of its ranks, first_dpu is the index of its first DPU
+        skipped receives how many distances the subset skipped, 0 unless the session is bounded
+        inertia receives the sum of the squared distances of the subset, 0 when the session is
+        bounded since the bounded kernel does not compute every distance
+        phase_time receives the transfer and reduction times of the subset
+        Returns how many points of the subset changed their label
+*/
+static uint32_t session_fetch_changed(struct dpu_session *session, struct dpu_set_t set, uint32_t first_dpu, uint64_t *skipped, uint64_t *inertia,
+                                      double *phase_time) {
+    struct dpu_set_t dpu;
+    uint32_t each_dpu;
+    uint32_t nr_dpus;
+
+    double start = kmeans_wall_time();
+    DPU_ASSERT(dpu_get_nr_dpus(set, &nr_dpus));
+    DPU_FOREACH(set, dpu, each_dpu){
+        DPU_ASSERT(dpu_prepare_xfer(dpu, &session->dpu_changed[first_dpu + each_dpu]));
+    }
+    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "changed", 0, sizeof(uint32_t), DPU_XFER_DEFAULT));
+    if (session->bounded) {
+        DPU_FOREACH(set, dpu, each_dpu){
+            DPU_ASSERT(dpu_prepare_xfer(dpu, &session->dpu_skipped[first_dpu + each_dpu]));
+        }
+        DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "skipped", 0, sizeof(uint32_t), DPU_XFER_DEFAULT));
+    } else {
+        DPU_FOREACH(set, dpu, each_dpu){
+            DPU_ASSERT(dpu_prepare_xfer(dpu, &session->dpu_inertia[first_dpu + each_dpu]));
+        }
+        DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "inertia", 0, sizeof(uint64_t), DPU_XFER_DEFAULT));
+    }
+    session_fetch_cycles(session, set, first_dpu);
+    start = phase_end(phase_time, KMEANS_PHASE_FROM_DPU, start);
+
+    uint32_t changed = 0;
+    *skipped = 0;
+    *inertia = 0;
+    for (uint32_t i = first_dpu; i < first_dpu + nr_dpus; i++) {
+        changed += session->dpu_changed[i];
+        *skipped += session->dpu_skipped[i];
+        *inertia += session->bounded ? 0 : session->dpu_inertia[i];
+    }
+    phase_end(phase_time, KMEANS_PHASE_REDUCE, start);
+    return changed;
+}
+
+/*
+    Copy the per cluster sums and counts back from a subset of the DPUs and merge them
+        set is the whole session or one of its ranks, first_dpu is the index of its first DPU
+        total_sum and num_points_per_centroid receive the merged results of the subset
+        phase_time receives the transfer and reduction times of the subset
+*/
+static void session_fetch_sums(struct dpu_session *session, struct dpu_set_t set, uint32_t first_dpu, uint64_t *total_sum, uint32_t *num_points_per_centroid,
+                               double *phase_time) {
+    struct dpu_set_t dpu;
+    uint32_t each_dpu;
+    uint32_t nr_dpus;
+    uint32_t num_centroids = session->num_centroids;
+    uint32_t num_values = num_centroids * session->stride;
+
+    double start = kmeans_wall_time();
+    DPU_ASSERT(dpu_get_nr_dpus(set, &nr_dpus));
+    DPU_FOREACH(set, dpu, each_dpu){
+        DPU_ASSERT(dpu_prepare_xfer(dpu, &session->dpu_sums[(size_t)(first_dpu + each_dpu) * num_values]));
+    }
+    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "sums", 0, num_values * sizeof(uint32_t), DPU_XFER_DEFAULT));
+    DPU_FOREACH(set, dpu, each_dpu){
+        DPU_ASSERT(dpu_prepare_xfer(dpu, &session->dpu_counts[(size_t)(first_dpu + each_dpu) * num_centroids]));
+    }
+    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "counts", 0, num_centroids * sizeof(uint32_t), DPU_XFER_DEFAULT));
+    session_fetch_cycles(session, set, first_dpu);
+    start = phase_end(phase_time, KMEANS_PHASE_FROM_DPU, start);
+
+    // Calculate the total sum, a thread per range of values once there are enough DPUs and values.
+    // The callbacks of an asynchronous launch already run side by side and merge a rank each.
+    #pragma omp parallel for schedule(static) if (!session->async && (uint64_t)nr_dpus * num_values >= PARALLEL_MERGE_VALUES)
+    for (uint32_t v = 0; v < num_values; v++) {
+        uint64_t sum = 0;
+        for (uint32_t j = first_dpu; j < first_dpu + nr_dpus; j++) {
+            sum += session->dpu_sums[(size_t)j * num_values + v];
+        }
+        total_sum[v] = sum;
+    }
+    for (uint32_t i = 0; i < num_centroids; i++) {
+        num_points_per_centroid[i] = 0;
+        for (uint32_t j = first_dpu; j < first_dpu + nr_dpus; j++) {
+            num_points_per_centroid[i] += session->dpu_counts[(size_t)j * num_centroids + i];
+        }
+    }
+    phase_end(phase_time, KMEANS_PHASE_REDUCE, start);
+}
+
+// Called once per rank as soon as the rank finished the nearest centroid kernel
+static dpu_error_t assign_rank_done(struct dpu_set_t rank, uint32_t rank_id, void *arg) {
+    struct dpu_session *session = arg;
+    session->rank_changed[rank_id] = session_fetch_changed(session, rank, session->rank_first_dpu[rank_id], &session->rank_skipped[rank_id],
+                                                           &session->rank_inertia[rank_id], &session->rank_phase_time[(size_t)rank_id * KMEANS_NR_PHASES]);
+    return DPU_OK;
+}
+
+// Called once per rank as soon as the rank finished the average coordinate kernel
+static dpu_error_t sums_rank_done(struct dpu_set_t rank, uint32_t rank_id, void *arg) {
+    struct dpu_session *session = arg;
+    session_fetch_sums(session, rank, session->rank_first_dpu[rank_id],
+                       &session->rank_sums[(size_t)rank_id * MAX_CENTROID_VALUES], &session->rank_counts[(size_t)rank_id * MAX_CENTROIDS],
+                       &session->rank_phase_time[(size_t)rank_id * KMEANS_NR_PHASES]);
+    return DPU_OK;
+}
+
+// Called once per rank as soon as the rank finished the seed distance kernel
+static dpu_error_t seed_rank_done(struct dpu_set_t rank, uint32_t rank_id, void *arg) {
+    struct dpu_session *session = arg;
+    struct dpu_set_t dpu;
+    uint32_t each_dpu;
+    uint32_t first_dpu = session->rank_first_dpu[rank_id];
+
+    double start = kmeans_wall_time();
+    DPU_FOREACH(rank, dpu, each_dpu){
+        DPU_ASSERT(dpu_prepare_xfer(dpu, &session->dpu_totals[first_dpu + each_dpu]));
+    }
+    DPU_ASSERT(dpu_push_xfer(rank, DPU_XFER_FROM_DPU, "total", 0, sizeof(uint64_t), DPU_XFER_DEFAULT));
+    session_fetch_cycles(session, rank, first_dpu);
+    phase_end(&session->rank_phase_time[(size_t)rank_id * KMEANS_NR_PHASES], KMEANS_PHASE_FROM_DPU, start);
+    return DPU_OK;
+}
+
+/*
+    Launch the loaded program and collect its results
+        Synchronous: wait for every DPU, then fetch from the whole set at once
+        Asynchronous: fetch and reduce the results of each rank in a callback as soon as that
+        rank is done, while the other ranks are still computing. The host cannot access the
+        MRAM of a running DPU, so the rank is the unit that transfers overlap compute with.
+    The callbacks may run concurrently, each records its times in the row of its rank.
+*/
+static void session_launch(struct dpu_session *session, dpu_error_t (*rank_done)(struct dpu_set_t, uint32_t, void *)) {
+    double launch = kmeans_wall_time();
+    if (session->async) {
+        DPU_ASSERT(dpu_launch(session->set, DPU_ASYNCHRONOUS));
+        DPU_ASSERT(dpu_callback(session->set, rank_done, session, DPU_CALLBACK_ASYNC));
+        DPU_ASSERT(dpu_sync(session->set));
+        // Launch and transfers overlap, the whole pipeline counts as launch time
+        phase_end(session->phase_time, KMEANS_PHASE_LAUNCH, launch);
+    } else {
+        DPU_ASSERT(dpu_launch(session->set, DPU_SYNCHRONOUS));
+        phase_end(session->phase_time, KMEANS_PHASE_LAUNCH, launch);
+        rank_done(session->set, 0, session);
+    }
+
+    for (uint32_t r = 0; r < session->nr_ranks; r++) {
+        for (int phase = 0; phase < KMEANS_NR_PHASES; phase++) {
+            session->phase_time[phase] += session->rank_phase_time[(size_t)r * KMEANS_NR_PHASES + phase];
+            session->rank_phase_time[(size_t)r * KMEANS_NR_PHASES + phase] = 0;
+        }
+    }
+}
+
+// Largest r with r * r <= x
+static uint32_t sqrt_floor(uint64_t x) {
+    uint64_t root = sqrt((double)x);
+    while (root * root > x) {
+        root--;
+    }
+    while ((root + 1) * (root + 1) <= x) {
+        root++;
+    }
+    return root;
+}
+
+// Squared distance between two centroids of stride Q16.16 coordinates, in Q32.32
+static int64_t centroid_distance(const int32_t *a, const int32_t *b, uint32_t stride) {
+    int64_t distance = 0;
+    for (uint32_t d = 0; d < stride; d++) {
+        distance += (int64_t)(a[d] - b[d]) * (a[d] - b[d]);
+    }
+    return distance;
+}
+
+/*
+    Broadcast the Q16.16 distances the bounded kernel moves its bounds by
+        centroid_drift  how far every centroid moved since the previous assignment, rounded up
+        half_gap        half the distance to the nearest other centroid, rounded down
+    The rounding keeps the bounds valid, the kernel then never skips a distance it needs.
+*/
+static void session_broadcast_bounds(struct dpu_session *session, const int32_t *centroids, uint32_t num_centroids) {
+    uint32_t stride = session->stride;
+    uint32_t drift[num_centroids];
+    uint32_t half_gap[num_centroids];
+    uint32_t max_drift = 0;
+
+    double start = kmeans_wall_time();
+    for (uint32_t i = 0; i < num_centroids; i++) {
+        uint64_t moved = centroid_distance(&centroids[i * stride], &session->previous_centroids[i * stride], stride);
+        drift[i] = sqrt_floor(moved);
+        if ((uint64_t)drift[i] * drift[i] < moved) {
+            drift[i]++;
+        }
+        if (drift[i] > max_drift) {
+            max_drift = drift[i];
+        }
+
+        uint64_t gap = UINT64_MAX;
+        for (uint32_t j = 0; j < num_centroids; j++) {
+            uint64_t distance = centroid_distance(&centroids[i * stride], &centroids[j * stride], stride);
+            if (j != i && distance < gap) {
+                gap = distance;
+            }
+        }
+        half_gap[i] = gap == UINT64_MAX ? UINT32_MAX : sqrt_floor(gap) / 2;
+    }
+    memcpy(session->previous_centroids, centroids, num_centroids * stride * sizeof(int32_t));
+    start = phase_end(session->phase_time, KMEANS_PHASE_REDUCE, start);
+
+    DPU_ASSERT(dpu_broadcast_to(session->set, "centroid_drift", 0, drift, sizeof(drift), DPU_XFER_DEFAULT));
+    DPU_ASSERT(dpu_broadcast_to(session->set, "max_drift", 0, &max_drift, sizeof(uint32_t), DPU_XFER_DEFAULT));
+    DPU_ASSERT(dpu_broadcast_to(session->set, "half_gap", 0, half_gap, sizeof(half_gap), DPU_XFER_DEFAULT));
+    phase_end(session->phase_time, KMEANS_PHASE_TO_DPU, start);
+}
+
+/*
+    Broadcast the Q16.16 coordinates of all centroids, stride per centroid, and their squared norms,
+    and the drifts and gaps when bounded. They stay in WRAM until the next load.
+*/
+static void session_broadcast_centroids(struct dpu_session *session, const int32_t *centroids, uint32_t num_centroids) {
+    int64_t norms[num_centroids];
+
+    double start = kmeans_wall_time();
+    for (uint32_t i = 0; i < num_centroids; i++) {
+        norms[i] = 0;
+        for (uint32_t d = 0; d < session->stride; d++) {
+            norms[i] += (int64_t)centroids[i * session->stride + d] * centroids[i * session->stride + d];
+        }
+    }
+    start = phase_end(session->phase_time, KMEANS_PHASE_REDUCE, start);
+    session->num_centroids = num_centroids;
+    DPU_ASSERT(dpu_broadcast_to(session->set, "num_centroids", 0, &num_centroids, sizeof(uint32_t), DPU_XFER_DEFAULT));
+    DPU_ASSERT(dpu_broadcast_to(session->set, "centroids", 0, centroids, num_centroids * session->stride * sizeof(int32_t), DPU_XFER_DEFAULT));
+    DPU_ASSERT(dpu_broadcast_to(session->set, "centroid_norms", 0, norms, sizeof(norms), DPU_XFER_DEFAULT));
+    phase_end(session->phase_time, KMEANS_PHASE_TO_DPU, start);
+    if (session->bounded) {
+        session_broadcast_bounds(session, centroids, num_centroids);
+    }
+}
+
+/*
+    Launch the nearest centroid kernel with the centroids already broadcast
+    Returns how many points changed their label, see session_assign
+*/
+static uint32_t session_launch_assign(struct dpu_session *session) {
+    // Execute the DPU program, the synchronous launch fetches the whole set as rank 0
+    session_launch(session, assign_rank_done);
+
+    uint32_t total_changed = 0;
+    session->skipped = 0;
+    session->inertia = 0;
+    for (uint32_t i = 0; i < (session->async ? session->nr_ranks : 1); i++) {
+        total_changed += session->rank_changed[i];
+        session->skipped += session->rank_skipped[i];
+        session->inertia += session->rank_inertia[i];
+    }
+    return total_changed;
+}
+
+/*
+    Assign every point to its nearest centroid on the DPUs
+        1. Broadcast the centroids with session_broadcast_centroids
+        2. Launch the nearest centroid kernel, the labels are kept in MRAM for the average kernel
+        3. Return how many points changed their label, session_read_labels copies the labels themselves
+    A bounded session records how many distances the kernel skipped in session->skipped, any
+    other the inertia of the centroids in session->inertia.
+*/
+static uint32_t session_assign(struct dpu_session *session, const int32_t *centroids, uint32_t num_centroids) {
+    session_broadcast_centroids(session, centroids, num_centroids);
+    return session_launch_assign(session);
+}
+
+/*
+    Sum the coordinates of the points of every cluster on the DPUs
+        1. Launch the average coordinate kernel once, the labels are already resident
+        2. Each DPU returns per cluster coordinate sums and point counts, stride sums per cluster
+        3. Merge the per DPU partial results, per rank first when asynchronous
+*/
+static void session_cluster_sums(struct dpu_session *session, uint32_t num_centroids, uint64_t *total_sum, uint32_t *num_points_per_centroid) {
+    double start = kmeans_wall_time();
+    session->num_centroids = num_centroids;
+    DPU_ASSERT(dpu_broadcast_to(session->set, "num_centroids", 0, &num_centroids, sizeof(uint32_t), DPU_XFER_DEFAULT));
+    phase_end(session->phase_time, KMEANS_PHASE_TO_DPU, start);
+
+    // Execute the DPU program
+    session_launch(session, sums_rank_done);
+
+    start = kmeans_wall_time();
+    uint32_t nr_partials = session->async ? session->nr_ranks : 1;
+    for (uint32_t v = 0; v < num_centroids * session->stride; v++) {
+        total_sum[v] = 0;
+        for (uint32_t r = 0; r < nr_partials; r++) {
+            total_sum[v] += session->rank_sums[(size_t)r * MAX_CENTROID_VALUES + v];
+        }
+    }
+    for (uint32_t i = 0; i < num_centroids; i++) {
+        num_points_per_centroid[i] = 0;
+        for (uint32_t r = 0; r < nr_partials; r++) {
+            num_points_per_centroid[i] += session->rank_counts[(size_t)r * MAX_CENTROIDS + i];
+        }
+    }
+    phase_end(session->phase_time, KMEANS_PHASE_REDUCE, start);
+}
+
+// Uniform 62 bit random number from two draws of rand
+static uint64_t random64(void) {
+    uint64_t high = rand();
+    return (high << 31) ^ rand();
+}
+
+/*
+    Index of the point a k-means++ draw selects among the squared distances of some points
+        target is below the sum of the distances, the point is the first one whose running sum
+        exceeds it, so a point at distance 0 is never selected
+        target receives what is left of it when the distances do not reach it
+    Returns count when the distances do not reach target
+*/
+static uint32_t weighted_index(const uint64_t *distance, uint32_t count, uint64_t *target) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (*target < distance[i]) {
+            return i;
+        }
+        *target -= distance[i];
+    }
+    return count;
+}
+
+/*
+    k-means++ seeding on the DPUs, binary is the seed_distance build of the dimension bucket
+        1. The first seed is a random point
+        2. Broadcast the seed, every DPU lowers the distance of its points to the nearest seed
+           and returns the sum of its distances, the sum of every tile stays in MRAM
+        3. Draw a target below the sum over all DPUs, walk the DPU sums to the DPU that holds it,
+           then copy only the tile sums of that DPU and the distances of a single tile
+        4. The point the target falls on is the next seed, a point is selected with probability
+           proportional to its squared distance to the nearest seed
+    Every seed is a point other than the previous seeds unless all points coincide with them.
+    The draws are the ones seed_plusplus_cpu makes, so both pick the same seeds.
+    centroids receives num_centroids seeds of stride Q16.16 coordinates.
+*/
+static void session_seed_plusplus(struct dpu_session *session, const char *binary, int32_t *centroids, uint32_t num_centroids) {
+    struct dpu_set_t dpu;
+    uint32_t each_dpu;
+    uint32_t stride = session->stride;
+    uint32_t seed[stride];
+    uint32_t tile_points;
+
+    session_load(session, binary);
+    DPU_FOREACH(session->set, dpu, each_dpu){
+        DPU_ASSERT(dpu_copy_from(dpu, "tile_points", 0, &tile_points, sizeof(uint32_t)));
+        break;
+    }
+    uint32_t max_tiles = (session->num_points_per_dpu + tile_points - 1) / tile_points;
+    uint64_t *tile_sums = malloc(max_tiles * sizeof(uint64_t));
+    uint64_t *distances = malloc(tile_points * sizeof(uint64_t));
+    assert(tile_sums != NULL && distances != NULL);
+
+    uint64_t index = rand() % session->total_num_points;
+    for (uint32_t j = 0; j < num_centroids; j++) {
+        double start = kmeans_wall_time();
+        for (uint32_t d = 0; d < stride; d++) {
+            seed[d] = session->points[index * stride + d];
+            centroids[j * stride + d] = seed[d] << FIXED_SHIFT;
+        }
+        if (j + 1 == num_centroids) {
+            break;
+        }
+
+        uint32_t first_seed = j == 0;
+        DPU_ASSERT(dpu_broadcast_to(session->set, "seed", 0, seed, sizeof(seed), DPU_XFER_DEFAULT));
+        DPU_ASSERT(dpu_broadcast_to(session->set, "first_seed", 0, &first_seed, sizeof(uint32_t), DPU_XFER_DEFAULT));
+        phase_end(session->phase_time, KMEANS_PHASE_TO_DPU, start);
+
+        session_launch(session, seed_rank_done);
+
+        // All remaining points coincide with a seed, any point is as good
+        start = kmeans_wall_time();
+        uint64_t total = 0;
+        for (uint32_t i = 0; i < session->nr_dpus; i++) {
+            total += session->dpu_totals[i];
+        }
+        if (total == 0) {
+            index = rand() % session->total_num_points;
+            phase_end(session->phase_time, KMEANS_PHASE_REDUCE, start);
+            continue;
+        }
+
+        uint64_t target = random64() % total;
+        uint32_t dpu_index = weighted_index(session->dpu_totals, session->nr_dpus, &target);
+        DPU_FOREACH(session->set, dpu, each_dpu){
+            if (each_dpu == dpu_index) {
+                break;
+            }
+        }
+        start = phase_end(session->phase_time, KMEANS_PHASE_REDUCE, start);
+
+        uint32_t num_tiles = (session->num_points[dpu_index] + tile_points - 1) / tile_points;
+        DPU_ASSERT(dpu_copy_from(dpu, DPU_MRAM_HEAP_POINTER_NAME, TILE_SUMS_OFFSET, tile_sums, num_tiles * sizeof(uint64_t)));
+        start = phase_end(session->phase_time, KMEANS_PHASE_FROM_DPU, start);
+        uint32_t tile = weighted_index(tile_sums, num_tiles, &target);
+        start = phase_end(session->phase_time, KMEANS_PHASE_REDUCE, start);
+
+        DPU_ASSERT(dpu_copy_from(dpu, DPU_MRAM_HEAP_POINTER_NAME, DISTANCE_OFFSET + (size_t)tile * tile_points * sizeof(uint64_t), distances,
+                                 tile_points * sizeof(uint64_t)));
+        start = phase_end(session->phase_time, KMEANS_PHASE_FROM_DPU, start);
+        index = (uint64_t)dpu_index * session->num_points_per_dpu + (uint64_t)tile * tile_points + weighted_index(distances, tile_points, &target);
+        phase_end(session->phase_time, KMEANS_PHASE_REDUCE, start);
+    }
+
+    free(tile_sums);
+    free(distances);
+}
+
+/*
+    k-means++ seeding on the host CPU, the same draws and the same seeds as session_seed_plusplus
+    centroids receives num_centroids seeds of dim Q16.16 coordinates.
+*/
+static void seed_plusplus_cpu(const uint8_t *points, uint32_t total_num_points, uint32_t dim, int32_t *centroids, uint32_t num_centroids) {
+    uint64_t *distances = malloc((size_t)total_num_points * sizeof(uint64_t));
+    assert(distances != NULL);
+
+    uint64_t index = rand() % total_num_points;
+    for (uint32_t j = 0; j < num_centroids; j++) {
+        const uint8_t *seed = &points[index * dim];
+        for (uint32_t d = 0; d < dim; d++) {
+            centroids[j * dim + d] = seed[d] << FIXED_SHIFT;
+        }
+        if (j + 1 == num_centroids) {
+            break;
+        }
+
+        // Lower the distance of every point to its nearest seed, the integer total is the same for any thread count
+        uint64_t total = 0;
+        #pragma omp parallel for schedule(static) reduction(+:total)
+        for (uint32_t i = 0; i < total_num_points; i++) {
+            uint64_t distance = 0;
+            for (uint32_t d = 0; d < dim; d++) {
+                int32_t diff = points[(size_t)i * dim + d] - seed[d];
+                distance += diff * diff;
+            }
+            if (j == 0 || distance < distances[i]) {
+                distances[i] = distance;
+            }
+            total += distances[i];
+        }
+
+        if (total == 0) {
+            index = rand() % total_num_points;
+            continue;
+        }
+        uint64_t target = random64() % total;
+        index = weighted_index(distances, total_num_points, &target);
+    }
+
+    free(distances);
+}
+
+/* Spread of the cycles of one launch over the DPUs, the slowest DPU bounds the launch */
+struct cycle_stats {
+    uint64_t min;
+    uint64_t max;
+    double mean;
+    uint32_t slowest_dpu;
+};
+
+// Summarize the cycles of the last launch over the DPUs that hold points
+static void session_cycle_stats(const struct dpu_session *session, struct cycle_stats *stats) {
+    uint32_t nr_busy = 0;
+    double total = 0;
+
+    stats->min = UINT64_MAX;
+    stats->max = 0;
+    stats->slowest_dpu = 0;
+    for (uint32_t i = 0; i < session->nr_dpus; i++) {
+        if (session->num_points[i] == 0) {
+            continue;
+        }
+        uint64_t cycles = session->dpu_cycles[i];
+        if (cycles < stats->min) {
+            stats->min = cycles;
+        }
+        if (cycles > stats->max) {
+            stats->max = cycles;
+            stats->slowest_dpu = i;
+        }
+        total += cycles;
+        nr_busy++;
+    }
+    if (nr_busy == 0) {
+        stats->min = 0;
+    }
+    stats->mean = nr_busy ? total / nr_busy : 0;
+}
+
+/* Phase times and DPU cycles of one iteration */
+struct iteration_report {
+    uint32_t changed;
+    uint64_t skipped;               // Distances skipped by the bounds
+    double phase_time[KMEANS_NR_PHASES];
+    struct cycle_stats nearest;     // Assignment launch
+    struct cycle_stats avg;         // Cluster sums launch
+};
+
+/*
+    Write the per iteration report of a run, CSV when path ends in .csv and JSON otherwise.
+    The CSV has one row per iteration, the setup phases are the row of iteration -1.
+*/
+static void write_report(const char *path, const struct kmeans_stats *stats, const struct iteration_report *reports, int nr_iterations,
+                         uint32_t total_num_points, uint32_t dim, uint32_t num_centroids) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        return;
+    }
+
+    size_t length = strlen(path);
+    if (length >= 4 && strcmp(&path[length - 4], ".csv") == 0) {
+        fprintf(file, "iteration,changed,skipped");
+        for (int phase = 0; phase < KMEANS_NR_PHASES; phase++) {
+            fprintf(file, ",%s_s", kmeans_phase_names[phase]);
+        }
+        fprintf(file, ",nearest_min_cycles,nearest_mean_cycles,nearest_max_cycles,nearest_slowest_dpu"
+                      ",avg_min_cycles,avg_mean_cycles,avg_max_cycles,avg_slowest_dpu\n");
+
+        fprintf(file, "-1,0,0");
+        for (int phase = 0; phase < KMEANS_NR_PHASES; phase++) {
+            fprintf(file, ",%f", stats->setup_phase_time[phase]);
+        }
+        fprintf(file, ",0,0,0,0,0,0,0,0\n");
+
+        for (int iter = 0; iter < nr_iterations; iter++) {
+            const struct iteration_report *report = &reports[iter];
+            fprintf(file, "%d,%u,%" PRIu64, iter, report->changed, report->skipped);
+            for (int phase = 0; phase < KMEANS_NR_PHASES; phase++) {
+                fprintf(file, ",%f", report->phase_time[phase]);
+            }
+            fprintf(file, ",%" PRIu64 ",%.0f,%" PRIu64 ",%u,%" PRIu64 ",%.0f,%" PRIu64 ",%u\n",
+                    report->nearest.min, report->nearest.mean, report->nearest.max, report->nearest.slowest_dpu,
+                    report->avg.min, report->avg.mean, report->avg.max, report->avg.slowest_dpu);
+        }
+        fclose(file);
+        return;
+    }
+
+    fprintf(file, "{\n  \"dpus\": %u,\n  \"ranks\": %u,\n  \"points\": %u,\n  \"dims\": %u,\n  \"centroids\": %u,\n",
+            stats->nr_dpus, stats->nr_ranks, total_num_points, dim, num_centroids);
+    fprintf(file, "  \"converged\": %s,\n", stats->converged ? "true" : "false");
+    fprintf(file, "  \"setup_s\": %f,\n  \"total_s\": %f,\n  \"setup\": {", stats->setup_time, stats->total_time);
+    for (int phase = 0; phase < KMEANS_NR_PHASES; phase++) {
+        fprintf(file, "%s\"%s_s\": %f", phase ? ", " : "", kmeans_phase_names[phase], stats->setup_phase_time[phase]);
+    }
+    fprintf(file, "},\n  \"phases\": {");
+    for (int phase = 0; phase < KMEANS_NR_PHASES; phase++) {
+        fprintf(file, "%s\"%s_s\": %f", phase ? ", " : "", kmeans_phase_names[phase], stats->phase_time[phase]);
+    }
+    fprintf(file, "},\n  \"iterations\": [\n");
+    for (int iter = 0; iter < nr_iterations; iter++) {
+        const struct iteration_report *report = &reports[iter];
+        fprintf(file, "    {\"iteration\": %d, \"changed\": %u, \"skipped\": %" PRIu64, iter, report->changed, report->skipped);
+        for (int phase = 0; phase < KMEANS_NR_PHASES; phase++) {
+            fprintf(file, ", \"%s_s\": %f", kmeans_phase_names[phase], report->phase_time[phase]);
+        }
+        const struct cycle_stats *launches[2] = { &report->nearest, &report->avg };
+        const char *launch_names[2] = { "nearest_cycles", "avg_cycles" };
+        for (int l = 0; l < 2; l++) {
+            fprintf(file, ", \"%s\": {\"min\": %" PRIu64 ", \"mean\": %.0f, \"max\": %" PRIu64 ", \"slowest_dpu\": %u}",
+                    launch_names[l], launches[l]->min, launches[l]->mean, launches[l]->max, launches[l]->slowest_dpu);
+        }
+        fprintf(file, "}%s\n", iter + 1 < nr_iterations ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+}
+
+/*
+    Move every centroid to the mean of its cluster, rounded to nearest, an empty cluster keeps its centroid
+    Returns the largest squared distance a centroid moved, in Q32.32
+*/
+static int64_t update_centroids(int32_t *centroids, const uint64_t *total_sum, const uint32_t *num_points_per_centroid, uint32_t num_centroids, uint32_t stride) {
+    int64_t max_shift = 0;
+    for (uint32_t i = 0; i < num_centroids; i++) {
+        uint64_t count = num_points_per_centroid[i];
+        int64_t shift = 0;
+        for (uint32_t d = 0; count != 0 && d < stride; d++) {
+            int32_t mean = ((total_sum[i * stride + d] << FIXED_SHIFT) + count / 2) / count;
+            shift += (int64_t)(mean - centroids[i * stride + d]) * (mean - centroids[i * stride + d]);
+            centroids[i * stride + d] = mean;
+        }
+        if (shift > max_shift) {
+            max_shift = shift;
+        }
+    }
+    return max_shift;
+}
+
+/*
+    Whether a run stops after a pass that changed the labels of changed points and moved the
+    centroids by at most max_shift, the squared Q32.32 distance of update_centroids.
+    The DPUs and the CPU engine stop at the same pass, so their results stay identical.
+    With the default thresholds of 0 the run stops once the centroids stop moving: the next
+    pass would change no label and compute the same centroids again.
+*/
+static int converged(const struct kmeans_options *options, uint32_t changed, uint32_t total_num_points, int64_t max_shift) {
+    double tolerance = options->tolerance * FIXED_ONE;
+    return changed <= options->max_changed * total_num_points || (tolerance >= 0 && max_shift <= tolerance * tolerance);
+}
+
+// Nearest of num_centroids 2-D Q16.16 centroids to the point (x, y), with the distance and the ties of the kernels
+static uint16_t nearest_cell_centroid(uint32_t x, uint32_t y, const int32_t *centroids, const int64_t *norms, uint32_t num_centroids,
+                                      int64_t *min_distance) {
+    uint16_t label = 0;
+    *min_distance = INT64_MAX;
+    for (uint32_t j = 0; j < num_centroids; j++) {
+        uint64_t dot = (uint64_t)x * (uint32_t)centroids[j * 2] + (uint64_t)y * (uint32_t)centroids[j * 2 + 1];
+        int64_t distance = norms[j] - (int64_t)(dot << (FIXED_SHIFT + 1));
+        if (distance < *min_distance) {
+            *min_distance = distance;
+            label = j;
+        }
+    }
+    return label;
+}
+
+/*
+    Lloyd iterations over the occupied cells of a 2-D histogram, every cell weighted with its count
+        1. Label every occupied cell with its nearest centroid, the label each of its points gets
+        2. Sum count times the coordinates and the counts per cluster, the sums of the points themselves
+        3. Move the centroids and stop like a fit over the points does
+    A pass costs the occupied cells, at most HISTOGRAM_CELLS, times the centroids whatever the
+    number of points, and gives the same centroids, changed labels and passes as a fit over the
+    points. centroids holds num_centroids * 2 Q16.16 coordinates, the initial ones on entry and
+    the final ones on return. assigned receives the centroids of the last assignment, the ones
+    the points are labelled with, and cell_labels the label of every occupied cell unless NULL.
+    With options->inertia the inertia of the final centroids is summed over the cells too.
+*/
+static void histogram_kmeans(const uint32_t *histogram, uint32_t total_num_points, int32_t *centroids, uint32_t num_centroids,
+                             int32_t *assigned, uint16_t *cell_labels, const struct kmeans_options *options, struct kmeans_stats *stats) {
+    uint32_t *cells = malloc(HISTOGRAM_CELLS * sizeof(uint32_t));
+    uint16_t *labels = malloc(HISTOGRAM_CELLS * sizeof(uint16_t));
+    uint64_t total_sum[num_centroids * 2];
+    uint32_t num_points_per_centroid[num_centroids];
+    int64_t norms[num_centroids];
+    assert(cells != NULL && labels != NULL);
+
+    uint32_t num_cells = 0;
+    for (uint32_t c = 0; c < HISTOGRAM_CELLS; c++) {
+        if (histogram[c] != 0) {
+            labels[num_cells] = UINT16_MAX;
+            cells[num_cells++] = c;
+        }
+    }
+    stats->cells = num_cells;
+
+    stats->converged = 0;
+    for (int iter = 0; iter <= options->iterations && !stats->converged; iter++) {
+        for (uint32_t j = 0; j < num_centroids; j++) {
+            norms[j] = (int64_t)centroids[j * 2] * centroids[j * 2] + (int64_t)centroids[j * 2 + 1] * centroids[j * 2 + 1];
+        }
+        memcpy(assigned, centroids, (size_t)num_centroids * 2 * sizeof(int32_t));
+        memset(total_sum, 0, sizeof(total_sum));
+        memset(num_points_per_centroid, 0, sizeof(num_points_per_centroid));
+        uint32_t changed = 0;
+
+        #pragma omp parallel
+        {
+            // Partial results of this thread
+            uint64_t *local_sums = calloc(num_centroids * 2, sizeof(uint64_t));
+            uint32_t *local_counts = calloc(num_centroids, sizeof(uint32_t));
+            uint32_t local_changed = 0;
+            assert(local_sums != NULL && local_counts != NULL);
+
+            #pragma omp for schedule(static)
+            for (uint32_t i = 0; i < num_cells; i++) {
+                uint32_t x = cells[i] / HISTOGRAM_SIDE;
+                uint32_t y = cells[i] % HISTOGRAM_SIDE;
+                uint32_t weight = histogram[cells[i]];
+                int64_t distance;
+                uint16_t label = nearest_cell_centroid(x, y, centroids, norms, num_centroids, &distance);
+                local_changed += label != labels[i] ? weight : 0;
+                labels[i] = label;
+                local_sums[label * 2] += (uint64_t)weight * x;
+                local_sums[label * 2 + 1] += (uint64_t)weight * y;
+                local_counts[label] += weight;
+            }
+
+            // Merge the partial results, one thread at a time
+            #pragma omp critical
+            {
+                for (uint32_t v = 0; v < num_centroids * 2; v++) {
+                    total_sum[v] += local_sums[v];
+                }
+                for (uint32_t j = 0; j < num_centroids; j++) {
+                    num_points_per_centroid[j] += local_counts[j];
+                }
+                changed += local_changed;
+            }
+
+            free(local_sums);
+            free(local_counts);
+        }
+
+        int64_t max_shift = update_centroids(centroids, total_sum, num_points_per_centroid, num_centroids, 2);
+        if (options->verbose) {
+            printf("Iteration %d: %u labels changed, %u cells\n", iter, changed, num_cells);
+        }
+        stats->iterations = iter + 1;
+        stats->converged = converged(options, changed, total_num_points, max_shift);
+    }
+
+    for (uint32_t i = 0; cell_labels != NULL && i < num_cells; i++) {
+        cell_labels[cells[i]] = labels[i];
+    }
+
+    // Each distance is truncated to Q16.16 before it counts once per point, like the DPUs sum it
+    if (options->inertia) {
+        for (uint32_t j = 0; j < num_centroids; j++) {
+            norms[j] = (int64_t)centroids[j * 2] * centroids[j * 2] + (int64_t)centroids[j * 2 + 1] * centroids[j * 2 + 1];
+        }
+        uint64_t inertia = 0;
+        #pragma omp parallel for schedule(static) reduction(+:inertia)
+        for (uint32_t i = 0; i < num_cells; i++) {
+            uint32_t x = cells[i] / HISTOGRAM_SIDE;
+            uint32_t y = cells[i] % HISTOGRAM_SIDE;
+            int64_t distance;
+            nearest_cell_centroid(x, y, centroids, norms, num_centroids, &distance);
+            distance += (int64_t)(x * x + y * y) << 32;
+            inertia += ((uint64_t)distance >> FIXED_SHIFT) * histogram[cells[i]];
+        }
+        stats->inertia = (double)inertia / FIXED_ONE;
+    }
+
+    free(cells);
+    free(labels);
+}
+
+/*
+    Count the resident 2-D points of every DPU into one occupancy histogram of HISTOGRAM_CELLS counts
+    The histogram kernel builds the histogram of every DPU in MRAM in a single launch, the host
+    copies them back a rank at a time, 256 KB per DPU, and adds them up.
+*/
+static void session_histogram(struct dpu_session *session, const char *binary, uint32_t *histogram) {
+    struct dpu_set_t rank;
+    struct dpu_set_t dpu;
+    uint32_t each_rank;
+    uint32_t each_dpu;
+    uint32_t *dpu_histograms = NULL;
+    uint32_t capacity = 0;
+
+    session_load(session, binary);
+    double launch = kmeans_wall_time();
+    DPU_ASSERT(dpu_launch(session->set, DPU_SYNCHRONOUS));
+    phase_end(session->phase_time, KMEANS_PHASE_LAUNCH, launch);
+
+    memset(histogram, 0, HISTOGRAM_CELLS * sizeof(uint32_t));
+    DPU_RANK_FOREACH(session->set, rank, each_rank){
+        uint32_t nr_dpus;
+        DPU_ASSERT(dpu_get_nr_dpus(rank, &nr_dpus));
+        if (nr_dpus > capacity) {
+            capacity = nr_dpus;
+            free(dpu_histograms);
+            dpu_histograms = malloc((size_t)capacity * HISTOGRAM_CELLS * sizeof(uint32_t));
+            assert(dpu_histograms != NULL);
+        }
+
+        double start = kmeans_wall_time();
+        DPU_FOREACH(rank, dpu, each_dpu){
+            DPU_ASSERT(dpu_prepare_xfer(dpu, &dpu_histograms[(size_t)each_dpu * HISTOGRAM_CELLS]));
+        }
+        DPU_ASSERT(dpu_push_xfer(rank, DPU_XFER_FROM_DPU, DPU_MRAM_HEAP_POINTER_NAME, HISTOGRAM_OFFSET, HISTOGRAM_CELLS * sizeof(uint32_t),
+                                 DPU_XFER_DEFAULT));
+        start = phase_end(session->phase_time, KMEANS_PHASE_FROM_DPU, start);
+
+        #pragma omp parallel for schedule(static)
+        for (uint32_t c = 0; c < HISTOGRAM_CELLS; c++) {
+            uint32_t count = histogram[c];
+            for (uint32_t j = 0; j < nr_dpus; j++) {
+                count += dpu_histograms[(size_t)j * HISTOGRAM_CELLS + c];
+            }
+            histogram[c] = count;
+        }
+        phase_end(session->phase_time, KMEANS_PHASE_REDUCE, start);
+    }
+    free(dpu_histograms);
+}
+
+// Count 2-D points into an occupancy histogram of HISTOGRAM_CELLS counts, per thread first
+static void cpu_histogram(const uint8_t *points, uint32_t total_num_points, uint32_t *histogram) {
+    memset(histogram, 0, HISTOGRAM_CELLS * sizeof(uint32_t));
+    #pragma omp parallel
+    {
+        uint32_t *local = calloc(HISTOGRAM_CELLS, sizeof(uint32_t));
+        assert(local != NULL);
+
+        #pragma omp for schedule(static)
+        for (uint32_t i = 0; i < total_num_points; i++) {
+            local[points[(size_t)i * 2] * HISTOGRAM_SIDE + points[(size_t)i * 2 + 1]]++;
+        }
+
+        #pragma omp critical
+        for (uint32_t c = 0; c < HISTOGRAM_CELLS; c++) {
+            histogram[c] += local[c];
+        }
+        free(local);
+    }
+}
+
+// Whether candidate a is farther than candidate b, the higher index on a tie, like the distance kernel
+static int candidate_after(const struct knn_candidate *a, const struct knn_candidate *b) {
+    return a->distance > b->distance || (a->distance == b->distance && a->index > b->index);
+}
+
+// Put a candidate at the top of a heap of size candidates, the farthest first, and sift it down
+static void heap_sift(struct knn_candidate *heap, uint32_t size, struct knn_candidate candidate) {
+    uint32_t i = 0;
+    for (uint32_t child = 1; child < size; child = 2 * i + 1) {
+        if (child + 1 < size && candidate_after(&heap[child + 1], &heap[child])) {
+            child++;
+        }
+        if (!candidate_after(&heap[child], &candidate)) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = candidate;
+}
+
+// Keep a candidate in a heap of the k nearest ones when it is nearer than the farthest
+static void heap_offer(struct knn_candidate *heap, uint32_t k, struct knn_candidate candidate) {
+    if (candidate_after(&heap[0], &candidate)) {
+        heap_sift(heap, k, candidate);
+    }
+}
+
+// Empty a heap of k candidates into indices and distances, nearest first
+static void heap_sort(struct knn_candidate *heap, uint32_t k, uint32_t *indices, uint32_t *distances) {
+    for (uint32_t size = k; size > 1; size--) {
+        struct knn_candidate last = heap[size - 1];
+        heap[size - 1] = heap[0];
+        heap_sift(heap, size - 1, last);
+    }
+    for (uint32_t i = 0; i < k; i++) {
+        indices[i] = heap[i].index;
+        distances[i] = heap[i].distance;
+    }
+}
+
+// Queries per launch of the distance kernel, for k candidates or a matrix row of pitch distances each
+static uint32_t distance_batch(uint32_t stride, uint32_t k, uint32_t pitch) {
+    uint32_t batch = KNN_MAX_QUERIES;
+    uint32_t limit = k != 0 ? KNN_MAX_CANDIDATES / k : MATRIX_BYTES / (pitch * sizeof(uint32_t));
+    if (batch > KNN_QUERY_BYTES / stride) {
+        batch = KNN_QUERY_BYTES / stride;
+    }
+    return batch < limit ? batch : limit;
+}
+
+/*
+    Broadcast the queries of one launch of the distance kernel, padded to the dimension bucket
+    k is the number of candidates kept per query, 0 for the rows of the distance matrix.
+*/
+static void session_broadcast_queries(struct dpu_session *session, const uint8_t *queries, uint32_t num_queries, uint32_t k) {
+    uint32_t pitch = session->num_points_per_dpu;
+    uint8_t padded[ALIGN8(num_queries * session->stride)];
+
+    double start = kmeans_wall_time();
+    memset(padded, 0, sizeof(padded));
+    for (uint32_t q = 0; q < num_queries; q++) {
+        memcpy(&padded[q * session->stride], &queries[(size_t)q * session->dim], session->dim);
+    }
+    DPU_ASSERT(dpu_broadcast_to(session->set, "num_queries", 0, &num_queries, sizeof(uint32_t), DPU_XFER_DEFAULT));
+    DPU_ASSERT(dpu_broadcast_to(session->set, "queries", 0, padded, sizeof(padded), DPU_XFER_DEFAULT));
+    DPU_ASSERT(dpu_broadcast_to(session->set, "k", 0, &k, sizeof(uint32_t), DPU_XFER_DEFAULT));
+    DPU_ASSERT(dpu_broadcast_to(session->set, "pitch", 0, &pitch, sizeof(uint32_t), DPU_XFER_DEFAULT));
+    phase_end(session->phase_time, KMEANS_PHASE_TO_DPU, start);
+}
+
+/*
+    Merge the candidates of every DPU after a top-k launch of the distance kernel
+    Each DPU returns num_queries * k candidates, copied back a rank at a time and offered to
+    heaps, num_queries heaps of k candidates that start empty, with the indices of the points
+    in the whole set.
+*/
+static void session_merge_candidates(struct dpu_session *session, uint32_t num_queries, uint32_t k, struct knn_candidate *heaps) {
+    struct dpu_set_t rank;
+    struct dpu_set_t dpu;
+    uint32_t each_rank;
+    uint32_t each_dpu;
+    uint32_t dpu_candidates = num_queries * k;
+    struct knn_candidate *rank_candidates = NULL;
+    uint32_t capacity = 0;
+
+    for (uint32_t c = 0; c < dpu_candidates; c++) {
+        heaps[c].distance = UINT32_MAX;
+        heaps[c].index = UINT32_MAX;
+    }
+    DPU_RANK_FOREACH(session->set, rank, each_rank){
+        uint32_t nr_dpus;
+        uint32_t first_dpu = session->rank_first_dpu[each_rank];
+        DPU_ASSERT(dpu_get_nr_dpus(rank, &nr_dpus));
+        if (nr_dpus > capacity) {
+            capacity = nr_dpus;
+            free(rank_candidates);
+            rank_candidates = malloc((size_t)capacity * dpu_candidates * sizeof(struct knn_candidate));
+            assert(rank_candidates != NULL);
+        }
+
+        double start = kmeans_wall_time();
+        DPU_FOREACH(rank, dpu, each_dpu){
+            DPU_ASSERT(dpu_prepare_xfer(dpu, &rank_candidates[(size_t)each_dpu * dpu_candidates]));
+        }
+        DPU_ASSERT(dpu_push_xfer(rank, DPU_XFER_FROM_DPU, "candidates", 0, dpu_candidates * sizeof(struct knn_candidate), DPU_XFER_DEFAULT));
+        start = phase_end(session->phase_time, KMEANS_PHASE_FROM_DPU, start);
+
+        // A DPU with fewer than k points leaves empty slots anywhere in its heap
+        #pragma omp parallel for schedule(static)
+        for (uint32_t q = 0; q < num_queries; q++) {
+            for (uint32_t j = 0; j < nr_dpus; j++) {
+                uint32_t offset = (first_dpu + j) * session->num_points_per_dpu;
+                const struct knn_candidate *candidates = &rank_candidates[(size_t)j * dpu_candidates + q * k];
+                for (uint32_t c = 0; c < k; c++) {
+                    if (candidates[c].index == UINT32_MAX) {
+                        continue;
+                    }
+                    struct knn_candidate candidate = { candidates[c].distance, candidates[c].index + offset };
+                    heap_offer(&heaps[q * k], k, candidate);
+                }
+            }
+        }
+        phase_end(session->phase_time, KMEANS_PHASE_REDUCE, start);
+    }
+    free(rank_candidates);
+}
+
+/*
+    Copy back the distance matrix rows of a launch of the distance kernel
+    Row q of a DPU lands straight in distances at q * total_num_points plus the first point
+    of its slice. The slice that runs past the end of the points goes through scratch, the
+    empty ones share its second half, like the tail of session_slice_points.
+*/
+static void session_fetch_rows(struct dpu_session *session, uint32_t num_queries, uint32_t *distances, uint32_t *scratch) {
+    struct dpu_set_t dpu;
+    uint32_t each_dpu;
+    uint32_t pitch = session->num_points_per_dpu;
+    uint32_t total_num_points = session->total_num_points;
+    uint32_t partial = total_num_points / pitch;
+
+    double start = kmeans_wall_time();
+    for (uint32_t q = 0; q < num_queries; q++) {
+        uint32_t *row = &distances[(size_t)q * total_num_points];
+        DPU_FOREACH(session->set, dpu, each_dpu){
+            uint64_t begin = (uint64_t)each_dpu * pitch;
+            uint32_t *target = begin + pitch <= total_num_points ? &row[begin] : each_dpu == partial ? scratch : &scratch[pitch];
+            DPU_ASSERT(dpu_prepare_xfer(dpu, target));
+        }
+        DPU_ASSERT(dpu_push_xfer(session->set, DPU_XFER_FROM_DPU, DPU_MRAM_HEAP_POINTER_NAME, MATRIX_OFFSET + (size_t)q * pitch * sizeof(uint32_t),
+                                 pitch * sizeof(uint32_t), DPU_XFER_DEFAULT));
+        if (partial < session->nr_dpus && total_num_points % pitch != 0) {
+            memcpy(&row[(size_t)partial * pitch], scratch, (total_num_points % pitch) * sizeof(uint32_t));
+        }
+    }
+    phase_end(session->phase_time, KMEANS_PHASE_FROM_DPU, start);
+}
+
+// Squared distance between a point and a query of dim coordinates, as on the DPUs
+static uint32_t query_distance(const uint8_t *point, const uint8_t *query, uint32_t dim) {
+    uint32_t distance = 0;
+    for (uint32_t d = 0; d < dim; d++) {
+        int32_t diff = point[d] - query[d];
+        distance += diff * diff;
+    }
+    return distance;
+}
+
+/*
+    Sum of the squared distances of the points to the centroid of their label
+    Each distance is exact in Q32.32 and truncated to Q16.16 before the sum, like the DPUs do.
+*/
+static double cpu_inertia(const uint8_t *points, uint32_t total_num_points, uint32_t dim, const int32_t *centroids, const uint16_t *labels) {
+    uint64_t inertia = 0;
+    #pragma omp parallel for reduction(+:inertia)
+    for (uint32_t i = 0; i < total_num_points; i++) {
+        const int32_t *centroid = &centroids[(size_t)labels[i] * dim];
+        int64_t distance = 0;
+        for (uint32_t d = 0; d < dim; d++) {
+            int64_t diff = ((int64_t)points[(size_t)i * dim + d] << FIXED_SHIFT) - centroid[d];
+            distance += diff * diff;
+        }
+        inertia += (uint64_t)distance >> FIXED_SHIFT;
+    }
+    return (double)inertia / FIXED_ONE;
+}
+
+/*
+    Run k-means on the host CPU with cpu_engine, the fallback when no DPUs are used
+    Same arguments and results as kmeans_run, the setup is the copy into the structure of
+    arrays layout and the seeding. The DPU phases and the report do not apply and stay empty.
+*/
+static void run_kmeans_cpu(uint8_t *points, uint32_t total_num_points, uint32_t dim, int32_t *centroids, uint32_t num_centroids,
+                           uint16_t *labels, const struct kmeans_options *options, struct kmeans_stats *stats) {
+    uint32_t num_points_per_centroid[num_centroids];
+    uint64_t total_sum[num_centroids * dim];
+
+    double start = kmeans_wall_time();
+    memset(stats, 0, sizeof(*stats));
+    if (options->plusplus) {
+        double seeding = kmeans_wall_time();
+        seed_plusplus_cpu(points, total_num_points, dim, centroids, num_centroids);
+        stats->seed_time = kmeans_wall_time() - seeding;
+        if (options->seeds != NULL) {
+            memcpy(options->seeds, centroids, (size_t)num_centroids * dim * sizeof(int32_t));
+        }
+    }
+
+    // The histogram replaces the points, every point then takes the label of its cell
+    if (options->histogram) {
+        uint32_t *histogram = malloc(HISTOGRAM_CELLS * sizeof(uint32_t));
+        uint16_t *cell_labels = malloc(HISTOGRAM_CELLS * sizeof(uint16_t));
+        int32_t assigned[num_centroids * 2];
+        assert(histogram != NULL && cell_labels != NULL);
+        double counting = kmeans_wall_time();
+        cpu_histogram(points, total_num_points, histogram);
+        double setup = kmeans_wall_time();
+        stats->histogram_time = setup - counting;
+
+        histogram_kmeans(histogram, total_num_points, centroids, num_centroids, assigned, cell_labels, options, stats);
+        #pragma omp parallel for schedule(static) if (labels != NULL)
+        for (uint32_t i = 0; i < (labels != NULL ? total_num_points : 0); i++) {
+            labels[i] = cell_labels[points[(size_t)i * 2] * HISTOGRAM_SIDE + points[(size_t)i * 2 + 1]];
+        }
+        stats->setup_time = setup - start;
+        stats->total_time = kmeans_wall_time() - start;
+        free(histogram);
+        free(cell_labels);
+        return;
+    }
+
+    struct cpu_engine engine;
+    cpu_engine_init(&engine, points, total_num_points, dim);
+    double setup = kmeans_wall_time();
+
+    for (int iter = 0; iter <= options->iterations && !stats->converged; iter++) {
+        uint32_t changed = cpu_engine_step(&engine, centroids, num_centroids, total_sum, num_points_per_centroid);
+        int64_t max_shift = update_centroids(centroids, total_sum, num_points_per_centroid, num_centroids, dim);
+        if (options->verbose) {
+            printf("Iteration %d: %u labels changed\n", iter, changed);
+        }
+        stats->iterations = iter + 1;
+        stats->converged = converged(options, changed, total_num_points, max_shift);
+    }
+
+    if (labels != NULL) {
+        memcpy(labels, engine.labels, total_num_points * sizeof(uint16_t));
+    }
+
+    // One more pass labels the points with the final centroids, then sum the distances as the DPUs do
+    if (options->inertia) {
+        cpu_engine_step(&engine, centroids, num_centroids, total_sum, num_points_per_centroid);
+        stats->inertia = cpu_inertia(points, total_num_points, dim, centroids, engine.labels);
+    }
+    double end = kmeans_wall_time();
+
+    stats->setup_time = setup - start;
+    stats->total_time = end - start;
+
+    cpu_engine_free(&engine);
+}
+
+/*
+    A k-means context, the DPU session of the library API
+    The session outlives the fits and predicts, the context tracks what its MRAM holds: the
+    training points, or the queries of the last predict, and whether the labels belong to a
+    previous fit. The model is kept in the dim coordinates of the caller.
+*/
+struct kmeans_context {
+    struct dpu_session session;     // Without DPUs only the CPU engine is used, the session stays empty
+    uint32_t nr_dpus;               // DPUs of the session, 0 for the CPU engine
+    char binary_dir[KERNEL_DIR_SIZE];
+    char nearest_binary[KERNEL_PATH_SIZE];  // Kernel builds of the dimension bucket of the points
+    char bounded_binary[KERNEL_PATH_SIZE];
+    char avg_binary[KERNEL_PATH_SIZE];
+    char seed_binary[KERNEL_PATH_SIZE];
+    char histogram_binary[KERNEL_PATH_SIZE];
+    char matrix_binary[KERNEL_PATH_SIZE];
+    uint8_t *points;                // Training points of the caller
+    uint32_t total_num_points;
+    uint32_t dim;                   // Coordinates of the points and the model, 0 before the first
+    int points_resident;            // The MRAM holds the training points
+    int labels_assigned;            // The labels in MRAM belong to a previous fit
+    int32_t *centroids;             // Model, num_centroids * dim Q16.16 coordinates
+    uint32_t num_centroids;         // 0 without a model
+    int model_resident;             // The WRAM of the DPUs holds the model and the predict kernel
+    double setup_start;             // Start of the allocation and uploads no fit reported yet, negative if none
+    double phase_mark[KMEANS_NR_PHASES]; // Session phase times already reported or spent in predicts
+};
+
+/*
+    Run k-means on the DPUs of a context
+        1. The points are resident since kmeans_set_points, only the labels of a previous
+           fit are reset
+        2. Per iteration assign the labels, sum the clusters and move each centroid to the
+           mean of its cluster, rounded to Q16.16
+        3. Stop at options->iterations, or earlier once converged, the DPUs count the labels
+           that changed against the previous labels kept in MRAM
+        4. Record the timings in stats, and per iteration in options->report when set
+    centroids holds num_centroids * dim Q16.16 coordinates, the initial centroids on entry and
+    the final ones on return. labels receives the final label of every point unless it is NULL.
+    With options->plusplus the initial centroids are ignored, the session is seeded with
+    k-means++ after the upload and the seeds are copied to options->seeds.
+    Returns 1 when the points cannot be uploaded again after a predict, 0 otherwise.
+*/
+static int run_kmeans_dpus(struct kmeans_context *context, int32_t *centroids, uint32_t num_centroids, uint16_t *labels,
+                            const struct kmeans_options *options, struct kmeans_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    struct dpu_session *session = &context->session;
+    uint32_t total_num_points = context->total_num_points;
+    uint32_t dim = context->dim;
+    uint32_t stride = kmeans_dim_bucket(dim);
+    uint32_t num_points_per_centroid[num_centroids];
+    uint64_t total_sum[num_centroids * stride];
+    int32_t centroid[num_centroids * stride];
+
+    // The kernel builds of the dimension bucket
+    const char *nearest_binary = options->bounded && !options->histogram ? context->bounded_binary : context->nearest_binary;
+    const char *avg_binary = context->avg_binary;
+
+    // The centroids padded to the dimension bucket, the extra coordinates stay zero
+    memset(centroid, 0, sizeof(centroid));
+    for (uint32_t i = 0; i < num_centroids; i++) {
+        memcpy(&centroid[i * stride], &centroids[i * dim], dim * sizeof(int32_t));
+    }
+
+    // Start the timer, at the allocation or upload when this fit is the first one after them
+    double start = context->setup_start >= 0 ? context->setup_start : kmeans_wall_time();
+
+    // Upload the points again after a predict, or forget the labels of the previous fit
+    if (!context->points_resident) {
+        if (session_set_points(session, context->points, total_num_points, dim) != 0) {
+            return 1;
+        }
+        context->points_resident = 1;
+    } else if (context->labels_assigned) {
+        session_reset_labels(session);
+    }
+    context->labels_assigned = 1;
+    session->async = options->async;
+    session->bounded = options->bounded && !options->histogram;
+    stats->seed_time = 0;
+    if (options->plusplus) {
+        double seeding = kmeans_wall_time();
+        session_seed_plusplus(session, context->seed_binary, centroid, num_centroids);
+        stats->seed_time = kmeans_wall_time() - seeding;
+        for (uint32_t i = 0; options->seeds != NULL && i < num_centroids; i++) {
+            memcpy(&options->seeds[i * dim], &centroid[i * stride], dim * sizeof(int32_t));
+        }
+    }
+    uint32_t *histogram = NULL;
+    if (options->histogram) {
+        double counting = kmeans_wall_time();
+        histogram = malloc(HISTOGRAM_CELLS * sizeof(uint32_t));
+        assert(histogram != NULL);
+        session_histogram(session, context->histogram_binary, histogram);
+        stats->histogram_time = kmeans_wall_time() - counting;
+    }
+    double setup = kmeans_wall_time();
+    for (int phase = 0; phase < KMEANS_NR_PHASES; phase++) {
+        stats->setup_phase_time[phase] = session->phase_time[phase] - context->phase_mark[phase];
+    }
+
+    struct iteration_report *reports = NULL;
+    if (options->report != NULL && !options->histogram) {
+        reports = calloc(options->iterations + 1, sizeof(struct iteration_report));
+        assert(reports != NULL);
+    }
+
+    // The iterations run on the host over the histogram, one launch labels the points with the centroids of the last pass
+    stats->converged = 0;
+    stats->skipped = 0;
+    if (histogram != NULL) {
+        int32_t assigned[num_centroids * stride];
+        double reduce = kmeans_wall_time();
+        histogram_kmeans(histogram, total_num_points, centroid, num_centroids, assigned, NULL, options, stats);
+        phase_end(session->phase_time, KMEANS_PHASE_REDUCE, reduce);
+        if (labels != NULL) {
+            session_load(session, nearest_binary);
+            session_assign(session, assigned, num_centroids);
+        }
+        free(histogram);
+    }
+
+    // The first pass followed by the refinement iterations
+    int final_assigned = 0;
+    for (int iter = 0; !options->histogram && iter <= options->iterations && !stats->converged; iter++) {
+        double phase_start[KMEANS_NR_PHASES];
+        memcpy(phase_start, session->phase_time, sizeof(phase_start));
+
+        // Find the nearest centroid to each point use DPUs, all centroids in one launch
+        session_load(session, nearest_binary);
+        if (options->reload_per_launch) {
+            session_reload(session, nearest_binary);
+        }
+        uint32_t changed = session_assign(session, centroid, num_centroids);
+        stats->skipped += session->skipped;
+        if (options->verbose && options->bounded) {
+            printf("Iteration %d: %u labels changed, %" PRIu64 " of %" PRIu64 " distances skipped\n", iter, changed, session->skipped,
+                   (uint64_t)total_num_points * num_centroids);
+        } else if (options->verbose) {
+            printf("Iteration %d: %u labels changed\n", iter, changed);
+        }
+        if (reports != NULL) {
+            reports[iter].changed = changed;
+            reports[iter].skipped = session->skipped;
+            session_cycle_stats(session, &reports[iter].nearest);
+        }
+        stats->iterations = iter + 1;
+
+        // No label changed, so the centroids already are the means of their clusters
+        if (iter > 0 && changed == 0) {
+            stats->converged = 1;
+            final_assigned = !options->bounded;
+            for (int phase = 0; reports != NULL && phase < KMEANS_NR_PHASES; phase++) {
+                reports[iter].phase_time[phase] = session->phase_time[phase] - phase_start[phase];
+            }
+            break;
+        }
+
+        // Sum the coordinates and count the points of every cluster use DPUs, the labels are already resident
+        session_load(session, avg_binary);
+        if (options->reload_per_launch) {
+            session_reload(session, avg_binary);
+        }
+        session_cluster_sums(session, num_centroids, total_sum, num_points_per_centroid);
+        if (reports != NULL) {
+            session_cycle_stats(session, &reports[iter].avg);
+        }
+
+        double reduce = kmeans_wall_time();
+        int64_t max_shift = update_centroids(centroid, total_sum, num_points_per_centroid, num_centroids, stride);
+        stats->converged = converged(options, changed, total_num_points, max_shift);
+        phase_end(session->phase_time, KMEANS_PHASE_REDUCE, reduce);
+
+        for (int phase = 0; reports != NULL && phase < KMEANS_NR_PHASES; phase++) {
+            reports[iter].phase_time[phase] = session->phase_time[phase] - phase_start[phase];
+        }
+
+        // Print the centroids
+        for (uint32_t i = 0; options->verbose && i < num_centroids; i++) {
+            printf("AVG Centroid %u: (", i);
+            for (uint32_t d = 0; d < dim; d++) {
+                printf(d == 0 ? "%.3f" : ", %.3f", (double)centroid[i * stride + d] / FIXED_ONE);
+            }
+            printf(")\n");
+        }
+    }
+
+    if (labels != NULL) {
+        session_read_labels(session);
+        memcpy(labels, session->labels, total_num_points * sizeof(uint16_t));
+    }
+
+    // The inertia comes with an unbounded assignment to the final centroids, the labels in MRAM then follow them.
+    // A bounded fit switches to the unbounded kernel, whose load clears the WRAM, session_assign broadcasts the centroids again
+    if (options->inertia && !options->histogram) {
+        if (!final_assigned) {
+            session->bounded = 0;
+            session_load(session, context->nearest_binary);
+            session_assign(session, centroid, num_centroids);
+        }
+        stats->inertia = (double)session->inertia / FIXED_ONE;
+    }
+
+    // End the timer
+    double end = kmeans_wall_time();
+
+    for (uint32_t i = 0; i < num_centroids; i++) {
+        memcpy(&centroids[i * dim], &centroid[i * stride], dim * sizeof(int32_t));
+    }
+
+    stats->nr_dpus = session->nr_dpus;
+    stats->nr_ranks = session->nr_ranks;
+    stats->setup_time = setup - start;
+    stats->total_time = end - start;
+    for (int phase = 0; phase < KMEANS_NR_PHASES; phase++) {
+        stats->phase_time[phase] = session->phase_time[phase] - context->phase_mark[phase];
+    }
+    memcpy(context->phase_mark, session->phase_time, sizeof(session->phase_time));
+    context->setup_start = -1;
+
+    if (reports != NULL) {
+        write_report(options->report, stats, reports, stats->iterations, total_num_points, dim, num_centroids);
+        free(reports);
+    }
+    return 0;
+}
+
+
+// A context without DPUs, NULL when binary_dir is too long
+static struct kmeans_context *context_new(const char *binary_dir) {
+    if (binary_dir != NULL && strlen(binary_dir) >= KERNEL_DIR_SIZE) {
+        fprintf(stderr, "Kernel directory longer than %d characters: %s\n", KERNEL_DIR_SIZE - 1, binary_dir);
+        return NULL;
+    }
+    struct kmeans_context *context = calloc(1, sizeof(struct kmeans_context));
+    assert(context != NULL);
+    context->centroids = calloc(MAX_CENTROID_VALUES, sizeof(int32_t));
+    assert(context->centroids != NULL);
+    snprintf(context->binary_dir, sizeof(context->binary_dir), "%s", binary_dir != NULL ? binary_dir : ".");
+    context->setup_start = kmeans_wall_time();
+    return context;
+}
+
+struct kmeans_context *kmeans_create(uint32_t nr_dpus, const char *binary_dir) {
+    struct kmeans_context *context = context_new(binary_dir);
+    if (context == NULL) {
+        return NULL;
+    }
+
+    if (nr_dpus != 0) {
+        if (session_init(&context->session, nr_dpus) != DPU_OK) {
+            free(context->centroids);
+            free(context);
+            return NULL;
+        }
+        context->nr_dpus = context->session.nr_dpus;
+    }
+    return context;
+}
+
+void kmeans_destroy(struct kmeans_context *context) {
+    if (context->nr_dpus != 0) {
+        session_free(&context->session);
+    }
+    free(context->centroids);
+    free(context);
+}
+
+uint32_t kmeans_nr_dpus(const struct kmeans_context *context) {
+    return context->nr_dpus;
+}
+
+// Switch the context to points and models of dim coordinates, a model of another dimension is dropped
+static void context_set_dim(struct kmeans_context *context, uint32_t dim) {
+    if (dim == context->dim) {
+        return;
+    }
+    uint32_t stride = kmeans_dim_bucket(dim);
+    kernel_binary(context->nearest_binary, KERNEL_PATH_SIZE, context->binary_dir, NEAREST_CENTROID, stride);
+    kernel_binary(context->bounded_binary, KERNEL_PATH_SIZE, context->binary_dir, BOUNDED_CENTROID, stride);
+    kernel_binary(context->avg_binary, KERNEL_PATH_SIZE, context->binary_dir, AVG_COORDINATE, stride);
+    kernel_binary(context->seed_binary, KERNEL_PATH_SIZE, context->binary_dir, SEED_DISTANCE, stride);
+    kernel_binary(context->histogram_binary, KERNEL_PATH_SIZE, context->binary_dir, HISTOGRAM, stride);
+    kernel_binary(context->matrix_binary, KERNEL_PATH_SIZE, context->binary_dir, DISTANCE_MATRIX, stride);
+    context->dim = dim;
+    context->num_centroids = 0;
+    context->model_resident = 0;
+    context->points = NULL;
+    context->total_num_points = 0;
+}
+
+int kmeans_set_points(struct kmeans_context *context, uint8_t *points, uint32_t num_points, uint32_t dim) {
+    if (num_points == 0 || dim == 0 || dim > MAX_DIM) {
+        fprintf(stderr, "Invalid points: %u points of %u coordinates (at most %u)\n", num_points, dim, MAX_DIM);
+        return 1;
+    }
+    if (context->setup_start < 0) {
+        context->setup_start = kmeans_wall_time();
+    }
+    if (context->nr_dpus != 0 && session_set_points(&context->session, points, num_points, dim) != 0) {
+        return 1;
+    }
+    context_set_dim(context, dim);
+    context->points = points;
+    context->total_num_points = num_points;
+    context->points_resident = 1;
+    context->labels_assigned = 0;
+    return 0;
+}
+
+// Whether num_centroids centroids of dim coordinates fit the kernels
+static int check_centroids(uint32_t num_centroids, uint32_t dim) {
+    if (num_centroids == 0 || num_centroids > MAX_CENTROIDS || num_centroids * kmeans_dim_bucket(dim) > MAX_CENTROID_VALUES) {
+        fprintf(stderr, "Invalid model: %u centroids (at most %u) of %u coordinates, at most %u centroid coordinates in total\n",
+                num_centroids, MAX_CENTROIDS, dim, MAX_CENTROID_VALUES);
+        return 1;
+    }
+    return 0;
+}
+
+int kmeans_fit(struct kmeans_context *context, int32_t *centroids, uint32_t num_centroids, uint16_t *labels,
+               const struct kmeans_options *options, struct kmeans_stats *stats) {
+    if (context->points == NULL) {
+        fprintf(stderr, "No points to fit, see kmeans_set_points\n");
+        return 1;
+    }
+    if (check_centroids(num_centroids, context->dim) != 0) {
+        return 1;
+    }
+    if (num_centroids > context->total_num_points) {
+        fprintf(stderr, "%u centroids for %u points\n", num_centroids, context->total_num_points);
+        return 1;
+    }
+    if (options->histogram && context->dim != 2) {
+        fprintf(stderr, "The histogram holds 2-D points, not %u coordinates\n", context->dim);
+        return 1;
+    }
+
+    if (context->nr_dpus == 0) {
+        run_kmeans_cpu(context->points, context->total_num_points, context->dim, centroids, num_centroids, labels, options, stats);
+        context->setup_start = -1;
+    } else if (run_kmeans_dpus(context, centroids, num_centroids, labels, options, stats) != 0) {
+        return 1;
+    }
+
+    memcpy(context->centroids, centroids, (size_t)num_centroids * context->dim * sizeof(int32_t));
+    context->num_centroids = num_centroids;
+    context->model_resident = 0;
+    return 0;
+}
+
+int kmeans_set_centroids(struct kmeans_context *context, const int32_t *centroids, uint32_t num_centroids, uint32_t dim) {
+    if (dim == 0 || dim > MAX_DIM || check_centroids(num_centroids, dim) != 0) {
+        return 1;
+    }
+    if (context->points != NULL && dim != context->dim) {
+        fprintf(stderr, "A model of %u coordinates for points of %u coordinates\n", dim, context->dim);
+        return 1;
+    }
+    context_set_dim(context, dim);
+    memcpy(context->centroids, centroids, (size_t)num_centroids * dim * sizeof(int32_t));
+    context->num_centroids = num_centroids;
+    context->model_resident = 0;
+    return 0;
+}
+
+/*
+    Label the points of a predict
+        DPUs: the queries replace the resident points and one assignment labels them. The
+        kernel and the model stay in WRAM, back to back predicts only push the queries and
+        their counts into the buffers the session keeps. More queries than the MRAM of the
+        DPUs holds are labelled in several launches.
+        CPU engine: one step of the engine over the queries
+    The predict times stay out of the stats of the next fit.
+*/
+int kmeans_predict(struct kmeans_context *context, uint8_t *points, uint32_t num_points, uint16_t *labels) {
+    uint32_t num_centroids = context->num_centroids;
+    uint32_t dim = context->dim;
+    if (num_centroids == 0) {
+        fprintf(stderr, "No model to predict with, see kmeans_fit and kmeans_set_centroids\n");
+        return 1;
+    }
+    if (num_points == 0) {
+        return 0;
+    }
+
+    double start = kmeans_wall_time();
+    if (context->nr_dpus == 0) {
+        uint32_t num_points_per_centroid[num_centroids];
+        uint64_t total_sum[num_centroids * dim];
+        int32_t centroids[num_centroids * dim];
+        memcpy(centroids, context->centroids, sizeof(centroids));
+        struct cpu_engine engine;
+        cpu_engine_init(&engine, points, num_points, dim);
+        cpu_engine_step(&engine, centroids, num_centroids, total_sum, num_points_per_centroid);
+        memcpy(labels, engine.labels, num_points * sizeof(uint16_t));
+        cpu_engine_free(&engine);
+        return 0;
+    }
+
+    struct dpu_session *session = &context->session;
+    double phase_start[KMEANS_NR_PHASES];
+    memcpy(phase_start, session->phase_time, sizeof(phase_start));
+    context->points_resident = 0;
+
+    // A batch larger than the MRAM of the DPUs takes several launches, each filling every DPU
+    uint64_t launch_points = (uint64_t)session->nr_dpus * (dpu_capacity(kmeans_dim_bucket(dim)) & ~3);
+    for (uint64_t first = 0; first < num_points; first += launch_points) {
+        uint32_t count = num_points - first < launch_points ? num_points - first : launch_points;
+        if (session_set_queries(session, &points[first * dim], count, dim) != 0) {
+            return 1;
+        }
+
+        // A load resets the WRAM, the model is then broadcast again padded to the dimension bucket
+        if (session->binary == NULL || strcmp(session->binary, context->nearest_binary) != 0) {
+            context->model_resident = 0;
+        }
+        session->bounded = 0;
+        session_load(session, context->nearest_binary);
+        if (!context->model_resident) {
+            uint32_t stride = session->stride;
+            int32_t centroid[num_centroids * stride];
+            memset(centroid, 0, sizeof(centroid));
+            for (uint32_t i = 0; i < num_centroids; i++) {
+                memcpy(&centroid[i * stride], &context->centroids[i * dim], dim * sizeof(int32_t));
+            }
+            session_broadcast_centroids(session, centroid, num_centroids);
+            context->model_resident = 1;
+        }
+        session_launch_assign(session);
+        session_read_labels(session);
+        memcpy(&labels[first], session->labels, count * sizeof(uint16_t));
+    }
+
+    for (int phase = 0; phase < KMEANS_NR_PHASES; phase++) {
+        context->phase_mark[phase] += session->phase_time[phase] - phase_start[phase];
+    }
+    if (context->setup_start >= 0) {
+        context->setup_start += kmeans_wall_time() - start;
+    }
+    return 0;
+}
+
+/*
+    Distances of num_queries queries to the training points of a context
+        DPUs: the training points are uploaded again after a predict, then every launch of the
+        distance kernel takes distance_batch queries. With k the candidates of the DPUs are
+        merged into the k nearest points of every query, indices and distances nearest first,
+        otherwise the launch fills the rows of its queries in the matrix of distances.
+        CPU engine: the same distances, ties and order, from every point
+    The times stay out of the stats of the next fit, like those of a predict.
+    Returns 1 when the training points cannot be uploaded again, 0 otherwise.
+*/
+static int run_distances(struct kmeans_context *context, const uint8_t *queries, uint32_t num_queries, uint32_t k, uint32_t *indices,
+                          uint32_t *distances) {
+    uint32_t total_num_points = context->total_num_points;
+    uint32_t dim = context->dim;
+
+    if (context->nr_dpus == 0) {
+        #pragma omp parallel for schedule(dynamic)
+        for (uint32_t q = 0; q < num_queries; q++) {
+            const uint8_t *query = &queries[(size_t)q * dim];
+            struct knn_candidate heap[k != 0 ? k : 1];
+            for (uint32_t c = 0; c < k; c++) {
+                heap[c].distance = UINT32_MAX;
+                heap[c].index = UINT32_MAX;
+            }
+            for (uint32_t i = 0; i < total_num_points; i++) {
+                uint32_t distance = query_distance(&context->points[(size_t)i * dim], query, dim);
+                if (k == 0) {
+                    distances[(size_t)q * total_num_points + i] = distance;
+                } else if (distance <= heap[0].distance) {
+                    struct knn_candidate candidate = { distance, i };
+                    heap_offer(heap, k, candidate);
+                }
+            }
+            if (k != 0) {
+                heap_sort(heap, k, &indices[(size_t)q * k], &distances[(size_t)q * k]);
+            }
+        }
+        return 0;
+    }
+
+    struct dpu_session *session = &context->session;
+    double start = kmeans_wall_time();
+    double phase_start[KMEANS_NR_PHASES];
+    memcpy(phase_start, session->phase_time, sizeof(phase_start));
+    if (!context->points_resident) {
+        if (session_set_points(session, context->points, total_num_points, dim) != 0) {
+            return 1;
+        }
+        context->points_resident = 1;
+        context->labels_assigned = 0;
+    }
+    session_load(session, context->matrix_binary);
+
+    uint32_t pitch = session->num_points_per_dpu;
+    uint32_t batch = distance_batch(session->stride, k, pitch);
+    struct knn_candidate *heaps = NULL;
+    uint32_t *scratch = NULL;
+    if (k != 0) {
+        heaps = malloc((size_t)batch * k * sizeof(struct knn_candidate));
+        assert(heaps != NULL);
+    } else {
+        scratch = malloc((size_t)pitch * 2 * sizeof(uint32_t));
+        assert(scratch != NULL);
+    }
+
+    for (uint32_t first = 0; first < num_queries; first += batch) {
+        uint32_t count = num_queries - first < batch ? num_queries - first : batch;
+        session_broadcast_queries(session, &queries[(size_t)first * dim], count, k);
+        double launch = kmeans_wall_time();
+        DPU_ASSERT(dpu_launch(session->set, DPU_SYNCHRONOUS));
+        phase_end(session->phase_time, KMEANS_PHASE_LAUNCH, launch);
+
+        if (k == 0) {
+            session_fetch_rows(session, count, &distances[(size_t)first * total_num_points], scratch);
+            continue;
+        }
+        session_merge_candidates(session, count, k, heaps);
+        double reduce = kmeans_wall_time();
+        for (uint32_t q = 0; q < count; q++) {
+            heap_sort(&heaps[q * k], k, &indices[(size_t)(first + q) * k], &distances[(size_t)(first + q) * k]);
+        }
+        phase_end(session->phase_time, KMEANS_PHASE_REDUCE, reduce);
+    }
+    free(heaps);
+    free(scratch);
+
+    for (int phase = 0; phase < KMEANS_NR_PHASES; phase++) {
+        context->phase_mark[phase] += session->phase_time[phase] - phase_start[phase];
+    }
+    if (context->setup_start >= 0) {
+        context->setup_start += kmeans_wall_time() - start;
+    }
+    return 0;
+}
+
+int kmeans_distances(struct kmeans_context *context, const uint8_t *queries, uint32_t num_queries, uint32_t *distances) {
+    if (context->points == NULL) {
+        fprintf(stderr, "No points to measure against, see kmeans_set_points\n");
+        return 1;
+    }
+    return run_distances(context, queries, num_queries, 0, NULL, distances);
+}
+
+int kmeans_knn(struct kmeans_context *context, const uint8_t *queries, uint32_t num_queries, uint32_t k, uint32_t *indices,
+               uint32_t *distances) {
+    if (context->points == NULL) {
+        fprintf(stderr, "No points to search, see kmeans_set_points\n");
+        return 1;
+    }
+    if (k == 0 || k > KNN_MAX_CANDIDATES || k > context->total_num_points) {
+        fprintf(stderr, "Invalid neighbours: %u of %u points (at most %u)\n", k, context->total_num_points, KNN_MAX_CANDIDATES);
+        return 1;
+    }
+    return run_distances(context, queries, num_queries, k, indices, distances);
+}
+
+void kmeans_run(uint8_t *points, uint32_t total_num_points, uint32_t dim, int32_t *centroids, uint32_t num_centroids,
+                uint16_t *labels, const struct kmeans_options *options, struct kmeans_stats *stats) {
+    struct kmeans_context *context = kmeans_create(options->nr_dpus, NULL);
+    if (context == NULL) {
+        fprintf(stderr, "Cannot allocate %u DPUs\n", options->nr_dpus);
+        exit(EXIT_FAILURE);
+    }
+    if (kmeans_set_points(context, points, total_num_points, dim) != 0 ||
+        kmeans_fit(context, centroids, num_centroids, labels, options, stats) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    kmeans_destroy(context);
+}
+
+// Pick random points as the initial centroids, dim Q16.16 coordinates each
+void kmeans_generate_centroids(int32_t *centroids, uint32_t num_centroids, uint8_t *points, uint32_t total_num_points, uint32_t dim) {
+    for (uint32_t i = 0; i < num_centroids; i++){
+        // Generate random centroids index
+        uint32_t index = rand() % total_num_points;
+        for (uint32_t d = 0; d < dim; d++) {
+            centroids[i * dim + d] = points[(size_t)index * dim + d] << FIXED_SHIFT;
+        }
+    }
+}
+
+/* One batch of a dataset file, read on its own thread while the previous batch is processed */
+struct batch_read {
+    FILE *file;
+    uint8_t *batch;         // batch_points * dim coordinates
+    uint32_t batch_points;
+    uint32_t dim;
+    uint32_t count;         // Points read, 0 at the end of the file
+    double time;            // Seconds spent reading
+};
+
+// Read the next batch, a partial point at the end of the file is dropped
+static void *read_batch(void *arg) {
+    struct batch_read *read = arg;
+    double start = kmeans_wall_time();
+    read->count = fread(read->batch, read->dim, read->batch_points, read->file);
+    if (ferror(read->file)) {
+        perror("fread");
+        exit(EXIT_FAILURE);
+    }
+    read->time += kmeans_wall_time() - start;
+    return NULL;
+}
+
+/*
+    Move every centroid towards the mean of its points in a batch with the per cluster learning
+    rate n / N of mini-batch k-means, n points of the cluster in the batch and N in all batches
+    so far. A centroid so stays the running mean of every point assigned to it, rounded to
+    Q16.16, and the first batch of a cluster moves it to the batch mean.
+    Returns the largest squared distance a centroid moved, in Q32.32
+*/
+static int64_t update_centroids_minibatch(int32_t *centroids, const uint64_t *total_sum, const uint32_t *num_points_per_centroid, uint64_t *seen,
+                                          uint32_t num_centroids, uint32_t stride) {
+    int64_t max_shift = 0;
+    for (uint32_t i = 0; i < num_centroids; i++) {
+        int64_t count = num_points_per_centroid[i];
+        if (count == 0) {
+            continue;
+        }
+        seen[i] += count;
+        int64_t total = seen[i];
+        int64_t shift = 0;
+        for (uint32_t d = 0; d < stride; d++) {
+            int64_t delta = ((int64_t)total_sum[i * stride + d] << FIXED_SHIFT) - count * centroids[i * stride + d];
+            int64_t step = delta >= 0 ? (delta + total / 2) / total : -((-delta + total / 2) / total);
+            centroids[i * stride + d] += step;
+            shift += step * step;
+        }
+        if (shift > max_shift) {
+            max_shift = shift;
+        }
+    }
+    return max_shift;
+}
+
+/*
+    Mini-batch k-means over a dataset file larger than the host memory or the MRAM
+        1. Read batch_points points at a time after the header, the next batch is read on a second thread while
+           the current one is on the DPUs, or on the CPU engine without DPUs
+        2. Per batch assign the labels and sum the clusters with the kernels of kmeans_run,
+           the batch replaces the points of the previous one in MRAM
+        3. Move the centroids with update_centroids_minibatch
+    The kernels are read from binary_dir, the working directory when NULL.
+    Runs at most options->iterations + 1 passes over the file, and stops after a pass that moved
+    no centroid farther than options->tolerance. The host holds two batches, the MRAM one.
+    options->bounded, histogram and plusplus must be 0.
+    The initial centroids are random points of the first batch, centroids receives the final
+    num_centroids * dim Q16.16 coordinates, dim must match the header. Returns 0 on success.
+*/
+int kmeans_run_minibatch(const char *path, uint32_t dim, uint32_t num_centroids, uint32_t batch_points, unsigned seed, const char *binary_dir,
+                         const struct kmeans_options *options, int32_t *centroids, uint64_t *num_points, struct kmeans_stats *stats) {
+    int use_dpus = options->nr_dpus != 0;
+    uint32_t stride = use_dpus ? kmeans_dim_bucket(dim) : dim;
+    uint32_t num_points_per_centroid[num_centroids];
+    uint64_t total_sum[num_centroids * stride];
+    uint64_t seen[num_centroids];
+    int32_t centroid[num_centroids * stride];
+
+    // The kernels come from binary_dir like those of a context
+    if (binary_dir != NULL && strlen(binary_dir) >= KERNEL_DIR_SIZE) {
+        fprintf(stderr, "Kernel directory longer than %d characters: %s\n", KERNEL_DIR_SIZE - 1, binary_dir);
+        return 1;
+    }
+    if (binary_dir == NULL) {
+        binary_dir = ".";
+    }
+
+    // Every batch replaces the points in MRAM, bounds, a histogram or seeds would be of the last one
+    if (options->bounded || options->histogram || options->plusplus) {
+        fprintf(stderr, "Mini-batch k-means runs without bounds, histogram or k-means++ seeding\n");
+        return 1;
+    }
+
+    FILE *file = fopen(path, "rb");
+    struct dataset_header header;
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+    if (dataset_read_header(file, path, &header) != 0 || header.dim != dim) {
+        fclose(file);
+        return 1;
+    }
+    memset(stats, 0, sizeof(*stats));
+    double start = kmeans_wall_time();
+
+    // Two batch buffers, one is processed while the other is read
+    struct batch_read reads[2];
+    for (int b = 0; b < 2; b++) {
+        reads[b].file = file;
+        reads[b].batch = malloc((size_t)batch_points * dim);
+        reads[b].batch_points = batch_points;
+        reads[b].dim = dim;
+        reads[b].time = 0;
+        assert(reads[b].batch != NULL);
+    }
+    read_batch(&reads[0]);
+    if (reads[0].count < num_centroids) {
+        fprintf(stderr, "%s: the first batch holds %u points, fewer than %u centroids\n", path, reads[0].count, num_centroids);
+        fclose(file);
+        free(reads[0].batch);
+        free(reads[1].batch);
+        return 1;
+    }
+
+    // The initial centroids padded to the dimension bucket, the extra coordinates stay zero
+    int32_t initial_centroids[num_centroids * dim];
+    srand(seed);
+    kmeans_generate_centroids(initial_centroids, num_centroids, reads[0].batch, reads[0].count, dim);
+    memset(centroid, 0, sizeof(centroid));
+    memset(seen, 0, sizeof(seen));
+    for (uint32_t i = 0; i < num_centroids; i++) {
+        memcpy(&centroid[i * stride], &initial_centroids[i * dim], dim * sizeof(int32_t));
+    }
+
+    char nearest_binary[KERNEL_PATH_SIZE];
+    char avg_binary[KERNEL_PATH_SIZE];
+    kernel_binary(nearest_binary, sizeof(nearest_binary), binary_dir, NEAREST_CENTROID, stride);
+    kernel_binary(avg_binary, sizeof(avg_binary), binary_dir, AVG_COORDINATE, stride);
+    struct dpu_session session;
+    int failed = 0;
+    if (use_dpus) {
+        DPU_ASSERT(session_init(&session, options->nr_dpus));
+        failed = session_set_points(&session, reads[0].batch, reads[0].count, dim) != 0;
+        session.async = options->async;
+        memcpy(stats->setup_phase_time, session.phase_time, sizeof(session.phase_time));
+    }
+    double setup = kmeans_wall_time();
+
+    *num_points = 0;
+    stats->converged = 0;
+    for (int pass = 0; pass <= options->iterations && !stats->converged && !failed; pass++) {
+        int cur = 0;
+        int64_t max_shift = 0;
+        if (pass > 0) {
+            fseek(file, DATASET_HEADER_SIZE, SEEK_SET);
+            read_batch(&reads[0]);
+        }
+
+        for (int first = 1; reads[cur].count != 0; first = 0) {
+            // Read the next batch while this one is processed
+            pthread_t reader;
+            if (pthread_create(&reader, NULL, read_batch, &reads[1 - cur]) != 0) {
+                fprintf(stderr, "Cannot start the batch reader\n");
+                exit(EXIT_FAILURE);
+            }
+
+            // A batch that does not fit stops the run, the reader is done with the other buffer first
+            if (use_dpus && !(pass == 0 && first) && session_set_points(&session, reads[cur].batch, reads[cur].count, dim) != 0) {
+                pthread_join(reader, NULL);
+                failed = 1;
+                break;
+            }
+
+            if (use_dpus) {
+                session_load(&session, nearest_binary);
+                session_assign(&session, centroid, num_centroids);
+                session_load(&session, avg_binary);
+                session_cluster_sums(&session, num_centroids, total_sum, num_points_per_centroid);
+            } else {
+                struct cpu_engine engine;
+                cpu_engine_init(&engine, reads[cur].batch, reads[cur].count, dim);
+                cpu_engine_step(&engine, centroid, num_centroids, total_sum, num_points_per_centroid);
+                cpu_engine_free(&engine);
+            }
+
+            int64_t shift = update_centroids_minibatch(centroid, total_sum, num_points_per_centroid, seen, num_centroids, stride);
+            if (shift > max_shift) {
+                max_shift = shift;
+            }
+            *num_points += reads[cur].count;
+
+            pthread_join(reader, NULL);
+            cur = 1 - cur;
+        }
+        if (failed) {
+            break;
+        }
+
+        if (options->verbose) {
+            printf("Pass %d: largest centroid shift %f\n", pass, sqrt((double)max_shift) / FIXED_ONE);
+        }
+        double tolerance = options->tolerance * FIXED_ONE;
+        stats->iterations = pass + 1;
+        stats->converged = tolerance >= 0 && max_shift <= tolerance * tolerance;
+    }
+    double end = kmeans_wall_time();
+
+    for (uint32_t i = 0; i < num_centroids; i++) {
+        memcpy(&centroids[i * dim], &centroid[i * stride], dim * sizeof(int32_t));
+    }
+    stats->setup_time = setup - start;
+    stats->total_time = end - start;
+    stats->read_time = reads[0].time + reads[1].time;
+    if (use_dpus) {
+        stats->nr_dpus = session.nr_dpus;
+        stats->nr_ranks = session.nr_ranks;
+        memcpy(stats->phase_time, session.phase_time, sizeof(session.phase_time));
+        session_free(&session);
+    }
+
+    fclose(file);
+    free(reads[0].batch);
+    free(reads[1].batch);
+    return failed;
+}
+
+/* The jobs of kmeans_run_jobs, shared by the threads of the groups */
+struct job_queue {
+    struct kmeans_job *jobs;
+    uint32_t *order;                // Job indices, largest first
+    uint32_t nr_jobs;
+    uint32_t next;                  // Next entry of order to hand out
+    pthread_mutex_t lock;
+    const char *binary_dir;
+    struct kmeans_options options;
+    double start;
+};
+
+/* A group of DPUs and the thread that runs its jobs */
+struct job_group {
+    struct job_queue *queue;
+    struct dpu_set_t set;           // A rank or the whole set, borrowed from kmeans_run_jobs
+    int use_dpus;                   // Without DPUs the group runs the CPU engine
+    int per_dpu;                    // The rank fits a job per DPU in the same launches
+    uint32_t first_dpu;             // Index of the first DPU of the group in the whole set
+    uint32_t id;
+};
+
+/* A job and its work per pass, to hand out the largest jobs first */
+struct job_cost {
+    uint64_t cost;
+    uint32_t index;
+};
+
+static int compare_job_cost(const void *a, const void *b) {
+    const struct job_cost *x = a;
+    const struct job_cost *y = b;
+    if (x->cost != y->cost) {
+        return x->cost < y->cost ? 1 : -1;
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+/*
+    Take the next jobs of the queue, at most max_jobs of them and all of the dimension bucket
+    of the first one. Returns how many jobs indices receives, 0 once the queue is empty.
+*/
+static uint32_t queue_take(struct job_queue *queue, uint32_t *indices, uint32_t max_jobs) {
+    uint32_t count = 0;
+    pthread_mutex_lock(&queue->lock);
+    while (count < max_jobs && queue->next < queue->nr_jobs) {
+        uint32_t index = queue->order[queue->next];
+        if (count != 0 && kmeans_dim_bucket(queue->jobs[index].dim) != kmeans_dim_bucket(queue->jobs[indices[0]].dim)) {
+            break;
+        }
+        indices[count++] = index;
+        queue->next++;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+// Push the centroid count of its job to every DPU, 0 for a DPU without one
+static void session_push_job_counts(struct dpu_session *session, uint32_t *num_centroids) {
+    struct dpu_set_t dpu;
+    uint32_t each_dpu;
+
+    double start = kmeans_wall_time();
+    DPU_FOREACH(session->set, dpu, each_dpu){
+        DPU_ASSERT(dpu_prepare_xfer(dpu, &num_centroids[each_dpu]));
+    }
+    DPU_ASSERT(dpu_push_xfer(session->set, DPU_XFER_TO_DPU, "num_centroids", 0, sizeof(uint32_t), DPU_XFER_DEFAULT));
+    phase_end(session->phase_time, KMEANS_PHASE_TO_DPU, start);
+}
+
+/*
+    Push the centroids of its job to every DPU, with their squared norms like
+    session_broadcast_centroids. The centroids of a DPU start MAX_CENTROID_VALUES apart, the
+    transfers take max_centroids of them, the most of any job.
+*/
+static void session_push_job_centroids(struct dpu_session *session, int32_t *centroids, uint32_t *num_centroids, uint32_t max_centroids) {
+    struct dpu_set_t dpu;
+    uint32_t each_dpu;
+    int64_t *norms = calloc((size_t)session->nr_dpus * max_centroids, sizeof(int64_t));
+    assert(norms != NULL);
+
+    double start = kmeans_wall_time();
+    for (uint32_t j = 0; j < session->nr_dpus; j++) {
+        const int32_t *centroid = &centroids[(size_t)j * MAX_CENTROID_VALUES];
+        for (uint32_t i = 0; i < num_centroids[j]; i++) {
+            for (uint32_t d = 0; d < session->stride; d++) {
+                norms[(size_t)j * max_centroids + i] += (int64_t)centroid[i * session->stride + d] * centroid[i * session->stride + d];
+            }
+        }
+    }
+    phase_end(session->phase_time, KMEANS_PHASE_REDUCE, start);
+
+    session_push_job_counts(session, num_centroids);
+    start = kmeans_wall_time();
+    DPU_FOREACH(session->set, dpu, each_dpu){
+        DPU_ASSERT(dpu_prepare_xfer(dpu, &centroids[(size_t)each_dpu * MAX_CENTROID_VALUES]));
+    }
+    DPU_ASSERT(dpu_push_xfer(session->set, DPU_XFER_TO_DPU, "centroids", 0, max_centroids * session->stride * sizeof(int32_t), DPU_XFER_DEFAULT));
+    DPU_FOREACH(session->set, dpu, each_dpu){
+        DPU_ASSERT(dpu_prepare_xfer(dpu, &norms[(size_t)each_dpu * max_centroids]));
+    }
+    DPU_ASSERT(dpu_push_xfer(session->set, DPU_XFER_TO_DPU, "centroid_norms", 0, max_centroids * sizeof(int64_t), DPU_XFER_DEFAULT));
+    phase_end(session->phase_time, KMEANS_PHASE_TO_DPU, start);
+    free(norms);
+}
+
+// Called once the rank finished the average coordinate kernel of a batch of jobs, the sums stay per DPU
+static dpu_error_t job_sums_rank_done(struct dpu_set_t rank, uint32_t rank_id, void *arg) {
+    struct dpu_session *session = arg;
+    struct dpu_set_t dpu;
+    uint32_t each_dpu;
+
+    double start = kmeans_wall_time();
+    DPU_FOREACH(rank, dpu, each_dpu){
+        DPU_ASSERT(dpu_prepare_xfer(dpu, &session->dpu_sums[(size_t)each_dpu * MAX_CENTROID_VALUES]));
+    }
+    DPU_ASSERT(dpu_push_xfer(rank, DPU_XFER_FROM_DPU, "sums", 0, session->num_centroids * session->stride * sizeof(uint32_t), DPU_XFER_DEFAULT));
+    DPU_FOREACH(rank, dpu, each_dpu){
+        DPU_ASSERT(dpu_prepare_xfer(dpu, &session->dpu_counts[(size_t)each_dpu * MAX_CENTROIDS]));
+    }
+    DPU_ASSERT(dpu_push_xfer(rank, DPU_XFER_FROM_DPU, "counts", 0, session->num_centroids * sizeof(uint32_t), DPU_XFER_DEFAULT));
+    phase_end(&session->rank_phase_time[(size_t)rank_id * KMEANS_NR_PHASES], KMEANS_PHASE_FROM_DPU, start);
+    return DPU_OK;
+}
+
+/*
+    Fit count jobs of the same dimension bucket on the DPUs of a rank, one job per DPU
+        1. The points of every job go to its own DPU, zero padded to the slice of the largest job
+        2. Per pass every DPU gets the centroids of its job, one launch of the rank assigns all
+           the jobs and one sums all their clusters, then the host moves the centroids of every
+           job that is not converged yet
+        3. A converged job keeps its centroids, its DPU assigns the same labels again until the
+           last job of the batch is done
+    The SDK serializes the operations on a rank, so the DPUs of a rank only compute side by side
+    within one launch. The jobs assign without bounds and share the phase times of the batch.
+*/
+static void run_job_batch(struct kmeans_context *context, struct kmeans_job *jobs, const uint32_t *indices, uint32_t count,
+                          const struct kmeans_options *options, uint32_t first_dpu, double queue_start) {
+    struct dpu_session *session = &context->session;
+    uint32_t nr_dpus = session->nr_dpus;
+    uint32_t stride = kmeans_dim_bucket(jobs[indices[0]].dim);
+    double start = kmeans_wall_time();
+    double phase_start[KMEANS_NR_PHASES];
+    memcpy(phase_start, session->phase_time, sizeof(phase_start));
+    kernel_binary(context->nearest_binary, KERNEL_PATH_SIZE, context->binary_dir, NEAREST_CENTROID, stride);
+    kernel_binary(context->avg_binary, KERNEL_PATH_SIZE, context->binary_dir, AVG_COORDINATE, stride);
+
+    // A job that does not fit its DPU fails alone, its DPU holds no point
+    struct kmeans_job *job_of[nr_dpus];
+    uint32_t num_centroids[nr_dpus];
+    int active[nr_dpus];
+    int assigned[nr_dpus];              // The labels in MRAM follow the centroids of the job
+    uint32_t slice = 0;
+    uint32_t max_centroids = 0;
+    for (uint32_t j = 0; j < nr_dpus; j++) {
+        struct kmeans_job *job = j < count ? &jobs[indices[j]] : NULL;
+        job_of[j] = NULL;
+        num_centroids[j] = 0;
+        active[j] = 0;
+        assigned[j] = 0;
+        if (job == NULL) {
+            continue;
+        }
+        job->group = first_dpu + j;
+        job->start = start - queue_start;
+        job->status = 1;
+        if (job->num_points == 0 || job->dim == 0 || job->dim > MAX_DIM || job->num_points > dpu_capacity(stride) ||
+            job->num_centroids > job->num_points) {
+            fprintf(stderr, "Invalid job: %u points of %u coordinates and %u centroids, a DPU holds at most %u points\n", job->num_points,
+                    job->dim, job->num_centroids, dpu_capacity(stride));
+            continue;
+        }
+        if (check_centroids(job->num_centroids, job->dim) != 0) {
+            continue;
+        }
+        job_of[j] = job;
+        num_centroids[j] = job->num_centroids;
+        active[j] = 1;
+        memset(&job->stats, 0, sizeof(job->stats));
+        if (((job->num_points + 3) & ~3) > slice) {
+            slice = (job->num_points + 3) & ~3;
+        }
+        if (job->num_centroids > max_centroids) {
+            max_centroids = job->num_centroids;
+        }
+    }
+    if (slice == 0) {
+        return;
+    }
+
+    // The points of every job at the start of the slice of its DPU, padded to the dimension bucket
+    uint8_t *points = calloc((size_t)nr_dpus * slice, stride);
+    int32_t *centroid = calloc((size_t)nr_dpus * MAX_CENTROID_VALUES, sizeof(int32_t));
+    assert(points != NULL && centroid != NULL);
+    for (uint32_t j = 0; j < nr_dpus; j++) {
+        struct kmeans_job *job = job_of[j];
+        for (uint32_t i = 0; job != NULL && i < job->num_points; i++) {
+            memcpy(&points[((size_t)j * slice + i) * stride], &job->points[(size_t)i * job->dim], job->dim);
+        }
+        for (uint32_t i = 0; job != NULL && i < job->num_centroids; i++) {
+            memcpy(&centroid[(size_t)j * MAX_CENTROID_VALUES + i * stride], &job->centroids[i * job->dim], job->dim * sizeof(int32_t));
+        }
+    }
+    session_split_points(session, points, nr_dpus * slice, stride);
+    for (uint32_t j = 0; j < nr_dpus; j++) {
+        session->num_points[j] = job_of[j] != NULL ? job_of[j]->num_points : 0;
+    }
+    for (size_t i = 0; i < (size_t)nr_dpus * slice; i++) {
+        session->labels[i] = UINT16_MAX;
+    }
+    session_upload(session);
+    if (session->binary != NULL) {
+        session_push_counts(session);
+    }
+    session->bounded = 0;
+    session->async = 0;
+    double setup = kmeans_wall_time();
+
+    // The first pass followed by the refinement iterations, until every job converged
+    uint64_t total_sum[MAX_CENTROID_VALUES];
+    uint32_t nr_active = 0;
+    for (uint32_t j = 0; j < nr_dpus; j++) {
+        nr_active += active[j];
+    }
+    for (int iter = 0; iter <= options->iterations && nr_active != 0; iter++) {
+        session_load(session, context->nearest_binary);
+        session_push_job_centroids(session, centroid, num_centroids, max_centroids);
+        session_launch_assign(session);
+        for (uint32_t j = 0; j < nr_dpus; j++) {
+            assigned[j] = job_of[j] != NULL;
+            if (!active[j]) {
+                continue;
+            }
+            job_of[j]->stats.iterations = iter + 1;
+            // No label changed, so the centroids already are the means of their clusters
+            if (iter > 0 && session->dpu_changed[j] == 0) {
+                job_of[j]->stats.converged = 1;
+                active[j] = 0;
+                nr_active--;
+            }
+        }
+        if (nr_active == 0) {
+            break;
+        }
+
+        session_load(session, context->avg_binary);
+        session_push_job_counts(session, num_centroids);
+        session->num_centroids = max_centroids;
+        session_launch(session, job_sums_rank_done);
+
+        double reduce = kmeans_wall_time();
+        for (uint32_t j = 0; j < nr_dpus; j++) {
+            if (!active[j]) {
+                continue;
+            }
+            for (uint32_t v = 0; v < num_centroids[j] * stride; v++) {
+                total_sum[v] = session->dpu_sums[(size_t)j * MAX_CENTROID_VALUES + v];
+            }
+            int64_t max_shift = update_centroids(&centroid[(size_t)j * MAX_CENTROID_VALUES], total_sum, &session->dpu_counts[(size_t)j * MAX_CENTROIDS],
+                                                 num_centroids[j], stride);
+            assigned[j] = 0;
+            if (converged(options, session->dpu_changed[j], job_of[j]->num_points, max_shift)) {
+                job_of[j]->stats.converged = 1;
+                active[j] = 0;
+                nr_active--;
+            }
+        }
+        phase_end(session->phase_time, KMEANS_PHASE_REDUCE, reduce);
+    }
+
+    session_read_labels(session);
+    for (uint32_t j = 0; j < nr_dpus; j++) {
+        if (job_of[j] != NULL && job_of[j]->labels != NULL) {
+            memcpy(job_of[j]->labels, &session->labels[(size_t)j * slice], job_of[j]->num_points * sizeof(uint16_t));
+        }
+    }
+
+    // The inertia comes with an assignment to the final centroids, one more unless every job has one
+    int reassign = 0;
+    for (uint32_t j = 0; j < nr_dpus; j++) {
+        reassign |= job_of[j] != NULL && !assigned[j];
+    }
+    if (options->inertia && reassign) {
+        session_load(session, context->nearest_binary);
+        session_push_job_centroids(session, centroid, num_centroids, max_centroids);
+        session_launch_assign(session);
+    }
+    double end = kmeans_wall_time();
+
+    for (uint32_t j = 0; j < nr_dpus; j++) {
+        struct kmeans_job *job = job_of[j];
+        if (job == NULL) {
+            continue;
+        }
+        for (uint32_t i = 0; i < job->num_centroids; i++) {
+            memcpy(&job->centroids[i * job->dim], &centroid[(size_t)j * MAX_CENTROID_VALUES + i * stride], job->dim * sizeof(int32_t));
+        }
+        if (options->inertia) {
+            job->stats.inertia = (double)session->dpu_inertia[j] / FIXED_ONE;
+        }
+        job->stats.nr_dpus = 1;
+        job->stats.nr_ranks = 1;
+        job->stats.setup_time = setup - start;
+        job->stats.total_time = end - start;
+        for (int phase = 0; phase < KMEANS_NR_PHASES; phase++) {
+            job->stats.phase_time[phase] = session->phase_time[phase] - phase_start[phase];
+        }
+        job->status = 0;
+        job->time = end - start;
+    }
+    free(points);
+    free(centroid);
+}
+
+/*
+    Take jobs from the queue until it is empty, one context per group keeps the kernels loaded
+    across jobs, and the points too when the next job clusters the same points, like restarts do.
+    A group of a job per DPU takes as many jobs as its rank has DPUs at once.
+*/
+static void *run_group(void *arg) {
+    struct job_group *group = arg;
+    struct job_queue *queue = group->queue;
+    struct kmeans_context *context = context_new(queue->binary_dir);
+    assert(context != NULL);
+    if (group->use_dpus) {
+        session_attach(&context->session, group->set, 1);
+        context->nr_dpus = context->session.nr_dpus;
+    }
+
+    uint32_t max_jobs = group->per_dpu ? context->nr_dpus : 1;
+    uint32_t indices[max_jobs];
+    for (;;) {
+        uint32_t count = queue_take(queue, indices, max_jobs);
+        if (count == 0) {
+            break;
+        }
+        if (group->per_dpu) {
+            run_job_batch(context, queue->jobs, indices, count, &queue->options, group->first_dpu, queue->start);
+            continue;
+        }
+
+        struct kmeans_job *job = &queue->jobs[indices[0]];
+        double start = kmeans_wall_time();
+        job->group = group->id;
+        job->start = start - queue->start;
+        int resident = context->points == job->points && context->total_num_points == job->num_points && context->dim == job->dim;
+        job->status = (!resident && kmeans_set_points(context, job->points, job->num_points, job->dim) != 0) ||
+                      kmeans_fit(context, job->centroids, job->num_centroids, job->labels, &queue->options, &job->stats) != 0;
+        job->time = kmeans_wall_time() - start;
+    }
+
+    kmeans_destroy(context);
+    return NULL;
+}
+
+/*
+    Run independent jobs on groups of DPUs at the same time
+        1. Allocate the DPUs once and split the set into ranks, each a session of its own that
+           borrows the DPUs of the set
+        2. Order the jobs by their work per pass, largest first
+        3. Start a thread per group, each takes the next job of the queue, uploads its points
+           and fits it, until the queue is empty
+    The SDK serializes the operations on a rank, so a rank is the smallest group that runs
+    concurrently with the others. With a job per DPU every rank takes a job for each of its
+    DPUs at once and fits them in the same launches, see run_job_batch, so small jobs that
+    would leave most of a rank idle run side by side.
+*/
+int kmeans_run_jobs(struct kmeans_job *jobs, uint32_t nr_jobs, uint32_t nr_dpus, enum kmeans_job_groups groups, const char *binary_dir,
+                    const struct kmeans_options *options, struct kmeans_schedule_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (binary_dir != NULL && strlen(binary_dir) >= KERNEL_DIR_SIZE) {
+        fprintf(stderr, "Kernel directory longer than %d characters: %s\n", KERNEL_DIR_SIZE - 1, binary_dir);
+        return 1;
+    }
+    if (nr_dpus != 0 && groups == KMEANS_JOB_GROUP_DPU && (options->bounded || options->histogram)) {
+        fprintf(stderr, "The jobs of a DPU each assign without bounds or histogram\n");
+        return 1;
+    }
+
+    // The groups share one set, a rank is allocated as a whole
+    double start = kmeans_wall_time();
+    struct dpu_set_t set;
+    struct dpu_set_t *sets = NULL;
+    uint32_t *first_dpus = NULL;
+    uint32_t nr_groups = 1;
+    if (nr_dpus != 0) {
+        if (dpu_alloc(nr_dpus, NULL, &set) != DPU_OK) {
+            fprintf(stderr, "Cannot allocate %u DPUs\n", nr_dpus);
+            return 1;
+        }
+        uint32_t nr_ranks;
+        DPU_ASSERT(dpu_get_nr_dpus(set, &stats->nr_dpus));
+        DPU_ASSERT(dpu_get_nr_ranks(set, &nr_ranks));
+        nr_groups = groups == KMEANS_JOB_GROUP_ALL ? 1 : nr_ranks;
+        sets = malloc(nr_groups * sizeof(struct dpu_set_t));
+        first_dpus = calloc(nr_groups, sizeof(uint32_t));
+        assert(sets != NULL && first_dpus != NULL);
+
+        struct dpu_set_t subset;
+        uint32_t each_subset;
+        if (groups != KMEANS_JOB_GROUP_ALL) {
+            uint32_t first_dpu = 0;
+            DPU_RANK_FOREACH(set, subset, each_subset){
+                uint32_t rank_dpus;
+                DPU_ASSERT(dpu_get_nr_dpus(subset, &rank_dpus));
+                sets[each_subset] = subset;
+                first_dpus[each_subset] = first_dpu;
+                first_dpu += rank_dpus;
+            }
+        } else {
+            sets[0] = set;
+        }
+    }
+    stats->alloc_time = kmeans_wall_time() - start;
+
+    // A group without a job would only idle, a rank of a job per DPU counts as one group per DPU
+    if (nr_groups > nr_jobs) {
+        nr_groups = nr_jobs;
+    }
+    stats->nr_groups = nr_dpus != 0 && groups == KMEANS_JOB_GROUP_DPU ? (stats->nr_dpus < nr_jobs ? stats->nr_dpus : nr_jobs) : nr_groups;
+
+    struct job_cost *costs = malloc(nr_jobs * sizeof(struct job_cost));
+    uint32_t *order = malloc(nr_jobs * sizeof(uint32_t));
+    struct job_group *group = malloc(nr_groups * sizeof(struct job_group));
+    pthread_t *threads = malloc(nr_groups * sizeof(pthread_t));
+    assert((costs && order && group && threads) || nr_jobs == 0);
+    for (uint32_t i = 0; i < nr_jobs; i++) {
+        costs[i].cost = (uint64_t)jobs[i].num_points * jobs[i].num_centroids * kmeans_dim_bucket(jobs[i].dim);
+        costs[i].index = i;
+        jobs[i].status = 1;
+    }
+    qsort(costs, nr_jobs, sizeof(struct job_cost), compare_job_cost);
+    for (uint32_t i = 0; i < nr_jobs; i++) {
+        order[i] = costs[i].index;
+    }
+
+    // Every job runs on its own, only the whole set has several ranks to pipeline
+    struct job_queue queue = { .jobs = jobs, .order = order, .nr_jobs = nr_jobs, .next = 0, .binary_dir = binary_dir, .options = *options };
+    queue.options.reload_per_launch = 0;
+    queue.options.async = options->async && groups == KMEANS_JOB_GROUP_ALL;
+    queue.options.plusplus = 0;
+    queue.options.seeds = NULL;
+    queue.options.verbose = 0;
+    queue.options.report = NULL;
+    pthread_mutex_init(&queue.lock, NULL);
+
+    queue.start = kmeans_wall_time();
+    for (uint32_t g = 0; g < nr_groups; g++) {
+        group[g].queue = &queue;
+        group[g].use_dpus = nr_dpus != 0;
+        group[g].per_dpu = nr_dpus != 0 && groups == KMEANS_JOB_GROUP_DPU;
+        group[g].first_dpu = 0;
+        group[g].id = g;
+        if (group[g].use_dpus) {
+            group[g].set = sets[g];
+            group[g].first_dpu = first_dpus[g];
+        }
+        if (pthread_create(&threads[g], NULL, run_group, &group[g]) != 0) {
+            fprintf(stderr, "Cannot start the thread of group %u\n", g);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (uint32_t g = 0; g < nr_groups; g++) {
+        pthread_join(threads[g], NULL);
+    }
+    stats->total_time = kmeans_wall_time() - queue.start;
+    pthread_mutex_destroy(&queue.lock);
+
+    for (uint32_t i = 0; i < nr_jobs; i++) {
+        if (jobs[i].status != 0) {
+            stats->failed++;
+            continue;
+        }
+        stats->points += jobs[i].num_points;
+        stats->point_passes += (uint64_t)jobs[i].num_points * jobs[i].stats.iterations;
+    }
+
+    if (nr_dpus != 0) {
+        DPU_ASSERT(dpu_free(set));
+    }
+    free(sets);
+    free(first_dpus);
+    free(costs);
+    free(order);
+    free(group);
+    free(threads);
+    return stats->failed != 0;
+}
+
+// Number of DPUs in a set allocated with DPU_ALLOCATE_ALL, 0 when there are none
+uint32_t kmeans_available_dpus(void) {
+    struct dpu_set_t set;
+    uint32_t nr_dpus;
+    if (dpu_alloc(DPU_ALLOCATE_ALL, NULL, &set) != DPU_OK) {
+        return 0;
+    }
+    DPU_ASSERT(dpu_get_nr_dpus(set, &nr_dpus));
+    DPU_ASSERT(dpu_free(set));
+    return nr_dpus;
+}
+
@@ -0,0 +1,213 @@
+#ifndef UPMEM_KMEANS_H
+#define UPMEM_KMEANS_H
+
+#include <stdint.h>
+
+/*
+    k-means on UPMEM DPUs as a library, kmeans.c is the command line on top of it
+
+        struct kmeans_context *context = kmeans_create(nr_dpus, NULL);
+        kmeans_set_points(context, points, num_points, dim);
+        kmeans_fit(context, centroids, num_centroids, labels, &options, &stats);
+        kmeans_predict(context, queries, num_queries, query_labels);
+        kmeans_destroy(context);
+
+    Points have dim uint8_t coordinates, centroids dim Q16.16 coordinates (see common.h).
+    The context owns its DPU set from kmeans_create to kmeans_destroy: the set is allocated
+    once, a kernel is only loaded again when another one ran in between, and the points stay
+    resident in MRAM across fits. A context created with 0 DPUs runs on the CPU engine.
+
+    Invalid arguments are rejected with a message on stderr and a nonzero return, errors of
+    the DPUs themselves abort through DPU_ASSERT.
+*/
+
+/*
+    Host phases, each timed with the monotonic clock
+        alloc         dpu_alloc
+        load          dpu_load of a kernel
+        to_dpu        points, labels, point counts and centroids pushed to the DPUs
+        launch        waiting for the kernels, the whole per rank pipeline when asynchronous
+        from_dpu      results and cycle counts copied back
+        host_reduce   merging the per DPU results and computing the new centroids
+    With asynchronous launches from_dpu and host_reduce overlap launch.
+*/
+enum kmeans_phase { KMEANS_PHASE_ALLOC, KMEANS_PHASE_LOAD, KMEANS_PHASE_TO_DPU, KMEANS_PHASE_LAUNCH, KMEANS_PHASE_FROM_DPU, KMEANS_PHASE_REDUCE, KMEANS_NR_PHASES };
+extern const char *kmeans_phase_names[KMEANS_NR_PHASES];
+
+/* How to run k-means on the DPUs */
+struct kmeans_options {
+    uint32_t nr_dpus;           // DPU count, DPU_ALLOCATE_ALL, or 0 for the CPU engine, the context decides for kmeans_fit
+    int iterations;             // Most refinement iterations after the first pass
+    double max_changed;         // Converged once at most this fraction of the labels changed in a pass
+    double tolerance;           // Converged once no centroid moved farther than this, in coordinate units
+    int reload_per_launch;      // Recreate the DPU set before every launch
+    int async;                  // Pipeline the transfers and host reductions with the launches per rank
+    int bounded;                // Skip the distances the Hamerly bounds rule out
+    int plusplus;               // Seed with k-means++ instead of the initial centroids
+    int32_t *seeds;             // Receives the k-means++ seeds, num_centroids * dim, unless NULL
+    int inertia;                // Compute the inertia of the final centroids, one more unbounded assignment unless an unbounded pass changed no label
+    int histogram;              // 2-D points only: iterate over the cells of their 256 x 256 occupancy histogram
+    int verbose;
+    const char *report;         // Per iteration JSON or CSV report written here unless NULL
+};
+
+/* Timings of one k-means run */
+struct kmeans_stats {
+    uint32_t nr_dpus;
+    uint32_t nr_ranks;
+    int iterations;                 // Passes run, the first pass included
+    int converged;                  // Stopped before the iteration limit
+    uint64_t skipped;               // Distances skipped by the bounds over all passes
+    double inertia;                 // Sum of the squared distances of the points to their nearest final centroid, with options->inertia
+    double setup_time;              // Alloc, load and first upload of the points, and the seeding
+    double seed_time;               // k-means++ seeding
+    double histogram_time;          // Counting the points into the histogram, part of the setup
+    uint32_t cells;                 // Occupied histogram cells the iterations ran over
+    double read_time;               // Reading the batches of a mini-batch run, overlapped with the DPUs
+    double total_time;              // Setup and all iterations
+    double phase_time[KMEANS_NR_PHASES]; // Whole run, setup included
+    double setup_phase_time[KMEANS_NR_PHASES];
+};
+
+struct kmeans_context;
+
+/*
+    Allocate nr_dpus DPUs, DPU_ALLOCATE_ALL for every available one, or none for the CPU engine
+    binary_dir is the directory of the kernel builds, the working directory when NULL.
+    Returns NULL when the DPUs cannot be allocated or binary_dir is too long.
+*/
+struct kmeans_context *kmeans_create(uint32_t nr_dpus, const char *binary_dir);
+
+// Free the DPUs and everything else the context holds
+void kmeans_destroy(struct kmeans_context *context);
+
+// DPUs of the context, 0 on the CPU engine
+uint32_t kmeans_nr_dpus(const struct kmeans_context *context);
+
+/*
+    Make num_points points of dim coordinates the training points and upload them to the DPUs
+    The points are not copied and must stay valid until the next kmeans_set_points or
+    kmeans_destroy. A model of another dimension is dropped. Returns 0 on success.
+*/
+int kmeans_set_points(struct kmeans_context *context, uint8_t *points, uint32_t num_points, uint32_t dim);
+
+/*
+    Run k-means over the training points
+    centroids holds num_centroids * dim Q16.16 coordinates, the initial centroids on entry
+    (ignored with options->plusplus) and the final ones on return, which also become the
+    model of kmeans_predict. labels receives the final label of every point unless it is NULL.
+    The setup in stats covers the allocation and uploads since the previous fit.
+    Returns 0 on success.
+*/
+int kmeans_fit(struct kmeans_context *context, int32_t *centroids, uint32_t num_centroids, uint16_t *labels,
+               const struct kmeans_options *options, struct kmeans_stats *stats);
+
+/*
+    Make num_centroids centroids of dim Q16.16 coordinates the model of kmeans_predict, for a
+    model trained elsewhere. Returns 0 on success.
+*/
+int kmeans_set_centroids(struct kmeans_context *context, const int32_t *centroids, uint32_t num_centroids, uint32_t dim);
+
+/*
+    Label num_points points of the model's dimension with their nearest centroid of the model
+    The points replace the training points in MRAM, the next fit uploads those again.
+    Returns 0 on success.
+*/
+int kmeans_predict(struct kmeans_context *context, uint8_t *points, uint32_t num_points, uint16_t *labels);
+
+/*
+    Squared distances between num_queries queries of the points' dimension and every training point
+    distances receives the num_queries * num_points matrix, a row of num_points distances per
+    query. The DPUs compute the matrix in tiles of the resident points and as many rows per
+    launch as their MRAM holds. The queries replace the model in WRAM, not the points in MRAM.
+    Returns 0 on success.
+*/
+int kmeans_distances(struct kmeans_context *context, const uint8_t *queries, uint32_t num_queries, uint32_t *distances);
+
+/*
+    The k training points nearest to each of num_queries queries, brute force on the DPUs
+    indices and distances receive num_queries * k values, nearest first and the lower index
+    first on a tie. Every DPU keeps a heap of k candidates per query in WRAM and only those
+    cross the bus, k is at most KNN_MAX_CANDIDATES (see common.h) and the queries are batched
+    to fit. Returns 0 on success.
+*/
+int kmeans_knn(struct kmeans_context *context, const uint8_t *queries, uint32_t num_queries, uint32_t k, uint32_t *indices,
+               uint32_t *distances);
+
+/*
+    One k-means run on its own context, allocated for the run and freed at the end
+    Same arguments as kmeans_fit, with the DPU count of options->nr_dpus. The setup covers the
+    allocation and the upload of the points.
+*/
+void kmeans_run(uint8_t *points, uint32_t total_num_points, uint32_t dim, int32_t *centroids, uint32_t num_centroids,
+                uint16_t *labels, const struct kmeans_options *options, struct kmeans_stats *stats);
+
+/*
+    Mini-batch k-means over a dataset file larger than the host memory or the MRAM
+    binary_dir is the directory of the kernel builds, the working directory when NULL.
+    See upmem_kmeans.c, returns 0 on success.
+*/
+int kmeans_run_minibatch(const char *path, uint32_t dim, uint32_t num_centroids, uint32_t batch_points, unsigned seed, const char *binary_dir,
+                         const struct kmeans_options *options, int32_t *centroids, uint64_t *num_points, struct kmeans_stats *stats);
+
+/* One independent clustering job of kmeans_run_jobs */
+struct kmeans_job {
+    uint8_t *points;            // num_points points of dim coordinates
+    uint32_t num_points;
+    uint32_t dim;
+    int32_t *centroids;         // num_centroids * dim Q16.16 coordinates, the initial ones on entry and the final ones on return
+    uint32_t num_centroids;
+    uint16_t *labels;           // Receives the final label of every point unless NULL
+    int status;                 // 0 once the job ran
+    uint32_t group;             // Group of DPUs that ran the job, its DPU with a job per DPU
+    double start;               // Seconds from the start of the schedule to the start of the job
+    double time;                // Upload and fit
+    struct kmeans_stats stats;
+};
+
+/* How kmeans_run_jobs splits the allocated DPUs, every group runs one job at a time */
+enum kmeans_job_groups {
+    KMEANS_JOB_GROUP_DPU,       // A job per DPU in launches of its whole rank, at most MAX_POINTS_PER_DPU
+                                // points, without bounds or histogram
+    KMEANS_JOB_GROUP_RANK,      // A group per rank
+    KMEANS_JOB_GROUP_ALL,       // A single group of every DPU, the jobs run one after the other
+};
+
+/* Aggregate of kmeans_run_jobs */
+struct kmeans_schedule_stats {
+    uint32_t nr_dpus;
+    uint32_t nr_groups;
+    uint32_t failed;            // Jobs with a nonzero status
+    uint64_t points;            // Points of the jobs that ran
+    uint64_t point_passes;      // Points times passes of the jobs that ran
+    double alloc_time;          // Allocating the DPUs and splitting them into groups
+    double total_time;          // From the first job to the end of the last one
+};
+
+/*
+    Run nr_jobs independent jobs of any size on nr_dpus DPUs split into groups
+    The groups run concurrently, each from a host thread of its own. The SDK serializes the
+    operations on a rank, so the DPUs of a rank run a job each through launches of the whole
+    rank that fit all its jobs, of the same dimension bucket, side by side. The largest jobs, by
+    points times centroids times the dimension bucket, are handed out first and every group
+    takes the next job as soon as it is done, so the groups finish close together. A group
+    keeps its kernels loaded from one job to the next of the same dimension bucket.
+    With 0 DPUs the jobs run one after the other on the CPU engine. options applies to every
+    job, except for its reloads, report and k-means++ seeding. Returns 0 when every job ran.
+*/
+int kmeans_run_jobs(struct kmeans_job *jobs, uint32_t nr_jobs, uint32_t nr_dpus, enum kmeans_job_groups groups, const char *binary_dir,
+                    const struct kmeans_options *options, struct kmeans_schedule_stats *stats);
+
+// Pick random points as the initial centroids, dim Q16.16 coordinates each
+void kmeans_generate_centroids(int32_t *centroids, uint32_t num_centroids, uint8_t *points, uint32_t total_num_points, uint32_t dim);
+
+// Smallest kernel dimension bucket that holds dim coordinates
+uint32_t kmeans_dim_bucket(uint32_t dim);
+
+// Number of DPUs in a set allocated with DPU_ALLOCATE_ALL, 0 when there are none
+uint32_t kmeans_available_dpus(void);
+
+// Wall clock time in seconds
+double kmeans_wall_time(void);
+
+#endif